@@ -43,8 +43,8 @@ void initData(PtpClock *ptpClock)
   /* other stuff */
   timerNow(&now);
   ptpClock->random_seed = ptpClock->port_uuid_field[PTP_UUID_LENGTH-1] ^
-      now.seconds ^
-      now.nanoseconds;
+      (UInteger32)(now / 1000000000) ^
+      (UInteger32)(now % 1000000000);
 }
 
 /* see spec table 18 */
@@ -52,10 +52,8 @@ void m1(PtpClock *ptpClock)
 {
   /* Default data set */
   ptpClock->steps_removed = 0;
-  ptpClock->offset_from_master.seconds = 0;
-  ptpClock->offset_from_master.nanoseconds = 0;
-  ptpClock->one_way_delay.seconds = 0;
-  ptpClock->one_way_delay.nanoseconds = 0;
+  ptpClock->offset_from_master = 0;
+  ptpClock->one_way_delay = 0;
   
   /* Parent data set */
   ptpClock->parent_communication_technology = ptpClock->clock_communication_technology;
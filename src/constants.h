@@ -14,11 +14,108 @@
 #define DEFAULT_INBOUND_LATENCY      0       /* in nsec */
 #define DEFAULT_OUTBOUND_LATENCY     0       /* in nsec */
 #define DEFAULT_NO_RESET_CLOCK       FALSE
+#define DEFAULT_STEP_THRESHOLD       1000000000LL
+#define DEFAULT_MAX_SLEW             ADJ_FREQ_MAX
 #define DEFAULT_NO_ADJUST_CLOCK      FALSE
 #define DEFAULT_AP                   10
 #define DEFAULT_AI                   1000
 #define DEFAULT_DELAY_S              6
+#define MAX_DELAY_S                  30
 #define DEFUALT_MAX_FOREIGN_RECORDS  5
+#define DEFAULT_RECV_BATCH           8
+#define DEFAULT_RECV_TIME_STORE      1024
+/* TIME_BOTH: NIC<->system time readings per measurement, measurements per second */
+#define DEFAULT_CROSS_SAMPLES        5
+#define DEFAULT_CROSS_RATE           1
+#define MAX_CROSS_SAMPLES            25
+#define MAX_CROSS_RATE               1000
+#define DEFAULT_SAMPLE_FILTER        FILTER_IIR
+/* (t1,t2) and (t3,t4) pairs kept by the window filters */
+#define DEFAULT_FILTER_WINDOW        8
+#define MAX_FILTER_WINDOW            64
+#define DEFAULT_FILTER_PERCENTILE    10
+/*
+ * outlier gate: samples farther than DEFAULT_GATE_SIGMA standard
+ * deviations from the running mean are dropped, at most
+ * DEFAULT_GATE_CONSECUTIVE in a row; deviations below GATE_MIN_DEV
+ * (nsec) always pass, statistics are averaged over 2^GATE_SHIFT samples
+ * and used after GATE_WARMUP samples
+ */
+#define DEFAULT_GATE_SIGMA           4
+#define DEFAULT_GATE_CONSECUTIVE     5
+#define GATE_MIN_DEV                 100
+#define GATE_SHIFT                   4
+#define GATE_WARMUP                  8
+/*
+ * Syncs used in PTP_UNCALIBRATED to estimate the frequency before the
+ * servo takes over, 0 = go to PTP_SLAVE directly; without a delay
+ * measurement calibration ends after MAX_CALIBRATION_FACTOR times as
+ * many Syncs. Smaller offsets (nsec) are not stepped.
+ */
+#define DEFAULT_CALIBRATION_SYNCS    4
+#define MAX_CALIBRATION_SYNCS        64
+#define MAX_CALIBRATION_FACTOR       4
+#define CALIBRATION_STEP_MIN         1000
+/*
+ * drift file: saved every DRIFT_FILE_INTERVAL seconds while slave,
+ * entries beyond MAX_DRIFT_FILE ppb are ignored, at most
+ * DRIFT_FILE_ENTRIES interfaces/time sources are kept
+ */
+#define DRIFT_FILE_INTERVAL          600
+#define MAX_DRIFT_FILE               500000
+#define DRIFT_FILE_ENTRIES           32
+/*
+ * holdover: the frequency is sampled every HOLDOVER_INTERVAL seconds
+ * while slave and at most HOLDOVER_MAX_OFFSET nsec off, the last
+ * HOLDOVER_HISTORY samples are kept. A linear aging model is fitted
+ * once they span HOLDOVER_AGING_SPAN seconds, before that the last
+ * HOLDOVER_AVERAGE samples are averaged.
+ */
+#define DEFAULT_HOLDOVER             3600
+#define HOLDOVER_INTERVAL            60
+#define HOLDOVER_MAX_OFFSET          100000
+#define HOLDOVER_HISTORY             240
+#define HOLDOVER_AGING_SPAN          3600
+#define HOLDOVER_AVERAGE             10
+#define DEFAULT_SERVO                SERVO_PI
+/* samples in the window of the linear regression servo */
+#define DEFAULT_SERVO_WINDOW         16
+#define MIN_SERVO_WINDOW             4
+#define MAX_SERVO_WINDOW             64
+/*
+ * adaptive PI servo: GAIN_STAGES sets of gains, each with twice the
+ * P and four times the I attenuation of the one before. A change waits
+ * for GAIN_AVERAGE samples (also the length of the averages); the
+ * next narrower stage is taken while the mean offset stays below
+ * GAIN_NARROW times its standard deviation, the next wider one above
+ * GAIN_WIDEN times; an offset beyond GAIN_RESET times goes back to
+ * the first stage right away.
+ */
+#define GAIN_STAGES                  4
+#define GAIN_AVERAGE                 16
+#define GAIN_NARROW                  0.5
+#define GAIN_WIDEN                   2.0
+#define GAIN_RESET                   8.0
+/*
+ * Kalman servo: process noise of offset (nsec^2/sec), frequency
+ * (ppb^2/sec) and path delay (nsec^2/sec), initial uncertainties,
+ * floor and weight of the online measurement noise estimate, and
+ * the offset uncertainty (nsec) below which it reports lock
+ */
+#define KALMAN_Q_OFFSET              100.0
+#define KALMAN_Q_FREQ                1.0
+#define KALMAN_Q_DELAY               100.0
+#define KALMAN_P0_OFFSET             1000000.0
+#define KALMAN_P0_FREQ               100000.0
+#define KALMAN_P0_DELAY              1000000.0
+#define KALMAN_R0                    1000000.0
+#define KALMAN_MIN_R                 100.0
+#define KALMAN_R_WEIGHT              0.05
+#define KALMAN_LOCK_OFFSET           1000.0
+
+/* polling for delayed send time stamps, in nsec */
+#define TX_TIMESTAMP_POLL_INTERVAL   100000
+#define TX_TIMESTAMP_TIMEOUT         500000000
 
 /* features, only change to refelect changes in implementation */
 #define CLOCK_FOLLOWUP    TRUE
@@ -48,12 +145,16 @@
 #define PTP_CODE_STRING_LENGTH              4
 #define PTP_SUBDOMAIN_NAME_LENGTH           16
 #define PTP_MAX_MANAGEMENT_PAYLOAD_SIZE     90
-/* no support for intervals less than one */
-#define PTP_SYNC_INTERVAL_TIMEOUT(x)        (1<<((x)<0?1:(x))) 
-#define PTP_SYNC_RECEIPT_TIMEOUT(x)         (10*(1<<((x)<0?0:(x))))
+/* timeouts are in nsec, sync intervals from 2^-7 sec up to 2^16 sec */
+#define PTP_MIN_SYNC_INTERVAL               (-7)
+#define PTP_MAX_SYNC_INTERVAL               16
+#define PTP_INTERVAL_NSEC(x)                ((x)<0 ? 1000000000LL>>-(x) : 1000000000LL<<(x))
+#define PTP_SYNC_INTERVAL_TIMEOUT(x)        PTP_INTERVAL_NSEC((x)<PTP_MIN_SYNC_INTERVAL?PTP_MIN_SYNC_INTERVAL: \
+                                                              (x)>PTP_MAX_SYNC_INTERVAL?PTP_MAX_SYNC_INTERVAL:(x))
+#define PTP_SYNC_RECEIPT_TIMEOUT(x)         (10*PTP_SYNC_INTERVAL_TIMEOUT(x))
 #define PTP_DELAY_REQ_INTERVAL              30
 #define PTP_FOREIGN_MASTER_THRESHOLD        2
-#define PTP_FOREIGN_MASTER_TIME_WINDOW(x)   (4*(1<<((x)<0?0:(x))))
+#define PTP_FOREIGN_MASTER_TIME_WINDOW(x)   (4*PTP_SYNC_INTERVAL_TIMEOUT(x))
 #define PTP_RANDOMIZING_SLOTS               18
 #define PTP_LOG_VARIANCE_THRESHOLD          256
 #define PTP_LOG_VARIANCE_HYSTERESIS         128
@@ -108,6 +209,8 @@ enum {
 /* enum used by this implementation */
 enum {
   SYNC_RECEIPT_TIMER=0, SYNC_INTERVAL_TIMER, QUALIFICATION_TIMER,
+  TX_TIMESTAMP_TIMER, CROSS_TIMESTAMP_TIMER, DRIFT_FILE_TIMER,
+  HOLDOVER_TIMER,
   TIMER_ARRAY_SIZE  /* these two are non-spec */
 };
 
@@ -8,17 +8,143 @@ typedef struct {
   Integer32 nanoseconds;  
 } TimeRepresentation;
 
-typedef struct {
-  Integer32 seconds;
-  Integer32 nanoseconds;  
-} TimeInternal;
+/**
+ * signed nanoseconds, for absolute times since the epoch and for
+ * differences; converted to and from TimeRepresentation in msg.c
+ */
+typedef Integer64 TimeInternal;
 
 typedef struct {
-  Integer32  interval;
-  Integer32  left;
+  Integer64  interval;  /* in nsec, zero while stopped */
+  Integer64  deadline;  /* next expiration (if not driven by fd) */
+  Integer32  fd;        /* becomes readable on expiration, see timer.c */
   Boolean expire;
 } IntervalTimer;
 
+/** a NIC receive time stamp waiting for its packet */
+typedef struct {
+  Boolean valid;
+  TimeInternal recvTimeStamp;
+  /** CLOCK_MONOTONIC nsec when read from the NIC, for expiry */
+  Integer64 arrival;
+  UInteger16 sequenceId;
+  Octet sourceUuid[PTP_UUID_LENGTH];
+} RecvTime;
+
+/**
+ * NIC receive time stamps hashed by (sourceUuid, sequenceId); a key
+ * lives in one of RECV_TIME_PROBES slots following its hash
+ */
+typedef struct {
+  RecvTime *entries;
+  Integer32 size;
+  /** valid entries overwritten by newer ones */
+  UInteger32 evictions;
+  /** lookups without entry */
+  UInteger32 misses;
+  /** lookups which found an entry older than RECV_TIME_MAX_AGE */
+  UInteger32 staleHits;
+} RecvTimeStore;
+
+/**
+ * the last send/receive time stamp pairs of one direction, from which
+ * the window filters of filter.c select the one passed to the servo
+ */
+typedef struct {
+  TimeInternal send[MAX_FILTER_WINDOW];
+  TimeInternal recv[MAX_FILTER_WINDOW];
+  /** AppliedPhase at the local time stamp of each pair */
+  TimeInternal phase[MAX_FILTER_WINDOW];
+  Integer16 count, next;
+} SampleWindow;
+
+/**
+ * phase correction of the clock (nsec) beyond the compensation of its
+ * frequency error, i.e. steps plus the integral of the applied
+ * frequency correction minus observed_drift: 'phase' at local time
+ * 'time', changing with 'rate' ppb since then
+ */
+typedef struct {
+  TimeInternal phase, time;
+  Integer32 rate;
+} AppliedPhase;
+
+/**
+ * sums for the least-squares frequency estimate of PTP_UNCALIBRATED:
+ * x = local receive time of a Sync (sec), y = master to slave delay
+ * (nsec), both relative to the first Sync
+ */
+typedef struct {
+  Integer16 syncs;
+  TimeInternal firstTime, firstDelay;
+  double sx, sy, sxx, sxy;
+} Calibration;
+
+/**
+ * frequency history of a slave and the model used for holdover when
+ * the master disappears, see holdover.c
+ */
+typedef struct {
+  /** monotonic time (nsec) and observed_drift (ppb) of the samples */
+  TimeInternal time[HOLDOVER_HISTORY];
+  Integer32 drift[HOLDOVER_HISTORY];
+  Integer16 count, next;
+  
+  Boolean active;
+  /** monotonic time when holdover started */
+  TimeInternal start;
+  /** offset from master when holdover started */
+  TimeInternal startOffset;
+  /** model: drift(t) = frequency + aging * (t - start), t in sec */
+  double frequency, aging;
+  /** standard deviation of the samples around the model, ppb */
+  double sigma;
+} Holdover;
+
+/**
+ * sample window of the linear regression clock servo: offsets are
+ * kept as 'phase', with the frequency corrections applied so far
+ * added back, so that they lie on a line whose slope is the frequency
+ * error of the free running clock
+ */
+typedef struct {
+  TimeInternal time[MAX_SERVO_WINDOW];
+  TimeInternal phase[MAX_SERVO_WINDOW];
+  Integer16 count, next;
+  /** integral of the frequency corrections since the last reset, in nsec */
+  TimeInternal correction;
+  /** the correction in effect since the newest sample, in ppb */
+  Integer32 adj;
+} ServoWindow;
+
+/**
+ * state of the adaptive PI servo: the current set of gains and the
+ * running mean and variance of the offsets it is chosen by
+ */
+typedef struct {
+  Integer16 stage;
+  /** samples since the last change of stage */
+  Integer16 samples;
+  double mean, variance;
+} ServoGain;
+
+/**
+ * state of the Kalman clock servo: estimates of offset (nsec),
+ * frequency error of the free running clock (ppb) and mean path delay
+ * (nsec) with their covariance, plus the measurement noise of both
+ * directions as estimated from the residuals
+ */
+typedef struct {
+  double x[3];
+  double P[3][3];
+  double R[2];
+  /** local time of the estimate, 0 before the first measurement */
+  TimeInternal time;
+  /** the correction in effect since then, in ppb */
+  Integer32 adj;
+  Boolean delayKnown;
+} ServoKalman;
+
 /* Message header */
 typedef struct {
   UInteger16  versionPTP;
@@ -36,7 +162,8 @@ typedef struct {
 
 /* Sync or Delay_Req message */
 typedef struct {
-  TimeRepresentation  originTimestamp;
+  TimeInternal  originTimestamp;
+  Boolean  halfEpoch;  /* originTimestamp was sent in the second half epoch */
   UInteger16  epochNumber;
   Integer16  currentUTCOffset;
   UInteger8  grandmasterCommunicationTechnology;
@@ -67,13 +194,15 @@ typedef MsgSync MsgDelayReq;
 /* Follow_Up message */
 typedef struct {
   UInteger16  associatedSequenceId;
-  TimeRepresentation  preciseOriginTimestamp;
+  TimeInternal  preciseOriginTimestamp;
+  Boolean  halfEpoch;
   
 } MsgFollowUp;
 
 /* Delay_Resp message */
 typedef struct {
-  TimeRepresentation  delayReceiptTimestamp;
+  TimeInternal  delayReceiptTimestamp;
+  Boolean  halfEpoch;
   UInteger8  requestingSourceCommunicationTechnology;
   Octet  requestingSourceUuid[PTP_UUID_LENGTH];
   UInteger16  requestingSourcePortId;
@@ -224,8 +353,9 @@ typedef enum {
    *
    * The command line options only apply to one clock sync and
    * the defaults are used for the other:
-   * - NIC time: default values for clock control (adjust and reset)
-   *   and servo (coefficients), configurable PTP
+   * - NIC time: default values for clock control (adjust, reset,
+   *   step threshold, slew limit) and servo (coefficients),
+   *   configurable PTP
    * - system time: configurable clock control and servo, PTP options do
    *   not apply
    */
@@ -246,10 +376,47 @@ typedef enum {
    * packet time stamping via standard Linux net_tstamp.h API.
    */
   TIME_SYSTEM_LINUX_SW,
+  /**
+   * Time used and controlled by PTP is a PTP hardware clock (PHC,
+   * /dev/ptpN) driven through the dynamic POSIX clock API, with
+   * packet time stamping by the NIC via net_tstamp.h. CLOCK_REALTIME
+   * with software time stamping can stand in for the PHC.
+   */
+  TIME_PHC,
+  /**
+   * Virtual clock for replaying a capture (-V): all time stamps and
+   * clock readings come from the capture file, see capture.c.
+   */
+  TIME_REPLAY,
+  /**
+   * Simulated oscillator running on timerMonotonic(), for the network
+   * simulator ptpsim which also provides network and timers.
+   */
+  TIME_SIM,
 
   TIME_MAX
 } Time;
 
+/** filtering of delay measurements before the clock servo, see filter.c */
+typedef enum {
+  FILTER_IIR,         /**< average of two offsets, exponential filter for delays */
+  FILTER_MIN,         /**< pair with the smallest delay in the window */
+  FILTER_PERCENTILE,  /**< pair at runTimeOpts.filterPercentile of the delays */
+  FILTER_MEDIAN,      /**< pair with the median delay */
+
+  FILTER_MAX
+} SampleFilter;
+
+/** clock servo, see servo.c */
+typedef enum {
+  SERVO_PI,        /**< proportional-integral controller with attenuations ap, ai */
+  SERVO_LINREG,    /**< least-squares line through a sliding window of samples */
+  SERVO_KALMAN,    /**< Kalman filter for offset, frequency and path delay */
+  SERVO_ADAPTIVE,  /**< PI controller which narrows its gains as the offsets settle */
+
+  SERVO_MAX
+} Servo;
+
 /* program options set at run-time */
 typedef struct {
   Integer8  syncInterval;
@@ -261,7 +428,15 @@ typedef struct {
   Integer16  currentUtcOffset;
   UInteger16  epochNumber;
   Octet  ifaceName[IFACE_NAME_LENGTH];
+  /** PHC device for TIME_PHC, empty = the one of ifaceName */
+  char  phcDevice[PATH_MAX];
   Boolean  noResetClock;
+  /** offsets of at least stepThreshold nsec are stepped... */
+  Integer64  stepThreshold;
+  /** ...but only before the first correction of the clock */
+  Boolean  stepFirstOnly;
+  /** otherwise they are slewed away with at most maxSlew ppb */
+  Integer32  maxSlew;
   Boolean  noAdjust;
   Boolean  displayStats;
   Boolean  csvStats;
@@ -270,6 +445,28 @@ typedef struct {
   Integer16  s;
   TimeInternal  inboundLatency, outboundLatency;
   Integer16  max_foreign_records;
+  Integer16  recvBatch;
+  Integer32  recvTimeStore;
+  Integer16  crossSamples, crossRate;
+  /** emulate the E1000 driver and NIC in software, see e1000_sim.c */
+  Boolean  e1000Sim;
+  Integer64  e1000SimOffset;
+  Integer32  e1000SimDrift, e1000SimJitter;
+  Boolean  e1000SimOverwrite;
+  SampleFilter  filter;
+  Integer16  filterWindow, filterPercentile;
+  /** outlier gate, 0 sigma = off */
+  Integer16  gateSigma, gateConsecutive;
+  /** Syncs for the frequency estimate in PTP_UNCALIBRATED, 0 = none */
+  Integer16  calibrationSyncs;
+  Servo  servo;
+  Integer16  servoWindow;
+  /** maximum holdover in seconds, 0 = none */
+  Integer32  holdover;
+  /** frequency correction is saved here and restored at startup, see sys.c */
+  char  driftFile[PATH_MAX];
+  /** if not NULL, every input of the clock servo is appended here */
+  FILE  *servoLog;
   Boolean  slaveOnly;
   Boolean  probe;
   UInteger8  probe_management_key;
@@ -316,6 +513,8 @@ typedef struct {
   Boolean  parent_stats;
   Integer16  observed_variance;
   Integer32  observed_drift;
+  /** initClock() starts with this frequency, from the drift file */
+  Integer32  saved_drift;
   long       adj;
   Boolean  utc_reasonable;
   UInteger8  grandmaster_communication_technology;
@@ -398,6 +597,17 @@ typedef struct {
    */
   Boolean delayedTiming;
 
+  /**
+   * TRUE while the send time stamp of an event message sent with
+   * delayedTiming is still outstanding; polled with TX_TIMESTAMP_TIMER
+   * until it arrives or pendingSendStart is too long ago
+   */
+  Boolean pendingSend;
+  UInteger8  pendingSendControl;
+  UInteger16  pendingSendSequenceId;
+  /** timerMonotonic(), not affected by steps and slewing of the clock */
+  Integer64  pendingSendStart;
+
   /**
    * a prefix to be inserted before messages about the clock:
    * may be empty, but not NULL
@@ -412,12 +622,35 @@ typedef struct {
   
   offset_from_master_filter  ofm_filt;
   one_way_delay_filter  owd_filt;
+  /** master to slave (Sync) and slave to master (Delay_Req) pairs */
+  SampleWindow  m2s_window, s2m_window;
+  /** shifts the older pairs of the windows to the current clock */
+  AppliedPhase  applied_phase;
+  outlier_gate  offset_gate, delay_gate;
+  Calibration  calibration;
+  /** the clock has been corrected since startup, see stepFirstOnly */
+  Boolean  clockUpdated;
+  Holdover  holdover;
+  
+  /** selected by initClock() */
+  const struct ClockServo *servo;
+  /** I component of the PI servo in ppb, observed_drift is it rounded */
+  FixedPoint servoIntegral;
+  ServoGain servoGain;
+  ServoWindow servoSamples;
+  ServoKalman servoKalman;
   
   Boolean message_activity;
   
   IntervalTimer  itimer[TIMER_ARRAY_SIZE];
   
   NetPath netPath;
+  EventLoop eventLoop;
+  RecvTimeStore recvTimes;
+  /** selected by initTime() */
+  const struct TimeBackend *timeBackend;
+  PhcClock phc;
+  SimClock sim;
 
 } PtpClock;
 
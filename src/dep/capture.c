@@ -0,0 +1,397 @@
+/* capture.c */
+
+#include "../ptpd.h"
+
+/*
+ * Capture and replay of everything the protocol engine gets from the
+ * outside world: wake ups of the event loop, received packets with
+ * their time stamps, expired timers, readings of the clocks and the
+ * send and receive time stamps of the time backend (-W FILE). Replay
+ * (-V FILE) feeds these back in the same order instead of using
+ * network and clocks, with the TIME_REPLAY backend as virtual clock,
+ * and as fast as the records can be read. With the same options the
+ * protocol engine then takes the same decisions and the servo produces
+ * the same output (compare the -O logs); with other servo or filter
+ * options their effect on a real trace can be studied, open loop like
+ * in servocmp.
+ *
+ * Each record is a header of type, flag, data length and a 64 bit
+ * value followed by the data, in host byte order. Sent packets and the
+ * corrections of the clock are recorded for analysis, but skipped
+ * when replaying. Inputs which a time backend reads itself, while
+ * called through time.c, are not recorded: the virtual clock does
+ * not make such calls.
+ *
+ * An expired timer is recorded when timerExpired() reports it. In
+ * replay a timer has expired when the next record says so: between
+ * two checks of the same timer the protocol always waits for or reads
+ * a packet, which is recorded, so that this cannot be mistaken.
+ */
+
+#define CAPTURE_MAGIC "PTPDCAP1"
+#define CAPTURE_HEADER_LENGTH 12
+
+/** which records are only for analysis */
+#define CAPTURE_OUTPUT(type) ((type) >= CAPTURE_SEND_EVENT)
+
+typedef struct {
+  UInteger8 type, flag;
+  UInteger16 length;
+  Integer64 value;
+} CaptureRecord;
+
+static FILE *captureFile;
+static Boolean replaying;
+/* > 0 while inside a time backend */
+static int captureNesting;
+/* replay: the next input record and its data, if already read */
+static Boolean havePeek;
+static CaptureRecord peek;
+static Octet peekData[0x10000];
+
+static const char *captureNames[CAPTURE_MAX] = {
+  [CAPTURE_NET] = "net",
+  [CAPTURE_BACKEND] = "backend",
+  [CAPTURE_DRIFT] = "drift",
+  [CAPTURE_SELECT] = "select",
+  [CAPTURE_RECV_EVENT] = "event packet",
+  [CAPTURE_RECV_GENERAL] = "general packet",
+  [CAPTURE_TIMER] = "timer",
+  [CAPTURE_REALTIME] = "realtime",
+  [CAPTURE_MONOTONIC] = "monotonic",
+  [CAPTURE_TIME] = "time",
+  [CAPTURE_SEND_TIME] = "send time stamp",
+  [CAPTURE_RECV_TIME] = "receive time stamp",
+  [CAPTURE_SEND_EVENT] = "sent event packet",
+  [CAPTURE_SEND_GENERAL] = "sent general packet",
+  [CAPTURE_ADJ] = "frequency adjustment",
+  [CAPTURE_STEP] = "step",
+  [CAPTURE_SET_TIME] = "set time",
+};
+
+static const char * captureName(UInteger8 type)
+{
+  return type < CAPTURE_MAX ? captureNames[type] : "?";
+}
+
+Boolean captureOpen(const char *file, Boolean replay)
+{
+  char magic[sizeof(CAPTURE_MAGIC) - 1];
+
+  captureClose();
+
+  if(!(captureFile = fopen(file, replay ? "r" : "w")))
+  {
+    PERROR("could not open capture file %s", file);
+    return FALSE;
+  }
+  replaying = replay;
+
+  if(!replay)
+    fwrite(CAPTURE_MAGIC, sizeof(magic), 1, captureFile);
+  else if(fread(magic, sizeof(magic), 1, captureFile) != 1 ||
+          memcmp(magic, CAPTURE_MAGIC, sizeof(magic)))
+  {
+    ERROR("%s is not a capture file\n", file);
+    captureClose();
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void captureClose(void)
+{
+  if(captureFile)
+    fclose(captureFile);
+  captureFile = NULL;
+  replaying = FALSE;
+  havePeek = FALSE;
+}
+
+Boolean captureReplaying(void)
+{
+  return captureFile && replaying;
+}
+
+/* around calls into the time backend */
+void captureSuspend(void)
+{
+  ++captureNesting;
+}
+
+void captureResume(void)
+{
+  --captureNesting;
+}
+
+static Boolean recording(void)
+{
+  return captureFile && !replaying && !captureNesting;
+}
+
+static void captureWrite(UInteger8 type, UInteger8 flag, Integer64 value, const void *data, UInteger16 length)
+{
+  Octet header[CAPTURE_HEADER_LENGTH];
+
+  header[0] = type;
+  header[1] = flag;
+  memcpy(header + 2, &length, 2);
+  memcpy(header + 4, &value, 8);
+  if(fwrite(header, sizeof(header), 1, captureFile) != 1 ||
+     (length && fwrite(data, length, 1, captureFile) != 1))
+  {
+    PERROR("could not write capture file");
+    captureClose();
+  }
+}
+
+static void captureEnd(int status)
+{
+  ptpdShutdown();
+  exit(status);
+}
+
+/* replay: the next input record */
+static CaptureRecord * capturePeek(void)
+{
+  Octet header[CAPTURE_HEADER_LENGTH];
+
+  while(!havePeek)
+  {
+    if(fread(header, sizeof(header), 1, captureFile) != 1)
+    {
+      NOTIFY("end of capture\n");
+      captureEnd(0);
+    }
+    peek.type = header[0];
+    peek.flag = header[1];
+    memcpy(&peek.length, header + 2, 2);
+    memcpy(&peek.value, header + 4, 8);
+    if(peek.length && fread(peekData, peek.length, 1, captureFile) != 1)
+    {
+      ERROR("truncated capture file\n");
+      captureEnd(1);
+    }
+    havePeek = !CAPTURE_OUTPUT(peek.type);
+  }
+
+  return &peek;
+}
+
+/* replay: consume the next input record, which must be of 'type' */
+static CaptureRecord * captureNext(UInteger8 type)
+{
+  CaptureRecord *record = capturePeek();
+
+  if(record->type != type)
+  {
+    ERROR("capture out of sync: %s instead of %s\n",
+          captureName(record->type), captureName(type));
+    captureEnd(1);
+  }
+  havePeek = FALSE;
+
+  DBGV("replay %s %lld\n", captureName(type), record->value);
+  return record;
+}
+
+/* a reading 'value' of a clock */
+void captureTime(CaptureType type, Integer64 *value)
+{
+  if(recording())
+    captureWrite(type, 0, *value, NULL, 0);
+  else if(captureReplaying() && !captureNesting)
+    *value = captureNext(type)->value;
+}
+
+/* a time stamp 'time' which is only valid if 'ok' */
+Boolean captureStamp(CaptureType type, Boolean ok, TimeInternal *time)
+{
+  CaptureRecord *record;
+
+  if(recording())
+    captureWrite(type, ok, ok ? *time : 0, NULL, 0);
+  else if(captureReplaying() && !captureNesting)
+  {
+    record = captureNext(type);
+    ok = record->flag;
+    if(ok)
+      *time = record->value;
+  }
+
+  return ok;
+}
+
+/* result of netSelect() */
+int captureSelect(int ready)
+{
+  if(recording())
+    captureWrite(CAPTURE_SELECT, 0, ready, NULL, 0);
+  else if(captureReplaying())
+    ready = captureNext(CAPTURE_SELECT)->value;
+
+  return ready;
+}
+
+/*
+ * 'length' bytes received in 'buf', with receive time stamp 'time'
+ * for event packets (may be NULL); 'length' <= 0 if nothing or an error
+ */
+ssize_t capturePacket(CaptureType type, ssize_t length, Octet *buf, TimeInternal *time)
+{
+  CaptureRecord *record;
+
+  if(recording())
+    captureWrite(type, length < 0, length > 0 && time ? *time : 0,
+                 buf, length > 0 ? length : 0);
+  else if(captureReplaying())
+  {
+    record = captureNext(type);
+    if(record->flag)
+    {
+      errno = EIO;
+      return -1;
+    }
+    length = record->length;
+    memcpy(buf, peekData, length);
+    if(time)
+      *time = record->value;
+  }
+
+  return length;
+}
+
+/* a packet which was sent, only recorded */
+void captureSend(CaptureType type, Octet *buf, UInteger16 length)
+{
+  if(recording())
+    captureWrite(type, 0, 0, buf, length);
+}
+
+/* a correction of the clock by 'value', only recorded */
+void captureAdjust(CaptureType type, Integer64 value)
+{
+  if(recording())
+    captureWrite(type, 0, value, NULL, 0);
+}
+
+/* timerExpired() found timer 'index' 'expired' */
+Boolean captureTimer(UInteger16 index, Boolean expired)
+{
+  CaptureRecord *record;
+
+  if(recording() && expired)
+    captureWrite(CAPTURE_TIMER, 0, index, NULL, 0);
+  else if(captureReplaying() && !captureNesting)
+  {
+    record = capturePeek();
+    expired = record->type == CAPTURE_TIMER && record->value == index;
+    if(expired)
+      captureNext(CAPTURE_TIMER);
+  }
+
+  return expired;
+}
+
+/* result 'ok' of netInit() and what it found out about the interface */
+Boolean captureNet(Boolean ok, PtpClock *ptpClock)
+{
+  Octet data[PTP_UUID_LENGTH + 1 + SUBDOMAIN_ADDRESS_LENGTH + 2*PORT_ADDRESS_LENGTH];
+  CaptureRecord *record;
+
+  if(recording())
+  {
+    memcpy(data, ptpClock->port_uuid_field, PTP_UUID_LENGTH);
+    data[PTP_UUID_LENGTH] = ptpClock->port_communication_technology;
+    memcpy(data + PTP_UUID_LENGTH + 1, ptpClock->subdomain_address, SUBDOMAIN_ADDRESS_LENGTH);
+    memcpy(data + PTP_UUID_LENGTH + 1 + SUBDOMAIN_ADDRESS_LENGTH,
+           ptpClock->event_port_address, PORT_ADDRESS_LENGTH);
+    memcpy(data + PTP_UUID_LENGTH + 1 + SUBDOMAIN_ADDRESS_LENGTH + PORT_ADDRESS_LENGTH,
+           ptpClock->general_port_address, PORT_ADDRESS_LENGTH);
+    captureWrite(CAPTURE_NET, ok, 0, data, sizeof(data));
+  }
+  else if(captureReplaying())
+  {
+    record = captureNext(CAPTURE_NET);
+    if(record->length != sizeof(data))
+    {
+      ERROR("capture out of sync: bad net record\n");
+      captureEnd(1);
+    }
+    memcpy(ptpClock->port_uuid_field, peekData, PTP_UUID_LENGTH);
+    ptpClock->port_communication_technology = peekData[PTP_UUID_LENGTH];
+    memcpy(ptpClock->subdomain_address, peekData + PTP_UUID_LENGTH + 1, SUBDOMAIN_ADDRESS_LENGTH);
+    memcpy(ptpClock->event_port_address,
+           peekData + PTP_UUID_LENGTH + 1 + SUBDOMAIN_ADDRESS_LENGTH, PORT_ADDRESS_LENGTH);
+    memcpy(ptpClock->general_port_address,
+           peekData + PTP_UUID_LENGTH + 1 + SUBDOMAIN_ADDRESS_LENGTH + PORT_ADDRESS_LENGTH,
+           PORT_ADDRESS_LENGTH);
+    ok = record->flag;
+  }
+
+  return ok;
+}
+
+/* how the recorded time backend works, after initTime() */
+void captureBackend(PtpClock *ptpClock)
+{
+  CaptureRecord *record;
+
+  if(recording())
+    captureWrite(CAPTURE_BACKEND,
+                 ptpClock->delayedTiming | ptpClock->nic_instead_of_system << 1, 0,
+                 ptpClock->timeBackend->name, strlen(ptpClock->timeBackend->name));
+  else if(captureReplaying())
+  {
+    record = captureNext(CAPTURE_BACKEND);
+    ptpClock->delayedTiming = record->flag & 1;
+    ptpClock->nic_instead_of_system = (record->flag >> 1) & 1;
+    DBG("replaying time backend %.*s\n", record->length, peekData);
+  }
+}
+
+/*
+ * TIME_REPLAY: the virtual clock. All readings come from the capture,
+ * see time.c; corrections are only recorded.
+ */
+
+static void replayGetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  *time = 0;
+}
+
+static void replaySetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  DBGV("replay: set time %lldns\n", *time);
+}
+
+static void replayAdjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+{
+  DBGV("replay: adjust frequency by %dppb\n", adj);
+}
+
+static void replayAdjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  DBGV("replay: step by %lldns\n", -*offset);
+}
+
+static Boolean replayGetStamp(TimeInternal *time, PtpClock *ptpClock)
+{
+  return FALSE;
+}
+
+static Boolean replayGetReceiveTime(TimeInternal *time, Octet *sourceUuid, UInteger16 sequenceId, PtpClock *ptpClock)
+{
+  return FALSE;
+}
+
+const TimeBackend timeReplayBackend = {
+  .name = "replay",
+  .getTime = replayGetTime,
+  .setTime = replaySetTime,
+  .adjTime = replayAdjTime,
+  .adjTimeOffset = replayAdjTimeOffset,
+  .getSendTime = replayGetStamp,
+  .getReceiveTime = replayGetReceiveTime,
+};
@@ -146,6 +146,17 @@
 
 #define PACKET_SIZE  300
 
+/* upper limit for datagrams per recvmmsg() call */
+#define NET_RECV_BATCH_MAX  32
+/* ancillary data with receive time stamps */
+#define NET_CONTROL_LENGTH  256
+/* event messages whose send time stamp may be outstanding at once */
+#define NET_PENDING_SENDS   16
+
+/* NIC receive time stamps: slots searched per key, max age in nsec */
+#define RECV_TIME_PROBES    8
+#define RECV_TIME_MAX_AGE   1000000000LL
+
 #define PTP_EVENT_PORT    319
 #define PTP_GENERAL_PORT  320
 
@@ -163,6 +174,16 @@
 
 #define MM_STARTING_BOUNDARY_HOPS  0x7fff
 
+/* event loop */
+
+#define EVENT_MAX_FDS  16
+
+/* bits returned by eventWait() for the sources which are ready */
+#define EVENT_EVENT_SOCK    0x01
+#define EVENT_GENERAL_SOCK  0x02
+#define EVENT_ERROR_QUEUE   0x04
+#define EVENT_TIMER         0x08
+
 /* others */
 
 #define SCREEN_BUFSZ  128
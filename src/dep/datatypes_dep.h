@@ -3,6 +3,8 @@
 #ifndef DATATYPES_DEP_H
 #define DATATYPES_DEP_H
 
+#include<stdio.h>
+
 typedef enum {FALSE=0, TRUE} Boolean;
 typedef char Octet;
 typedef signed char Integer8;
@@ -11,23 +13,146 @@ typedef signed int Integer32;
 typedef unsigned char UInteger8;
 typedef unsigned short UInteger16;
 typedef unsigned int UInteger32;
+typedef signed long long Integer64;
+
+/** nsec or ppb with FIXED_SHIFT fractional bits, see ptpd_dep.h */
+typedef Integer64 FixedPoint;
 
 typedef struct {
-  Integer32  nsec_prev, y;
+  FixedPoint  nsec_prev, y;
 } offset_from_master_filter;
 
 typedef struct {
-  Integer32  nsec_prev, y;
+  FixedPoint  nsec_prev, y;
   Integer32  s_exp;
 } one_way_delay_filter;
 
+/** running mean and mean absolute deviation of a measurement, see filter.c */
+typedef struct {
+  Integer64  mean, dev;
+  Integer32  samples;     /**< accepted since the last reset, up to GATE_WARMUP */
+  Integer32  consecutive; /**< rejected in a row */
+  UInteger32  rejected;   /**< rejected in total */
+} outlier_gate;
+
+/**
+ * datagrams drained from a socket by one recvmmsg() call and handed
+ * out one by one to the protocol
+ */
+typedef struct {
+  Octet buf[NET_RECV_BATCH_MAX][PACKET_SIZE];
+  Integer16 length[NET_RECV_BATCH_MAX];
+  /** receive time stamps, 0/0 if none */
+  struct timespec stamp[NET_RECV_BATCH_MAX];
+  Integer16 count, next;
+  /** batches[n] = number of recvmmsg() calls which returned n datagrams */
+  UInteger32 batches[NET_RECV_BATCH_MAX + 1];
+} NetRecvBatch;
+
+/**
+ * an event message which waits for its send time stamp to be
+ * bounced back through the error queue
+ */
+typedef struct {
+  Boolean valid;
+  /** key assigned by the kernel (SOF_TIMESTAMPING_OPT_ID) */
+  UInteger32 key;
+  UInteger16 sequenceId;
+  UInteger8 control;
+  UInteger16 length;
+} NetPendingSend;
+
+/** a dynamic POSIX clock, see time_phc.c */
+typedef struct {
+  Integer32 fd;      /**< open PHC device, -1 for CLOCK_REALTIME */
+  clockid_t clock;
+  Integer32 maxAdj;  /**< max frequency adjustment in ppb */
+  Boolean precise;   /**< PTP_SYS_OFFSET_PRECISE works */
+  Boolean sysOffset; /**< PTP_SYS_OFFSET works */
+} PhcClock;
+
+/** instrumentation points on the way from a Sync to the clock, see latency.c */
+typedef enum {
+  LATENCY_RECV,     /**< handle() received a packet */
+  LATENCY_HANDLER,  /**< handleSync()/handleFollowUp() pass it on to the servo */
+  LATENCY_OFFSET,   /**< updateOffset() */
+  LATENCY_CLOCK,    /**< updateClock() */
+  LATENCY_ADJ,      /**< adjTime()/adjTimeOffset() call the time backend */
+  LATENCY_DONE,     /**< which returned */
+  LATENCY_POINTS
+} LatencyPoint;
+
+/** a simulated oscillator, see time_sim.c */
+typedef struct {
+  Integer64 last;  /**< timerMonotonic() when 'time' was current */
+  Integer64 time;  /**< reading of the clock, nsec */
+  double frac;     /**< and fractions of a nsec */
+  double drift;    /**< constant frequency error, ppb */
+  double wander;   /**< random walk of the frequency error, ppb/sqrt(s) */
+  double walk;     /**< current frequency error due to 'wander', ppb */
+  Integer32 adj;   /**< frequency adjustment, ppb */
+  UInteger32 seed;
+} SimClock;
+
 typedef struct {
   Integer32 eventSock, generalSock, multicastAddr, unicastAddr;
 #if defined(linux)
   /** for further ioctl() calls on eventSock */
   struct ifreq eventSockIFR;
 #endif
-  UInteger16 lastNetSendEventLength;
+  NetRecvBatch eventBatch, generalBatch;
+
+  /** TRUE if sends on eventSock are bounced with time stamp */
+  Boolean sendBounce;
+  /** which SO_TIMESTAMPING time stamp to use: software, HW in system time, raw HW */
+  Integer16 stampIndex;
+  /** TRUE if the kernel tags each bounce with sendKey */
+  Boolean sendKeys;
+  /** key of the next send on eventSock */
+  UInteger32 sendKey;
+  NetPendingSend pendingSends[NET_PENDING_SENDS];
+  Integer16 nextPendingSend;
+  /** pending sends overwritten before their bounce arrived */
+  UInteger32 lostBounces;
+  /** bounces without matching pending send */
+  UInteger32 unmatchedBounces;
 } NetPath;
 
+/** records of a capture file, see capture.c */
+typedef enum {
+  /* inputs, fed back in a replay */
+  CAPTURE_NET,           /**< result of netInit(), interface addresses */
+  CAPTURE_BACKEND,       /**< time backend */
+  CAPTURE_DRIFT,         /**< drift read from the drift file */
+  CAPTURE_SELECT,        /**< result of netSelect() */
+  CAPTURE_RECV_EVENT,    /**< event packet with receive time stamp */
+  CAPTURE_RECV_GENERAL,  /**< general packet */
+  CAPTURE_TIMER,         /**< expired timer */
+  CAPTURE_REALTIME,      /**< timerNow() */
+  CAPTURE_MONOTONIC,     /**< timerMonotonic() */
+  CAPTURE_TIME,          /**< getTime() */
+  CAPTURE_SEND_TIME,     /**< getSendTime() */
+  CAPTURE_RECV_TIME,     /**< getReceiveTime() */
+  /* outputs, only recorded */
+  CAPTURE_SEND_EVENT,
+  CAPTURE_SEND_GENERAL,
+  CAPTURE_ADJ,           /**< adjTime(), ppb */
+  CAPTURE_STEP,          /**< adjTimeOffset(), nsec */
+  CAPTURE_SET_TIME,      /**< setTime() */
+  CAPTURE_MAX
+} CaptureType;
+
+/**
+ * file descriptors watched by the event loop in event.c,
+ * each tagged with the EVENT_* bit reported when it becomes ready
+ */
+typedef struct {
+#if defined(linux)
+  Integer32 epollFd;
+#endif
+  Integer32 fd[EVENT_MAX_FDS];
+  UInteger32 source[EVENT_MAX_FDS];
+  Integer16 count;
+} EventLoop;
+
 #endif
@@ -0,0 +1,266 @@
+/* e1000_sim.c */
+
+#include "../ptpd.h"
+
+#include "e1000_ioctl.h"
+
+/*
+ * Software emulation of the igb driver's E1000_TSYNC ioctl()s for the
+ * nic, both and assisted clocks (-E), so that they run without the
+ * Intel NIC. Like the driver and the NIC, the state is global: all
+ * PtpClocks of the process share one emulated NIC.
+ *
+ * NIC time is a SimClock (time_sim.c) on CLOCK_MONOTONIC_RAW, which
+ * unlike CLOCK_MONOTONIC does not follow frequency corrections of
+ * system time. It starts at runTimeOpts.e1000SimOffset nsec from
+ * system time and runs e1000SimDrift ppb fast. Event packets are
+ * latched when ptpd sends them or reads them from the socket, with
+ * gaussian jitter of e1000SimJitter nsec. As in the hardware, a latched
+ * time stamp blocks the next one until E1000_TSYNC_READTS_IOCTL
+ * fetched it, unless e1000SimOverwrite is set.
+ */
+
+static struct {
+  Boolean initialized;
+  SimClock clock;
+  /** E1000_UDP_V1_SYNC/DELAY etc., -1 = receive time stamping off */
+  Integer32 rxMode;
+  Boolean txEnabled;
+  /** latched time stamps and their system times */
+  Boolean rxValid, txValid;
+  TimeInternal rx, rxSys, tx, txSys;
+  UInteger16 rxSequenceId;
+  Octet rxUuid[PTP_UUID_LENGTH];
+  /** packets which found the latch occupied */
+  UInteger32 rxLost, txLost;
+} nic = { .rxMode = -1 };
+
+static Integer64 rawMonotonic(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return TIMESPEC_NSEC(ts);
+}
+
+static TimeInternal systemNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return TIMESPEC_NSEC(ts);
+}
+
+static TimeInternal nicNow(void)
+{
+  return simClockRead(&nic.clock, rawMonotonic());
+}
+
+static void toE1000(TimeInternal time, struct E1000_TS *ts, int *sign)
+{
+  if(sign)
+    *sign = time < 0 ? -1 : 1;
+  ts->seconds = llabs(time) / 1000000000;
+  ts->nanoseconds = llabs(time) % 1000000000;
+}
+
+static TimeInternal fromE1000(struct E1000_TS *ts)
+{
+  return (Integer64)ts->seconds*1000000000LL + ts->nanoseconds;
+}
+
+static void simInitNIC(PtpClock *ptpClock)
+{
+  if(nic.initialized)
+    return;
+
+  memset(&nic.clock, 0, sizeof(nic.clock));
+  nic.clock.last = rawMonotonic();
+  nic.clock.time = systemNow() + ptpClock->runTimeOpts.e1000SimOffset;
+  nic.clock.drift = ptpClock->runTimeOpts.e1000SimDrift;
+  nic.clock.seed = nic.clock.last;
+  nic.initialized = TRUE;
+
+  NOTIFY("emulating E1000 NIC: offset %lldns, drift %dppb, jitter %dns, %s time stamps\n",
+         ptpClock->runTimeOpts.e1000SimOffset,
+         ptpClock->runTimeOpts.e1000SimDrift,
+         ptpClock->runTimeOpts.e1000SimJitter,
+         ptpClock->runTimeOpts.e1000SimOverwrite ? "overwrite" : "keep");
+}
+
+static void simSystime(struct E1000_TSYNC_SYSTIME_ARGU *ts)
+{
+  TimeInternal now = nicNow();
+
+  if(ts->negative_offset)
+  {
+    now += ts->negative_offset < 0 ? -fromE1000(&ts->time) : fromE1000(&ts->time);
+    nic.clock.time = now;
+    nic.clock.frac = 0;
+  }
+  toE1000(now, &ts->time, NULL);
+}
+
+static void simAdjtime(struct E1000_TSYNC_ADJTIME_ARGU *ts)
+{
+  if(ts->set_adj)
+  {
+    /* the old frequency applies up to now */
+    nicNow();
+    if(ts->adj > ADJ_FREQ_MAX)
+      ts->adj = ADJ_FREQ_MAX;
+    else if(ts->adj < -ADJ_FREQ_MAX)
+      ts->adj = -ADJ_FREQ_MAX;
+    nic.clock.adj = ts->adj;
+  }
+  ts->adj = nic.clock.adj;
+}
+
+static void simReadts(struct E1000_TSYNC_READTS_ARGU *ts)
+{
+  /* reading unlocks the latches */
+  if((ts->rx_valid = nic.rxValid))
+  {
+    toE1000(nic.rx, &ts->rx, NULL);
+    if(ts->withSystemTime)
+      toE1000(nic.rxSys, &ts->rx_sys, NULL);
+    ts->sourceSequenceId = nic.rxSequenceId;
+    memcpy(ts->sourceIdentity, nic.rxUuid, sizeof(ts->sourceIdentity));
+    nic.rxValid = FALSE;
+  }
+
+  if((ts->tx_valid = nic.txValid))
+  {
+    toE1000(nic.tx, &ts->tx, NULL);
+    if(ts->withSystemTime)
+      toE1000(nic.txSys, &ts->tx_sys, NULL);
+    nic.txValid = FALSE;
+  }
+}
+
+/* one reading system, NIC, system time like the driver */
+static void simComparets(struct E1000_TSYNC_COMPARETS_ARGU *ts)
+{
+  TimeInternal sys1, time, sys2;
+
+  sys1 = systemNow();
+  time = nicNow();
+  sys2 = systemNow();
+  toE1000(time - sys1, &ts->systemToNIC, &ts->systemToNICSign);
+  toE1000(sys2 - time, &ts->NICToSystem, &ts->NICToSystemSign);
+}
+
+/**
+ * Stands in for ioctl() on the event socket with 'request' and 'ifr',
+ * returns 0 or -1 with errno like it.
+ */
+int e1000SimIoctl(unsigned long request, struct ifreq *ifr, PtpClock *ptpClock)
+{
+  int mode;
+
+  if(request != E1000_TSYNC_INIT_IOCTL && !nic.initialized)
+  {
+    errno = EIO;
+    return -1;
+  }
+
+  switch(request)
+  {
+  case E1000_TSYNC_INIT_IOCTL:
+    simInitNIC(ptpClock);
+    return 0;
+
+  case E1000_TSYNC_SYSTIME_IOCTL:
+    simSystime((struct E1000_TSYNC_SYSTIME_ARGU *)ifr->ifr_data);
+    return 0;
+
+  case E1000_TSYNC_ADJTIME_IOCTL:
+    simAdjtime((struct E1000_TSYNC_ADJTIME_ARGU *)ifr->ifr_data);
+    return 0;
+
+  case E1000_TSYNC_ENABLETX_IOCTL:
+  case E1000_TSYNC_DISABLETX_IOCTL:
+    nic.txEnabled = request == E1000_TSYNC_ENABLETX_IOCTL;
+    nic.txValid = FALSE;
+    return 0;
+
+  case E1000_TSYNC_ENABLERX_IOCTL:
+    /* the mode is stored in place of the ifr_data pointer */
+    memcpy(&mode, &ifr->ifr_data, sizeof(mode));
+    if(mode < 0 || mode >= E1000_TSYNC_MAX)
+      break;
+    nic.rxMode = mode;
+    nic.rxValid = FALSE;
+    return 0;
+
+  case E1000_TSYNC_DISABLERX_IOCTL:
+    nic.rxMode = -1;
+    nic.rxValid = FALSE;
+    return 0;
+
+  case E1000_TSYNC_READTS_IOCTL:
+    simReadts((struct E1000_TSYNC_READTS_ARGU *)ifr->ifr_data);
+    return 0;
+
+  case E1000_TSYNC_COMPARETS_IOCTL:
+    simComparets((struct E1000_TSYNC_COMPARETS_ARGU *)ifr->ifr_data);
+    return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+/**
+ * Time stamp an event message which was just sent or read from the
+ * event socket, if the emulated NIC is active and the message is one
+ * which the NIC latches.
+ */
+void e1000SimPacket(Boolean send, Octet *buf, ssize_t length, PtpClock *ptpClock)
+{
+  TimeInternal time, system, jitter = 0;
+  UInteger8 control;
+
+  if(!ptpClock->runTimeOpts.e1000Sim || !nic.initialized || length < HEADER_LENGTH)
+    return;
+
+  control = *(UInteger8*)(buf + 32);
+  if(send ? !nic.txEnabled :
+     !((nic.rxMode == E1000_UDP_V1_SYNC && control == PTP_SYNC_MESSAGE) ||
+       (nic.rxMode == E1000_UDP_V1_DELAY && control == PTP_DELAY_REQ_MESSAGE)))
+    return;
+
+  system = systemNow();
+  time = nicNow();
+  if(ptpClock->runTimeOpts.e1000SimJitter)
+    jitter = ptpClock->runTimeOpts.e1000SimJitter * simGauss(&nic.clock.seed);
+
+  if(send)
+  {
+    if(nic.txValid && !ptpClock->runTimeOpts.e1000SimOverwrite)
+    {
+      DBG("emulated NIC: send time stamp still latched, %u lost\n", ++nic.txLost);
+      return;
+    }
+    nic.tx = time + jitter;
+    nic.txSys = system + jitter;
+    nic.txValid = TRUE;
+  }
+  else
+  {
+    if(nic.rxValid && !ptpClock->runTimeOpts.e1000SimOverwrite)
+    {
+      DBG("emulated NIC: receive time stamp still latched, %u lost\n", ++nic.rxLost);
+      return;
+    }
+    nic.rx = time + jitter;
+    nic.rxSys = system + jitter;
+    nic.rxSequenceId = flip16(*(UInteger16*)(buf + 30));
+    memcpy(nic.rxUuid, buf + 22, PTP_UUID_LENGTH);
+    nic.rxValid = TRUE;
+  }
+
+  DBGV("emulated NIC: latched %s time %lldns, sequence %u\n",
+       send ? "send" : "receive", time + jitter,
+       (UInteger16)flip16(*(UInteger16*)(buf + 30)));
+}
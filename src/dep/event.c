@@ -0,0 +1,166 @@
+/* event.c */
+
+#include "../ptpd.h"
+
+#if defined(linux)
+#include <sys/epoll.h>
+#endif
+
+/* create an empty set of watched file descriptors */
+Boolean eventInit(PtpClock *ptpClock)
+{
+  EventLoop *loop = &ptpClock->eventLoop;
+
+  DBG("eventInit\n");
+
+  loop->count = 0;
+
+#if defined(linux)
+  if((loop->epollFd = epoll_create(EVENT_MAX_FDS)) < 0)
+  {
+    PERROR("failed to create epoll instance");
+    return FALSE;
+  }
+#endif
+
+  return TRUE;
+}
+
+void eventShutdown(PtpClock *ptpClock)
+{
+  EventLoop *loop = &ptpClock->eventLoop;
+
+#if defined(linux)
+  if(loop->epollFd > 0)
+    close(loop->epollFd);
+  loop->epollFd = -1;
+#endif
+
+  loop->count = 0;
+}
+
+/* watch 'fd' for input, report it as 'source' in eventWait() */
+Boolean eventAdd(Integer32 fd, UInteger32 source, PtpClock *ptpClock)
+{
+  EventLoop *loop = &ptpClock->eventLoop;
+#if defined(linux)
+  struct epoll_event ev;
+#endif
+
+  if(loop->count >= EVENT_MAX_FDS)
+  {
+    ERROR("too many file descriptors for event loop\n");
+    return FALSE;
+  }
+
+#if defined(linux)
+  /*
+   * level triggered: everything not consumed by the protocol is
+   * reported again by the next eventWait()
+   */
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = loop->count;
+  if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    PERROR("failed to add file descriptor to event loop");
+    return FALSE;
+  }
+#endif
+
+  loop->fd[loop->count] = fd;
+  loop->source[loop->count] = source;
+  ++loop->count;
+
+  return TRUE;
+}
+
+/*
+ * Block until one of the watched file descriptors becomes ready or
+ * 'timeout' passed (NULL = wait forever). Returns the ready sources
+ * as EVENT_* bits, 0 if nothing happened, negative on error.
+ */
+int eventWait(TimeInternal *timeout, PtpClock *ptpClock)
+{
+  EventLoop *loop = &ptpClock->eventLoop;
+  int i, ret, ready = 0;
+
+#if defined(linux)
+  struct epoll_event ev[EVENT_MAX_FDS];
+  int ms = -1;
+
+  if(timeout)
+    ms = (*timeout + 999999)/1000000;
+
+  ret = epoll_wait(loop->epollFd, ev, EVENT_MAX_FDS, ms);
+  if(ret < 0)
+  {
+    if(errno == EINTR)
+      return 0;
+
+    return ret;
+  }
+
+  for(i = 0; i < ret; ++i)
+  {
+    UInteger32 source = loop->source[ev[i].data.u32];
+
+    if(ev[i].events & EPOLLIN)
+      ready |= source;
+    /* pending send time stamps are signalled as error on the event socket */
+    if(ev[i].events & EPOLLERR)
+      ready |= source == EVENT_EVENT_SOCK ? EVENT_ERROR_QUEUE : source;
+  }
+
+  /* latch expired timers even if the current state does not check them */
+  if(ready & EVENT_TIMER)
+    timerUpdate(ptpClock->itimer);
+
+#else /* select() */
+  fd_set readfds;
+  struct timeval tv, *tv_ptr = 0;
+  TimeInternal next;
+  int nfds = 0;
+
+  FD_ZERO(&readfds);
+  for(i = 0; i < loop->count; ++i)
+  {
+    FD_SET(loop->fd[i], &readfds);
+    if(loop->fd[i] > nfds)
+      nfds = loop->fd[i];
+  }
+
+  /* do not sleep beyond the next timer expiration */
+  if(timerNext(&next, ptpClock->itimer) && (!timeout || next < *timeout))
+    timeout = &next;
+
+  if(timeout)
+  {
+    tv.tv_sec = *timeout / 1000000000;
+    tv.tv_usec = (*timeout % 1000000000 + 999)/1000;
+    tv_ptr = &tv;
+  }
+
+  ret = select(nfds + 1, &readfds, 0, 0, tv_ptr);
+  if(ret < 0)
+  {
+    if(errno == EAGAIN || errno == EINTR)
+      return 0;
+
+    return ret;
+  }
+
+  for(i = 0; i < loop->count; ++i)
+    if(FD_ISSET(loop->fd[i], &readfds))
+      ready |= loop->source[i];
+
+  timerUpdate(ptpClock->itimer);
+  for(i = 0; i < TIMER_ARRAY_SIZE; ++i)
+    if(ptpClock->itimer[i].expire)
+      ready |= EVENT_TIMER;
+#endif
+
+  DBGV("eventWait: ready %x\n", ready);
+
+  return ready;
+}
@@ -0,0 +1,214 @@
+/* filter.c */
+
+#include "../ptpd.h"
+
+/*
+ * Window filters for the delay measurements: the last
+ * runTimeOpts.filterWindow send/receive time stamp pairs of a
+ * direction are kept and the pair whose delay is at the configured
+ * percentile of all of them is passed on. Queuing only ever adds
+ * delay, so the minimum or a low percentile picks the pairs which
+ * went through the network without waiting; the median also ignores
+ * outliers to both sides.
+ *
+ * The servo corrects the clock after each selected pair, so a pair
+ * which stays selected for several Syncs would have the same error
+ * corrected again and again. The local time stamp of every pair is
+ * therefore shifted by the phase correction applied since it was
+ * taken (AppliedPhase) before pairs get compared and passed on.
+ */
+
+static const char *filterNames[FILTER_MAX] = {
+  [FILTER_IIR] = "iir",
+  [FILTER_MIN] = "min",
+  [FILTER_PERCENTILE] = "percentile",
+  [FILTER_MEDIAN] = "median",
+};
+
+const char * filterName(SampleFilter filter)
+{
+  return filter < FILTER_MAX ? filterNames[filter] : NULL;
+}
+
+void initSampleWindow(SampleWindow *window)
+{
+  window->count = window->next = 0;
+}
+
+void initAppliedPhase(AppliedPhase *applied)
+{
+  applied->phase = applied->time = 0;
+  applied->rate = 0;
+}
+
+static TimeInternal appliedPhaseAt(TimeInternal localTime, AppliedPhase *applied)
+{
+  return applied->phase + (Integer64)applied->rate * (localTime - applied->time) / 1000000000;
+}
+
+/*
+ * The clock was stepped by 'step' (nsec) at local time 'localTime' and
+ * corrected by 'rate' ppb more than observed_drift from then on.
+ */
+void applyPhase(TimeInternal localTime, TimeInternal step, Integer32 rate, PtpClock *ptpClock)
+{
+  AppliedPhase *applied = &ptpClock->applied_phase;
+
+  applied->phase = appliedPhaseAt(localTime, applied) + step;
+  applied->time = localTime;
+  applied->rate = rate;
+}
+
+/*
+ * Add the pair 'send','recv' to 'window' and replace it with the
+ * selected one. 'localRecv' tells whether 'recv' (Sync) or 'send'
+ * (Delay_Req) is the local time stamp. Returns FALSE if no window
+ * filter is active (FILTER_IIR): then the pair is left alone.
+ */
+Boolean filterSample(TimeInternal *send, TimeInternal *recv, Boolean localRecv, SampleWindow *window, PtpClock *ptpClock)
+{
+  Integer16 size = ptpClock->runTimeOpts.filterWindow;
+  Integer16 percentile, order[MAX_FILTER_WINDOW];
+  TimeInternal phase, sends[MAX_FILTER_WINDOW], recvs[MAX_FILTER_WINDOW];
+  int i, j, selected;
+
+  if(ptpClock->runTimeOpts.filter == FILTER_IIR)
+    return FALSE;
+
+  if(size < 1)
+    size = 1;
+  else if(size > MAX_FILTER_WINDOW)
+    size = MAX_FILTER_WINDOW;
+
+  phase = appliedPhaseAt(localRecv ? *recv : *send, &ptpClock->applied_phase);
+  window->send[window->next] = *send;
+  window->recv[window->next] = *recv;
+  window->phase[window->next] = phase;
+  window->next = (window->next + 1) % size;
+  if(window->count < size)
+    ++window->count;
+
+  switch(ptpClock->runTimeOpts.filter)
+  {
+  case FILTER_MIN:
+    percentile = 0;
+    break;
+  case FILTER_MEDIAN:
+    percentile = 50;
+    break;
+  default:
+    percentile = ptpClock->runTimeOpts.filterPercentile;
+    break;
+  }
+
+  /* the pairs as if they were taken with the current correction */
+  for(i = 0; i < window->count; i++)
+  {
+    sends[i] = window->send[i];
+    recvs[i] = window->recv[i];
+    if(localRecv)
+      recvs[i] -= phase - window->phase[i];
+    else
+      sends[i] -= phase - window->phase[i];
+  }
+
+  /* insertion sort of the pairs by delay, the window is small */
+  for(i = 0; i < window->count; i++)
+  {
+    TimeInternal delay = recvs[i] - sends[i];
+
+    for(j = i; j > 0 && recvs[order[j-1]] - sends[order[j-1]] > delay; j--)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+
+  selected = order[((window->count - 1) * percentile + 50) / 100];
+  *send = sends[selected];
+  *recv = recvs[selected];
+
+  DBGV("%s%s filter: %d pairs, selected delay %lldns\n",
+       ptpClock->name, filterName(ptpClock->runTimeOpts.filter),
+       window->count, *recv - *send);
+
+  return TRUE;
+}
+
+void initOutlierGate(outlier_gate *gate)
+{
+  gate->mean = gate->dev = 0;
+  gate->samples = gate->consecutive = 0;
+}
+
+/*
+ * TRUE if 'value' is consistent with the recent samples of 'gate';
+ * 'name' is only for debug output.
+ */
+static Boolean gateSample(TimeInternal value, outlier_gate *gate, const char *name, PtpClock *ptpClock)
+{
+  TimeInternal dev = llabs(value - gate->mean);
+  /* sigma = sqrt(pi/2) * mean absolute deviation for normal distributions */
+  TimeInternal limit = gate->dev * ptpClock->runTimeOpts.gateSigma * 5 / 4;
+
+  if(!ptpClock->runTimeOpts.gateSigma)
+    return TRUE;
+
+  if(gate->samples >= GATE_WARMUP && dev > limit && dev > GATE_MIN_DEV)
+  {
+    if(gate->consecutive < ptpClock->runTimeOpts.gateConsecutive)
+    {
+      ++gate->consecutive;
+      ++gate->rejected;
+      DBG("%sreject %s %lldns, mean %lldns, deviation %lldns\n",
+          ptpClock->name, name, value, gate->mean, gate->dev);
+      return FALSE;
+    }
+
+    /* too many in a row: the mean has moved, start over from here */
+    DBG("%saccept %s %lldns after %d rejections\n",
+        ptpClock->name, name, value, gate->consecutive);
+    gate->mean = value;
+    dev = gate->dev;
+  }
+
+  gate->consecutive = 0;
+  if(!gate->samples)
+  {
+    gate->mean = value;
+    dev = 0;
+  }
+  else if(gate->samples < GATE_WARMUP)
+  {
+    /* plain average until the running one has enough history */
+    gate->mean += (value - gate->mean) / (gate->samples + 1);
+    gate->dev += (dev - gate->dev) / gate->samples;
+  }
+  else
+  {
+    gate->mean += (value - gate->mean) >> GATE_SHIFT;
+    gate->dev += (dev - gate->dev) >> GATE_SHIFT;
+  }
+  if(gate->samples < GATE_WARMUP)
+    ++gate->samples;
+
+  return TRUE;
+}
+
+/* check the offset from master which Sync 'send', 'recv' would give */
+Boolean gateOffset(TimeInternal *send, TimeInternal *recv, PtpClock *ptpClock)
+{
+  return gateSample(*recv - *send - ptpClock->one_way_delay,
+                    &ptpClock->offset_gate, "offset", ptpClock);
+}
+
+/* check the slave to master delay of Delay_Req 'send', 'recv' */
+Boolean gateDelay(TimeInternal *send, TimeInternal *recv, PtpClock *ptpClock)
+{
+  return gateSample(*recv - *send, &ptpClock->delay_gate, "delay", ptpClock);
+}
+
+void filterShutdown(PtpClock *ptpClock)
+{
+  if(ptpClock->runTimeOpts.gateSigma)
+    INFO("outliers: %u offsets, %u delays rejected\n",
+      ptpClock->offset_gate.rejected, ptpClock->delay_gate.rejected);
+}
@@ -0,0 +1,171 @@
+/* holdover.c */
+
+#include "../ptpd.h"
+
+#include <math.h>
+
+/*
+ * Holdover: while slave, the frequency correction (observed_drift) is
+ * sampled every HOLDOVER_INTERVAL seconds. When the Syncs of the master
+ * stop, the clock is not reset like in initClock() but keeps running
+ * with the frequency predicted from these samples for up to
+ * runTimeOpts.holdover seconds. Once the samples span
+ * HOLDOVER_AGING_SPAN seconds, a straight line is fitted to them which
+ * follows the aging of the oscillator; before that the last
+ * HOLDOVER_AVERAGE samples are averaged. The scatter of the samples
+ * around the model times the time spent in holdover is the estimate of
+ * the time error, on top of the offset when the master disappeared.
+ */
+
+/* sample 'i' counted from the oldest one */
+static int holdoverIndex(int i, Holdover *h)
+{
+  return (h->next - h->count + i + HOLDOVER_HISTORY) % HOLDOVER_HISTORY;
+}
+
+/* seconds since holdover started */
+static double holdoverTime(Holdover *h)
+{
+  return (timerMonotonic() - h->start) / 1000000000.0;
+}
+
+static TimeInternal holdoverError(double t, Holdover *h)
+{
+  return llabs(h->startOffset) + (TimeInternal)(h->sigma * t);
+}
+
+/* PTP_SLAVE: called every HOLDOVER_INTERVAL seconds */
+void holdoverSample(PtpClock *ptpClock)
+{
+  Holdover *h = &ptpClock->holdover;
+
+  /* not settled yet */
+  if(!ptpClock->offset_from_master ||
+     llabs(ptpClock->offset_from_master) > HOLDOVER_MAX_OFFSET)
+    return;
+
+  h->time[h->next] = timerMonotonic();
+  h->drift[h->next] = ptpClock->observed_drift;
+  h->next = (h->next + 1) % HOLDOVER_HISTORY;
+  if(h->count < HOLDOVER_HISTORY)
+    ++h->count;
+
+  DBGV("%sholdover sample %d: %dppb\n", ptpClock->name, h->count, ptpClock->observed_drift);
+}
+
+/* fit the model to the samples, relative to time 'h->start' */
+static void holdoverModel(Holdover *h)
+{
+  double x, y, n, sx = 0, sy = 0, sxx = 0, sxy = 0, det, ss = 0;
+  int i, first = 0;
+
+  h->aging = 0;
+  if(h->count > 2 &&
+     h->time[holdoverIndex(h->count - 1, h)] - h->time[holdoverIndex(0, h)] >=
+     HOLDOVER_AGING_SPAN * 1000000000LL)
+  {
+    for(i = 0; i < h->count; i++)
+    {
+      x = (h->time[holdoverIndex(i, h)] - h->start) / 1000000000.0;
+      y = h->drift[holdoverIndex(i, h)];
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+    }
+    n = h->count;
+    det = n * sxx - sx * sx;
+    if(det > 0)
+      h->aging = (n * sxy - sx * sy) / det;
+    h->frequency = (sy - h->aging * sx) / n;
+  }
+  else
+  {
+    if(h->count > HOLDOVER_AVERAGE)
+      first = h->count - HOLDOVER_AVERAGE;
+    for(i = first; i < h->count; i++)
+      sy += h->drift[holdoverIndex(i, h)];
+    h->frequency = sy / (h->count - first);
+  }
+
+  for(i = first; i < h->count; i++)
+  {
+    x = (h->time[holdoverIndex(i, h)] - h->start) / 1000000000.0;
+    y = h->drift[holdoverIndex(i, h)] - (h->frequency + h->aging * x);
+    ss += y * y;
+  }
+  h->sigma = h->count - first > 1 ? sqrt(ss / (h->count - first - 1)) : 0;
+}
+
+/* apply the frequency predicted for now */
+static void holdoverAdjust(PtpClock *ptpClock)
+{
+  Holdover *h = &ptpClock->holdover;
+
+  ptpClock->observed_drift = clampAdj(h->frequency + h->aging * holdoverTime(h), ADJ_FREQ_MAX);
+  adjTime(-ptpClock->observed_drift, &ptpClock->offset_from_master, ptpClock);
+}
+
+/*
+ * The master disappeared while slave: go into holdover instead of
+ * resetting the clock. FALSE if holdover is disabled or there is no
+ * frequency to hold yet.
+ */
+Boolean startHoldover(PtpClock *ptpClock)
+{
+  Holdover *h = &ptpClock->holdover;
+
+  if(!ptpClock->runTimeOpts.holdover || !h->count ||
+     (ptpClock->runTimeOpts.noAdjust && !ptpClock->nic_instead_of_system))
+    return FALSE;
+
+  h->active = TRUE;
+  h->start = timerMonotonic();
+  h->startOffset = ptpClock->offset_from_master;
+  holdoverModel(h);
+  holdoverAdjust(ptpClock);
+
+  NOTIFY("%sholdover with %dppb, aging %.3fppb/h, error grows by %.1fns/s\n",
+         ptpClock->name, ptpClock->observed_drift, h->aging * 3600, h->sigma);
+
+  return TRUE;
+}
+
+/* not PTP_SLAVE: called every HOLDOVER_INTERVAL seconds */
+void updateHoldover(PtpClock *ptpClock)
+{
+  Holdover *h = &ptpClock->holdover;
+  double t = holdoverTime(h);
+
+  if(!h->active)
+    return;
+
+  if(t >= ptpClock->runTimeOpts.holdover)
+  {
+    NOTIFY("%sholdover expired after %.0fs, estimated time error %lldns\n",
+           ptpClock->name, t, holdoverError(t, h));
+    /* nothing better than the last frequency, but a new master gets calibrated again */
+    h->active = FALSE;
+    return;
+  }
+
+  if(h->aging)
+    holdoverAdjust(ptpClock);
+
+  INFO("%sholdover for %.0fs, frequency %dppb, estimated time error %lldns\n",
+       ptpClock->name, t, ptpClock->observed_drift, holdoverError(t, h));
+}
+
+/* a master is back, the servo continues from the held frequency */
+void stopHoldover(PtpClock *ptpClock)
+{
+  Holdover *h = &ptpClock->holdover;
+  double t = holdoverTime(h);
+
+  if(!h->active)
+    return;
+
+  NOTIFY("%sholdover ended after %.0fs, estimated time error %lldns\n",
+         ptpClock->name, t, holdoverError(t, h));
+  h->active = FALSE;
+}
@@ -0,0 +1,195 @@
+/* latency.c */
+
+#include "../ptpd.h"
+
+#ifdef PTPD_LATENCY
+
+/*
+ * Latency of the path from a received Sync (or Follow_Up) to the
+ * correction of the clock, built with -DPTPD_LATENCY; otherwise the
+ * LATENCY_* macros expand to nothing.
+ *
+ * handle() starts a record for every packet; the following points
+ * only count when they come in order, so packets which do not lead to
+ * a correction, the calibration and the corrections outside of the
+ * Sync path (initClock(), the system clock of -z both) leave no
+ * sample. Points are read from CLOCK_MONOTONIC_RAW. The time from the
+ * receive time stamp to handle() is added where the time stamps are in
+ * system time.
+ *
+ * Every stage has a histogram with LATENCY_SUB_BUCKETS buckets per
+ * power of two (at most 1/16 relative error, like HDR histograms with
+ * one significant digit). SIGUSR1 and the shutdown print them.
+ */
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+typedef enum {
+  STAGE_SOCKET,    /**< receive time stamp -> handle() */
+  STAGE_DISPATCH,  /**< handle() -> handleSync()/handleFollowUp() */
+  STAGE_GATE,      /**< -> updateOffset() */
+  STAGE_FILTER,    /**< -> updateClock() */
+  STAGE_SERVO,     /**< -> adjTime() */
+  STAGE_ADJUST,    /**< adjTime() itself */
+  STAGE_TOTAL,     /**< handle() -> adjTime() returned */
+  STAGE_MAX
+} LatencyStage;
+
+static const char *stageNames[STAGE_MAX] = {
+  "socket", "dispatch", "gate", "filter", "servo", "adjust", "total"
+};
+
+typedef struct {
+  UInteger32 count;
+  Integer64 min, max;
+  UInteger32 buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+static LatencyHistogram histograms[STAGE_MAX];
+
+/* the sample in progress */
+static Integer64 marks[LATENCY_POINTS];
+static Integer64 socketDelay;
+static LatencyPoint next = LATENCY_POINTS;
+
+static volatile sig_atomic_t dumpRequested;
+
+static Integer64 rawNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return TIMESPEC_NSEC(ts);
+}
+
+static int bucketIndex(Integer64 value)
+{
+  int shift;
+
+  if(value < LATENCY_SUB_BUCKETS)
+    return value < 0 ? 0 : value;
+  shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+  return ((shift + 1) << LATENCY_SUB_BITS) + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the largest value in bucket 'index' */
+static Integer64 bucketValue(int index)
+{
+  int shift;
+
+  if(index < LATENCY_SUB_BUCKETS)
+    return index;
+  shift = (index >> LATENCY_SUB_BITS) - 1;
+  return ((Integer64)(LATENCY_SUB_BUCKETS + (index & (LATENCY_SUB_BUCKETS - 1)) + 1) << shift) - 1;
+}
+
+static void record(LatencyStage stage, Integer64 value)
+{
+  LatencyHistogram *histogram = &histograms[stage];
+
+  if(!histogram->count || value < histogram->min)
+    histogram->min = value;
+  if(!histogram->count || value > histogram->max)
+    histogram->max = value;
+  ++histogram->count;
+  ++histogram->buckets[bucketIndex(value)];
+}
+
+static Integer64 percentile(LatencyHistogram *histogram, double fraction)
+{
+  UInteger32 sum = 0, rank = fraction * histogram->count + 0.5;
+  int i;
+
+  if(rank < 1)
+    rank = 1;
+  for(i = 0; i < LATENCY_BUCKETS; i++) {
+    sum += histogram->buckets[i];
+    if(sum >= rank)
+      return bucketValue(i) < histogram->max ? bucketValue(i) : histogram->max;
+  }
+  return histogram->max;
+}
+
+void latencyMark(LatencyPoint point)
+{
+  Integer64 now = rawNow();
+  int i;
+
+  if(point == LATENCY_RECV)
+  {
+    marks[LATENCY_RECV] = now;
+    socketDelay = -1;
+    next = LATENCY_HANDLER;
+    return;
+  }
+
+  if(point != next)
+    return;
+  marks[point] = now;
+  next = point + 1;
+  if(point != LATENCY_DONE)
+    return;
+
+  if(socketDelay >= 0)
+    record(STAGE_SOCKET, socketDelay);
+  for(i = LATENCY_RECV; i < LATENCY_DONE; i++)
+    record(STAGE_DISPATCH + i, marks[i + 1] - marks[i]);
+  record(STAGE_TOTAL, marks[LATENCY_DONE] - marks[LATENCY_RECV]);
+}
+
+/* the packet of the last LATENCY_RECV has the receive time stamp 'stamp' */
+void latencyArrival(TimeInternal *stamp, PtpClock *ptpClock)
+{
+  struct timespec system;
+
+  /* no time stamp, or not in system time */
+  if(next != LATENCY_HANDLER || !*stamp ||
+     ptpClock->timeBackend->getTime != systemGetTime)
+    return;
+  /* not timerNow(), which would end up in a capture */
+  clock_gettime(CLOCK_REALTIME, &system);
+  socketDelay = TIMESPEC_NSEC(system) - *stamp - (rawNow() - marks[LATENCY_RECV]);
+  if(socketDelay < 0)
+    socketDelay = 0;
+}
+
+static void latencySignal(int sig)
+{
+  dumpRequested = TRUE;
+}
+
+void latencyInit(void)
+{
+  signal(SIGUSR1, latencySignal);
+}
+
+void latencyDump(void)
+{
+  LatencyHistogram *histogram;
+  int i;
+
+  for(i = 0; i < STAGE_MAX; i++)
+  {
+    histogram = &histograms[i];
+    if(!histogram->count)
+      continue;
+    INFO("latency %-8s %8u samples, min %lld, 50%% %lld, 90%% %lld, 99%% %lld, 99.9%% %lld, max %lldns\n",
+         stageNames[i], histogram->count, histogram->min,
+         percentile(histogram, 0.5), percentile(histogram, 0.9),
+         percentile(histogram, 0.99), percentile(histogram, 0.999),
+         histogram->max);
+  }
+}
+
+/* called by the protocol loop: dump if SIGUSR1 asked for it */
+void latencyPoll(void)
+{
+  if(!dumpRequested)
+    return;
+  dumpRequested = FALSE;
+  latencyDump();
+}
+
+#endif /* PTPD_LATENCY */
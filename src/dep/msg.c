@@ -3,6 +3,40 @@
 
 #include "../ptpd.h"
 
+/*
+ * On the wire a time is an unsigned seconds field followed by a
+ * nanoseconds field with the sign in its top bit. Seconds beyond
+ * INT_MAX are reported as belonging to the second half epoch.
+ * These are the only places where TimeInternal is converted.
+ */
+static void msgUnpackTime(void *buf, TimeInternal *time, Boolean *halfEpoch)
+{
+  UInteger32 seconds = flip32(*(UInteger32*)(buf + 0));
+  UInteger32 nanoseconds = flip32(*(UInteger32*)(buf + 4));
+  
+  *halfEpoch = seconds / INT_MAX;
+  *time = (seconds % INT_MAX) * 1000000000LL + (nanoseconds & INT_MAX);
+  if(nanoseconds & ~INT_MAX)
+    *time = -*time;
+  
+  DBGV("msgUnpackTime: %lldns <- %10us %11dns\n", *time, seconds, nanoseconds);
+}
+
+static void msgPackTime(void *buf, TimeInternal time, Boolean halfEpoch)
+{
+  UInteger32 seconds, nanoseconds;
+  
+  seconds = llabs(time) / 1000000000 + halfEpoch * INT_MAX;
+  nanoseconds = llabs(time) % 1000000000;
+  if(time < 0)
+    nanoseconds |= ~INT_MAX;
+  
+  *(Integer32*)(buf + 0) = flip32(seconds);
+  *(Integer32*)(buf + 4) = flip32(nanoseconds);
+  
+  DBGV("msgPackTime: %lldns -> %10us %11dns\n", time, seconds, nanoseconds);
+}
+
 Boolean msgPeek(void *buf, ssize_t length)
 {
   /* not imlpemented yet */
@@ -43,10 +77,8 @@ void msgUnpackHeader(void *buf, MsgHeader *header)
 
 void msgUnpackSync(void *buf, MsgSync *sync)
 {
-  sync->originTimestamp.seconds = flip32(*(UInteger32*)(buf + 40));
-  DBGV("msgUnpackSync: originTimestamp.seconds %u\n", sync->originTimestamp.seconds);
-  sync->originTimestamp.nanoseconds = flip32(*(Integer32*)(buf + 44));
-  DBGV("msgUnpackSync: originTimestamp.nanoseconds %d\n", sync->originTimestamp.nanoseconds);
+  msgUnpackTime(buf + 40, &sync->originTimestamp, &sync->halfEpoch);
+  DBGV("msgUnpackSync: originTimestamp %lld\n", sync->originTimestamp);
   sync->epochNumber = flip16(*(UInteger16*)(buf + 48));
   DBGV("msgUnpackSync: epochNumber %d\n", sync->epochNumber);
   sync->currentUTCOffset = flip16(*(Integer16*)(buf + 50));
@@ -107,18 +139,14 @@ void msgUnpackFollowUp(void *buf, MsgFollowUp *follow)
 {
   follow->associatedSequenceId = flip16(*(UInteger16*)(buf + 42));
   DBGV("msgUnpackFollowUp: associatedSequenceId %u\n", follow->associatedSequenceId);
-  follow->preciseOriginTimestamp.seconds = flip32(*(UInteger32*)(buf + 44));
-  DBGV("msgUnpackFollowUp: preciseOriginTimestamp.seconds %u\n", follow->preciseOriginTimestamp.seconds);
-  follow->preciseOriginTimestamp.nanoseconds = flip32(*(Integer32*)(buf + 48));
-  DBGV("msgUnpackFollowUp: preciseOriginTimestamp.nanoseconds %d\n", follow->preciseOriginTimestamp.nanoseconds);
+  msgUnpackTime(buf + 44, &follow->preciseOriginTimestamp, &follow->halfEpoch);
+  DBGV("msgUnpackFollowUp: preciseOriginTimestamp %lld\n", follow->preciseOriginTimestamp);
 }
 
 void msgUnpackDelayResp(void *buf, MsgDelayResp *resp)
 {
-  resp->delayReceiptTimestamp.seconds = flip32(*(UInteger32*)(buf + 40));
-  DBGV("msgUnpackDelayResp: delayReceiptTimestamp.seconds %u\n", resp->delayReceiptTimestamp.seconds);
-  resp->delayReceiptTimestamp.nanoseconds = flip32(*(Integer32*)(buf + 44));
-  DBGV("msgUnpackDelayResp: delayReceiptTimestamp.nanoseconds %d\n", resp->delayReceiptTimestamp.nanoseconds);
+  msgUnpackTime(buf + 40, &resp->delayReceiptTimestamp, &resp->halfEpoch);
+  DBGV("msgUnpackDelayResp: delayReceiptTimestamp %lld\n", resp->delayReceiptTimestamp);
   resp->requestingSourceCommunicationTechnology = *(UInteger8*)(buf + 49);
   DBGV("msgUnpackDelayResp: requestingSourceCommunicationTechnology %d\n", resp->requestingSourceCommunicationTechnology);
   memcpy(resp->requestingSourceUuid, (buf + 50), 6);
@@ -158,7 +186,6 @@ UInteger8 msgUnloadManagement(void *buf, MsgManagement *manage,
   PtpClock *ptpClock)
 {
   TimeInternal internalTime;
-  TimeRepresentation externalTime;
   
   switch(manage->managementMessageKey)
   {
@@ -212,9 +239,7 @@ UInteger8 msgUnloadManagement(void *buf, MsgManagement *manage,
     break;
     
   case PTP_MM_SET_TIME:
-    externalTime.seconds = flip32(*(UInteger32*)(buf + 60));
-    externalTime.nanoseconds = flip32(*(Integer32*)(buf + 64));
-    toInternalTime(&internalTime, &externalTime, &ptpClock->halfEpoch);
+    msgUnpackTime(buf + 60, &internalTime, &ptpClock->halfEpoch);
     setTime(&internalTime, ptpClock);
     break;
     
@@ -373,7 +398,7 @@ void msgPackHeader(void *buf, PtpClock *ptpClock)
 }
 
 void msgPackSync(void *buf, Boolean burst, Boolean ptpAssist,
-  TimeRepresentation *originTimestamp, PtpClock *ptpClock)
+  TimeInternal *originTimestamp, PtpClock *ptpClock)
 {
   *(UInteger8*)(buf +20) = 1;  /* messageType */
   *(Integer32*)(buf + 28) = shift16(flip16(ptpClock->port_id_field), 0) | shift16(flip16(ptpClock->last_sync_event_sequence_number), 1);
@@ -395,8 +420,7 @@ void msgPackSync(void *buf, Boolean burst, Boolean ptpAssist,
   else
     clearFlag((buf + 34), PTP_ASSIST);
   
-  *(Integer32*)(buf + 40) = flip32(originTimestamp->seconds);
-  *(Integer32*)(buf + 44) = flip32(originTimestamp->nanoseconds);
+  msgPackTime(buf + 40, *originTimestamp, ptpClock->halfEpoch);
   *(Integer32*)(buf + 48) = shift16(flip16(ptpClock->epoch_number), 0) | shift16(flip16(ptpClock->current_utc_offset), 1);
   *(Integer32*)(buf + 52) = shift8(ptpClock->grandmaster_communication_technology, 1);
   memcpy((buf + 54), ptpClock->grandmaster_uuid_field, 6);
@@ -419,7 +443,7 @@ void msgPackSync(void *buf, Boolean burst, Boolean ptpAssist,
 }
 
 void msgPackDelayReq(void *buf, Boolean burst, Boolean ptpAssist,
-  TimeRepresentation *originTimestamp, PtpClock *ptpClock)
+  TimeInternal *originTimestamp, PtpClock *ptpClock)
 {
   *(UInteger8*)(buf + 20) = 1;  /* messageType */
   *(Integer32*)(buf + 28) = shift16(flip16(ptpClock->port_id_field), 0) | shift16(flip16(ptpClock->last_sync_event_sequence_number), 1);
@@ -437,8 +461,7 @@ void msgPackDelayReq(void *buf, Boolean burst, Boolean ptpAssist,
   else
     clearFlag((buf + 34), PTP_ASSIST);
   
-  *(Integer32*)(buf + 40) = flip32(originTimestamp->seconds);
-  *(Integer32*)(buf + 44) = flip32(originTimestamp->nanoseconds);
+  msgPackTime(buf + 40, *originTimestamp, ptpClock->halfEpoch);
   *(Integer32*)(buf + 48) = shift16(flip16(ptpClock->epoch_number), 0) | shift16(flip16(ptpClock->current_utc_offset), 1);
   *(Integer32*)(buf + 52) = shift8(ptpClock->grandmaster_communication_technology, 1);
   memcpy((buf + 54), ptpClock->grandmaster_uuid_field, 6);
@@ -461,7 +484,7 @@ void msgPackDelayReq(void *buf, Boolean burst, Boolean ptpAssist,
 }
 
 void msgPackFollowUp(void *buf, UInteger16 associatedSequenceId,
-  TimeRepresentation *preciseOriginTimestamp, PtpClock *ptpClock)
+  TimeInternal *preciseOriginTimestamp, PtpClock *ptpClock)
 {
   *(UInteger8*)(buf + 20) = 2;  /* messageType */
   *(Integer32*)(buf + 28) = shift16(flip16(ptpClock->port_id_field), 0) | shift16(flip16(ptpClock->last_general_event_sequence_number), 1);
@@ -471,12 +494,11 @@ void msgPackFollowUp(void *buf, UInteger16 associatedSequenceId,
   clearFlag((buf + 34), PTP_ASSIST);
   
   *(Integer32*)(buf + 40) = shift16(flip16(associatedSequenceId), 1);
-  *(Integer32*)(buf + 44) = flip32(preciseOriginTimestamp->seconds);
-  *(Integer32*)(buf + 48) = flip32(preciseOriginTimestamp->nanoseconds);
+  msgPackTime(buf + 44, *preciseOriginTimestamp, ptpClock->halfEpoch);
 }
 
 void msgPackDelayResp(void *buf, MsgHeader *header,
-  TimeRepresentation *delayReceiptTimestamp, PtpClock *ptpClock)
+  TimeInternal *delayReceiptTimestamp, PtpClock *ptpClock)
 {
   *(UInteger8*)(buf + 20) = 2;  /* messageType */
   *(Integer32*)(buf + 28) = shift16(flip16(ptpClock->port_id_field), 0) | shift16(flip16(ptpClock->last_general_event_sequence_number), 1);
@@ -485,8 +507,7 @@ void msgPackDelayResp(void *buf, MsgHeader *header,
   clearFlag((buf + 34), PARENT_STATS);
   clearFlag((buf + 34), PTP_ASSIST);
   
-  *(Integer32*)(buf + 40) = flip32(delayReceiptTimestamp->seconds);
-  *(Integer32*)(buf + 44) = flip32(delayReceiptTimestamp->nanoseconds);
+  msgPackTime(buf + 40, *delayReceiptTimestamp, ptpClock->halfEpoch);
   *(Integer32*)(buf + 48) = shift8(header->sourceCommunicationTechnology, 1);
   memcpy(buf + 50, header->sourceUuid, 6);
   *(Integer32*)(buf + 56) = shift16(flip16(header->sourcePortId), 0) | shift16(flip16(header->sequenceId), 1);
@@ -523,7 +544,6 @@ UInteger16 msgPackManagement(void *buf, MsgManagement *manage, PtpClock *ptpCloc
 UInteger16 msgPackManagementResponse(void *buf, MsgHeader *header, MsgManagement *manage, PtpClock *ptpClock)
 {
   TimeInternal internalTime;
-  TimeRepresentation externalTime;
   
   *(UInteger8*)(buf + 20) = 2;  /* messageType */
   *(Integer32*)(buf + 28) = shift16(flip16(ptpClock->port_id_field), 0) | shift16(flip16(ptpClock->last_general_event_sequence_number), 1);
@@ -572,13 +592,8 @@ UInteger16 msgPackManagementResponse(void *buf, MsgHeader *header, MsgManagement
     *(Integer32*)(buf + 56) = shift16(flip16(20), 1);
     *(Integer32*)(buf + 60) = shift16(flip16(ptpClock->steps_removed), 1);
     
-    fromInternalTime(&ptpClock->offset_from_master, &externalTime, 0);
-    *(Integer32*)(buf + 64) = flip32(externalTime.seconds);
-    *(Integer32*)(buf + 68) = flip32(externalTime.nanoseconds);
-    
-    fromInternalTime(&ptpClock->one_way_delay, &externalTime, 0);
-    *(Integer32*)(buf + 72) = flip32(externalTime.seconds);
-    *(Integer32*)(buf + 76) = flip32(externalTime.nanoseconds);
+    msgPackTime(buf + 64, ptpClock->offset_from_master, FALSE);
+    msgPackTime(buf + 72, ptpClock->one_way_delay, FALSE);
     return 80;
     
   case PTP_MM_GET_PARENT_DATA_SET:
@@ -635,9 +650,7 @@ UInteger16 msgPackManagementResponse(void *buf, MsgHeader *header, MsgManagement
     *(Integer32*)(buf + 56) = shift16(flip16(24), 1);
     
     getTime(&internalTime, ptpClock);
-    fromInternalTime(&internalTime, &externalTime, ptpClock->halfEpoch);
-    *(Integer32*)(buf + 60) = flip32(externalTime.seconds);
-    *(Integer32*)(buf + 64) = flip32(externalTime.nanoseconds);
+    msgPackTime(buf + 60, internalTime, ptpClock->halfEpoch);
     
     *(Integer32*)(buf + 68) = shift16(flip16(ptpClock->current_utc_offset), 1);
     *(Integer32*)(buf + 72) = shift8(ptpClock->leap_59, 3);
@@ -1,7 +1,14 @@
 /* net.c */
 
+#define _GNU_SOURCE /* recvmmsg() */
 #include "../ptpd.h"
 
+#ifdef SO_TIMESTAMPNS
+# define NET_SO_TIMESTAMP SO_TIMESTAMPNS
+#else
+# define NET_SO_TIMESTAMP SO_TIMESTAMP
+#endif
+
 Boolean lookupSubdomainAddress(Octet *subdomainName, Octet *subdomainAddress)
 {
   UInteger32 h;
@@ -224,7 +231,7 @@ UInteger32 findIface(Octet *ifaceName, UInteger8 *communicationTechnology,
 /* must specify 'subdomainName', optionally 'ifaceName', if not then pass ifaceName == "" */
 /* returns other args */
 /* on socket options, see the 'socket(7)' and 'ip' man pages */
-Boolean netInit(PtpClock *ptpClock)
+static Boolean netOpen(PtpClock *ptpClock)
 {
   int temp, i;
   struct in_addr interfaceAddr, netAddr;
@@ -351,30 +358,210 @@ Boolean netInit(PtpClock *ptpClock)
     return FALSE;
   }
 
-  /* make timestamps available through recvmsg() (only needed for time stamping with system clock) */
+  /*
+   * make timestamps available through recvmsg() (only needed for time
+   * stamping with system clock), with nanosecond resolution if possible
+   */
   temp = useSystemTimeStamps;
-  if( setsockopt(ptpClock->netPath.eventSock, SOL_SOCKET, SO_TIMESTAMP, &temp, sizeof(int)) < 0
-    || setsockopt(ptpClock->netPath.generalSock, SOL_SOCKET, SO_TIMESTAMP, &temp, sizeof(int)) < 0 )
+  if( setsockopt(ptpClock->netPath.eventSock, SOL_SOCKET, NET_SO_TIMESTAMP, &temp, sizeof(int)) < 0
+    || setsockopt(ptpClock->netPath.generalSock, SOL_SOCKET, NET_SO_TIMESTAMP, &temp, sizeof(int)) < 0 )
   {
     PERROR("failed to enable receive time stamps");
     return FALSE;
   }
 
+  /* wait for both sockets in one event loop */
+  if( !eventInit(ptpClock)
+    || !eventAdd(ptpClock->netPath.eventSock, EVENT_EVENT_SOCK, ptpClock)
+    || !eventAdd(ptpClock->netPath.generalSock, EVENT_GENERAL_SOCK, ptpClock) )
+    return FALSE;
+
   return TRUE;
 }
 
+/* a replay gets interface and packets from the capture, see capture.c */
+Boolean netInit(PtpClock *ptpClock)
+{
+  if(!captureReplaying())
+    return captureNet(netOpen(ptpClock), ptpClock);
+
+  DBG("netInit: replay\n");
+  ptpClock->netPath.eventSock = ptpClock->netPath.generalSock = -1;
+  return eventInit(ptpClock) && captureNet(FALSE, ptpClock);
+}
+
+/* log how many datagrams each recvmmsg() call returned */
+static void netDumpBatches(const char *name, NetRecvBatch *batch)
+{
+  int i, len = 0;
+  char sbuf[NET_RECV_BATCH_MAX * 16];
+  
+  for(i = 1; i <= NET_RECV_BATCH_MAX; ++i)
+    if(batch->batches[i])
+      len += sprintf(sbuf + len, " %d:%u", i, batch->batches[i]);
+  
+  if(len)
+    INFO("%s receive batches (size:count)%s\n", name, sbuf);
+}
+
+/*
+ * Request send time stamps via the error queue of eventSock. Each
+ * bounce is tagged with a per-socket counter if the kernel supports
+ * SOF_TIMESTAMPING_OPT_ID, otherwise netRecvEvent() has to identify
+ * the message by its sequenceId.
+ */
+Boolean netEnableTimeStamping(int flags, PtpClock *ptpClock)
+{
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+  int keyed = flags|SOF_TIMESTAMPING_OPT_ID;
+  
+  memset(ptpClock->netPath.pendingSends, 0, sizeof(ptpClock->netPath.pendingSends));
+  ptpClock->netPath.nextPendingSend = 0;
+  ptpClock->netPath.sendKey = 0;
+  ptpClock->netPath.sendKeys = TRUE;
+  ptpClock->netPath.stampIndex =
+    (flags & SOF_TIMESTAMPING_RAW_HARDWARE) ? 2 :
+    (flags & SOF_TIMESTAMPING_SYS_HARDWARE) ? 1 : 0;
+  
+  if(setsockopt(ptpClock->netPath.eventSock, SOL_SOCKET, SO_TIMESTAMPING, &keyed, sizeof(keyed)) < 0)
+  {
+    if(errno != EINVAL)
+    {
+      PERROR("net_tstamp SO_TIMESTAMPING: %s", strerror(errno));
+      return FALSE;
+    }
+    
+    DBG("SOF_TIMESTAMPING_OPT_ID not supported, matching send time stamps by sequence id\n");
+    ptpClock->netPath.sendKeys = FALSE;
+    if(setsockopt(ptpClock->netPath.eventSock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+      PERROR("net_tstamp SO_TIMESTAMPING: %s", strerror(errno));
+      return FALSE;
+    }
+  }
+  
+  ptpClock->netPath.sendBounce = TRUE;
+  return TRUE;
+#else
+  ERROR("SO_TIMESTAMPING not supported\n");
+  return FALSE;
+#endif
+}
+
+/* remember an event message until its send time stamp comes back */
+static void netAddPendingSend(Octet *buf, UInteger16 length, PtpClock *ptpClock)
+{
+  NetPendingSend *pending = &ptpClock->netPath.pendingSends[ptpClock->netPath.nextPendingSend];
+  
+  if(pending->valid)
+  {
+    ++ptpClock->netPath.lostBounces;
+    DBG("no send time stamp for message %d\n", pending->sequenceId);
+  }
+  
+  pending->valid = TRUE;
+  pending->key = ptpClock->netPath.sendKey;
+  pending->sequenceId = flip16(*(UInteger16*)(buf + 30));
+  pending->control = *(UInteger8*)(buf + 32);
+  pending->length = length;
+  
+  ptpClock->netPath.nextPendingSend = (ptpClock->netPath.nextPendingSend + 1) % NET_PENDING_SENDS;
+}
+
+ssize_t netSendEvent(Octet *buf, UInteger16 length, PtpClock *ptpClock)
+{
+  ssize_t ret;
+  struct sockaddr_in addr;
+  
+  captureSend(CAPTURE_SEND_EVENT, buf, length);
+  if(captureReplaying())
+    return length;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PTP_EVENT_PORT);
+  addr.sin_addr.s_addr = ptpClock->netPath.multicastAddr;
+
+  /*
+   * The send time stamp is not waited for here: either it comes back
+   * through the socket (loop back, error queue) or the protocol polls
+   * for it, see checkPendingSend(). Only messages which were sent
+   * get a pending entry, the bounce is read later in the event loop.
+   */
+  ret = sendto(ptpClock->netPath.eventSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+  if(ret <= 0)
+    DBG("error sending multi-cast event message\n");
+  else
+  {
+    if(ptpClock->netPath.sendBounce)
+      netAddPendingSend(buf, length, ptpClock);
+    ++ptpClock->netPath.sendKey;
+    e1000SimPacket(TRUE, buf, length, ptpClock);
+  }
+
+  /**
+   * @TODO: why is the packet sent twice when unicast is enabled?
+   * The second send time stamp is not in the pending table: with
+   * keyed bounces it gets dropped, otherwise whichever bounce of
+   * the two arrives first is used.
+   */
+  if(ptpClock->netPath.unicastAddr)
+  {
+    addr.sin_addr.s_addr = ptpClock->netPath.unicastAddr;
+    
+    ret = sendto(ptpClock->netPath.eventSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+    if(ret <= 0)
+      DBG("error sending uni-cast event message\n");
+    else
+    {
+      ++ptpClock->netPath.sendKey;
+      e1000SimPacket(TRUE, buf, length, ptpClock);
+    }
+  }
+  
+  return ret;
+}
+
+ssize_t netSendGeneral(Octet *buf, UInteger16 length, PtpClock *ptpClock)
+{
+  ssize_t ret;
+  struct sockaddr_in addr;
+  
+  captureSend(CAPTURE_SEND_GENERAL, buf, length);
+  if(captureReplaying())
+    return length;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PTP_GENERAL_PORT);
+  addr.sin_addr.s_addr = ptpClock->netPath.multicastAddr;
+  
+  ret = sendto(ptpClock->netPath.generalSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+  if(ret <= 0)
+    DBG("error sending multi-cast general message\n");
+  
+  if(ptpClock->netPath.unicastAddr)
+  {
+    addr.sin_addr.s_addr = ptpClock->netPath.unicastAddr;
+    
+    ret = sendto(ptpClock->netPath.generalSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+    if(ret <= 0)
+      DBG("error sending uni-cast general message\n");
+  }
+  
+  return ret;
+}
+
 /* shut down the UDP stuff */
 Boolean netShutdown(PtpClock *ptpClock)
 {
   struct ip_mreq imr;
 
 #ifdef HAVE_LINUX_NET_TSTAMP_H
-  if (ptpClock->runTimeOpts.time == TIME_SYSTEM_LINUX_HW &&
+  if (ptpClock->netPath.stampIndex > 0 &&
       ptpClock->netPath.eventSock > 0) {
       struct hwtstamp_config hwconfig;
 
       ptpClock->netPath.eventSockIFR.ifr_data = (void *)&hwconfig;
-      memset(&hwconfig, 0, sizeof(&hwconfig));
+      memset(&hwconfig, 0, sizeof(hwconfig));
 
       hwconfig.tx_type = HWTSTAMP_TX_OFF;
       hwconfig.rx_filter = HWTSTAMP_FILTER_NONE;
@@ -384,6 +571,20 @@ Boolean netShutdown(PtpClock *ptpClock)
   }
 #endif
 
+  eventShutdown(ptpClock);
+
+  netDumpBatches("event", &ptpClock->netPath.eventBatch);
+  netDumpBatches("general", &ptpClock->netPath.generalBatch);
+  memset(&ptpClock->netPath.eventBatch, 0, sizeof(ptpClock->netPath.eventBatch));
+  memset(&ptpClock->netPath.generalBatch, 0, sizeof(ptpClock->netPath.generalBatch));
+
+  if(ptpClock->netPath.sendBounce)
+    INFO("send time stamps: %u lost, %u unmatched\n",
+      ptpClock->netPath.lostBounces, ptpClock->netPath.unmatchedBounces);
+  ptpClock->netPath.sendBounce = FALSE;
+  ptpClock->netPath.stampIndex = 0;
+  ptpClock->netPath.lostBounces = ptpClock->netPath.unmatchedBounces = 0;
+
   imr.imr_multiaddr.s_addr = ptpClock->netPath.multicastAddr;
   imr.imr_interface.s_addr = htonl(INADDR_ANY);
 
@@ -404,131 +605,37 @@ Boolean netShutdown(PtpClock *ptpClock)
   return TRUE;
 }
 
+/*
+ * wait for input on the sockets (or any other source registered with
+ * the event loop), returns the EVENT_* bits of the ready sources
+ */
 int netSelect(TimeInternal *timeout, PtpClock *ptpClock)
 {
-  int ret, nfds;
-  fd_set readfds;
-  struct timeval tv, *tv_ptr;
-  
-  if(timeout < 0)
-    return FALSE;
-  
-  FD_ZERO(&readfds);
-  FD_SET(ptpClock->netPath.eventSock, &readfds);
-  FD_SET(ptpClock->netPath.generalSock, &readfds);
-  
-  if(timeout)
-  {
-    tv.tv_sec = timeout->seconds;
-    tv.tv_usec = timeout->nanoseconds/1000;
-    tv_ptr = &tv;
-  }
-  else
-    tv_ptr = 0;
-  
-  if(ptpClock->netPath.eventSock > ptpClock->netPath.generalSock)
-    nfds = ptpClock->netPath.eventSock;
-  else
-    nfds = ptpClock->netPath.generalSock;
-  
-  ret = select(nfds + 1, &readfds, 0, 0, tv_ptr) > 0;
-  if(ret < 0)
-  {
-    if(errno == EAGAIN || errno == EINTR)
-      return 0;
-  }
-  
-  return ret;
+  if(captureReplaying())
+    return captureSelect(0);
+
+  /* datagrams already drained by recvmmsg() are not signalled again */
+  if(netRecvPending(ptpClock))
+    return captureSelect(EVENT_EVENT_SOCK|EVENT_GENERAL_SOCK);
+
+  return captureSelect(eventWait(timeout, ptpClock));
 }
 
-ssize_t netRecvEvent(Octet *buf, TimeInternal *time, PtpClock *ptpClock)
+/*
+ * Extract the receive time stamp from the ancillary data of 'msg'.
+ * Returns FALSE if there is none.
+ */
+static Boolean netGetTimeStamp(struct msghdr *msg, struct timespec *stamp, PtpClock *ptpClock)
 {
-  ssize_t ret = 0;
-  struct msghdr msg;
-  struct iovec vec[1];
-  struct sockaddr_in from_addr;
-  union {
-      struct cmsghdr cm;
-      char control[512];
-  } cmsg_un;
   struct cmsghdr *cmsg;
-  Boolean have_time;
-  
-  vec[0].iov_base = buf;
-  vec[0].iov_len = PACKET_SIZE;
-  
-  memset(&msg, 0, sizeof(msg));
-  memset(&from_addr, 0, sizeof(from_addr));
-  memset(buf, 0, PACKET_SIZE);
-  memset(&cmsg_un, 0, sizeof(cmsg_un));
-  
-  msg.msg_name = (caddr_t)&from_addr;
-  msg.msg_namelen = sizeof(from_addr);
-  msg.msg_iov = vec;
-  msg.msg_iovlen = 1;
-  msg.msg_control = cmsg_un.control;
-  msg.msg_controllen = sizeof(cmsg_un.control);
-  msg.msg_flags = 0;
-
-#ifdef HAVE_LINUX_NET_TSTAMP_H
-  if(ptpClock->runTimeOpts.time == TIME_SYSTEM_LINUX_HW ||
-     ptpClock->runTimeOpts.time == TIME_SYSTEM_LINUX_SW) {
-      ret = recvmsg(ptpClock->netPath.eventSock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT);
-      if(ret <= 0) {
-          if (errno != EAGAIN && errno != EINTR)
-              return ret;
-      } else {
-          /*
-           * strip network transport header: assumes that this is the
-           * most recently sent message
-           */
-          if(ret > ptpClock->netPath.lastNetSendEventLength) {
-              memmove(buf,
-                      buf + ret - ptpClock->netPath.lastNetSendEventLength,
-                      ptpClock->netPath.lastNetSendEventLength);
-              ret = ptpClock->netPath.lastNetSendEventLength;
-          } else {
-              /* No clue what this message is. Skip it. */
-              PERROR("received unexpected bounce via error queue");
-              ret = 0;
-          }
-      }
-  }
-#endif /* HAVE_LINUX_NET_TSTAMP_H */
-
-  if(ret <= 0) {
-      ret = recvmsg(ptpClock->netPath.eventSock, &msg, MSG_DONTWAIT);
-  }
-  if(ret <= 0)
-  {
-    if(errno == EAGAIN || errno == EINTR)
-      return 0;
-    
-    return ret;
-  }
-  
-  if(msg.msg_flags&MSG_TRUNC)
-  {
-    ERROR("received truncated message\n");
-    return 0;
-  }
-  
-  /* get time stamp of packet? */
-  if(!time)
-  {
-    /* caller does not need time (probably wasn't even enabled) */
-    return ret;
-  }
   
-  if(msg.msg_flags&MSG_CTRUNC)
+  if(msg->msg_flags&MSG_CTRUNC)
   {
     ERROR("received truncated ancillary data\n");
-    return 0;
+    return FALSE;
   }
   
-  for (cmsg = CMSG_FIRSTHDR(&msg), have_time = FALSE;
-       !have_time && cmsg != NULL;
-       cmsg = CMSG_NXTHDR(&msg, cmsg))
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
   {
     if (cmsg->cmsg_level == SOL_SOCKET) {
       switch (cmsg->cmsg_type) {
@@ -538,32 +645,40 @@ ssize_t netRecvEvent(Octet *buf, TimeInternal *time, PtpClock *ptpClock)
           {
              ERROR("received short SCM_TIMESTAMP (%d/%d)\n",
                    cmsg->cmsg_len, sizeof(*tv));
-             return 0;
+             return FALSE;
           }
-          time->seconds = tv->tv_sec;
-          time->nanoseconds = tv->tv_usec*1000;
-          have_time = TRUE;
-          break;
+          stamp->tv_sec = tv->tv_sec;
+          stamp->tv_nsec = tv->tv_usec*1000;
+          return TRUE;
       }
+#ifdef SCM_TIMESTAMPNS
+      case SCM_TIMESTAMPNS: {
+          struct timespec *ts = (struct timespec *)CMSG_DATA(cmsg);
+          if(cmsg->cmsg_len < sizeof(*ts))
+          {
+             ERROR("received short SCM_TIMESTAMPNS (%d/%d)\n",
+                   cmsg->cmsg_len, (int)sizeof(*ts));
+             return FALSE;
+          }
+          *stamp = *ts;
+          return TRUE;
+      }
+#endif
 #ifdef HAVE_LINUX_NET_TSTAMP_H
       case SO_TIMESTAMPING: {
           /* array of three time stamps: software, HW, raw HW */
-          struct timespec *stamp =
+          struct timespec *ts =
               (struct timespec *)CMSG_DATA(cmsg);
-          if(cmsg->cmsg_len < sizeof(*stamp) * 3)
+          if(cmsg->cmsg_len < sizeof(*ts) * 3)
           {
              ERROR("received short SO_TIMESTAMPING (%d/%d)\n",
-                   cmsg->cmsg_len, (int)sizeof(*stamp) * 3);
-             return 0;
-          }
-          if (ptpClock->runTimeOpts.time == TIME_SYSTEM_LINUX_HW) {
-              /* look at second element in array which is the HW tstamp */
-              stamp++;
+                   cmsg->cmsg_len, (int)sizeof(*ts) * 3);
+             return FALSE;
           }
-          if (stamp->tv_sec && stamp->tv_nsec) {
-              time->seconds = stamp->tv_sec;
-              time->nanoseconds = stamp->tv_nsec;
-              have_time = TRUE;
+          ts += ptpClock->netPath.stampIndex;
+          if (ts->tv_sec && ts->tv_nsec) {
+              *stamp = *ts;
+              return TRUE;
           }
           break;
       }
@@ -572,29 +687,62 @@ ssize_t netRecvEvent(Octet *buf, TimeInternal *time, PtpClock *ptpClock)
     }
   }
   
-  if(have_time)
-  {
-    DBGV("kernel recv time stamp %us %dns\n", time->seconds, time->nanoseconds);
-  }
-  else
-  {
-    /* do not try to get by with recording the time here, better to fail
-       because the time recorded could be well after the message receive,
-       which would put a big spike in the offset signal sent to the clock servo */
-    DBG("no receive time stamp\n");
-    return 0;
-  }
-
-  return ret;
+  return FALSE;
 }
 
-ssize_t netRecvGeneral(Octet *buf, PtpClock *ptpClock)
+/*
+ * Refill 'batch' with as many datagrams as are available on 'sock',
+ * up to the configured batch size: with recvmmsg() this takes one
+ * system call per wakeup instead of one per packet.
+ */
+static ssize_t netRecvBatch(Integer32 sock, NetRecvBatch *batch, Boolean wantTime, PtpClock *ptpClock)
 {
-  ssize_t ret;
-  struct sockaddr_in addr;
-  socklen_t addr_len = sizeof(struct sockaddr_in);
+  int i, ret, size = ptpClock->runTimeOpts.recvBatch;
+  struct msghdr *msg;
+  struct iovec vec[NET_RECV_BATCH_MAX];
+  struct sockaddr_in from_addr[NET_RECV_BATCH_MAX];
+  union {
+      struct cmsghdr cm;
+      char control[NET_CONTROL_LENGTH];
+  } cmsg_un[NET_RECV_BATCH_MAX];
+#if defined(linux)
+  struct mmsghdr msgs[NET_RECV_BATCH_MAX];
+#else
+  struct msghdr msgs[1];
+  size = 1;
+#endif
   
-  ret = recvfrom(ptpClock->netPath.generalSock, buf, PACKET_SIZE, MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+  if(size < 1 || size > NET_RECV_BATCH_MAX)
+    size = size < 1 ? 1 : NET_RECV_BATCH_MAX;
+  
+  for(i = 0; i < size; ++i)
+  {
+#if defined(linux)
+    msg = &msgs[i].msg_hdr;
+#else
+    msg = &msgs[i];
+#endif
+    vec[i].iov_base = batch->buf[i];
+    vec[i].iov_len = PACKET_SIZE;
+    msg->msg_name = (caddr_t)&from_addr[i];
+    msg->msg_namelen = sizeof(from_addr[i]);
+    msg->msg_iov = &vec[i];
+    msg->msg_iovlen = 1;
+    msg->msg_control = wantTime ? cmsg_un[i].control : NULL;
+    msg->msg_controllen = wantTime ? sizeof(cmsg_un[i].control) : 0;
+    msg->msg_flags = 0;
+  }
+  
+#if defined(linux)
+  ret = recvmmsg(sock, msgs, size, MSG_DONTWAIT, NULL);
+#else
+  ret = recvmsg(sock, msgs, MSG_DONTWAIT);
+  if(ret > 0)
+  {
+    batch->length[0] = ret;
+    ret = 1;
+  }
+#endif
   if(ret <= 0)
   {
     if(errno == EAGAIN || errno == EINTR)
@@ -603,127 +751,219 @@ ssize_t netRecvGeneral(Octet *buf, PtpClock *ptpClock)
     return ret;
   }
   
+  batch->count = ret;
+  batch->next = 0;
+  ++batch->batches[ret];
+  
+  for(i = 0; i < ret; ++i)
+  {
+#if defined(linux)
+    msg = &msgs[i].msg_hdr;
+    batch->length[i] = msgs[i].msg_len;
+#else
+    msg = &msgs[i];
+#endif
+    if(msg->msg_flags&MSG_TRUNC)
+    {
+      /* skipped by netRecvNext() */
+      ERROR("received truncated message\n");
+      batch->length[i] = 0;
+    }
+    
+    if(!wantTime || !netGetTimeStamp(msg, &batch->stamp[i], ptpClock))
+      batch->stamp[i].tv_sec = batch->stamp[i].tv_nsec = 0;
+  }
+  
   return ret;
 }
 
-ssize_t netSendEvent(Octet *buf, UInteger16 length, TimeInternal *sendTimeStamp, PtpClock *ptpClock)
+/*
+ * Hand out the next datagram from 'batch', refilling it from 'sock'
+ * when empty. Returns the length of the datagram, 0 if there is none.
+ * Truncated datagrams are skipped.
+ */
+static ssize_t netRecvNext(Octet *buf, struct timespec *stamp, Integer32 sock, NetRecvBatch *batch, Boolean wantTime, PtpClock *ptpClock)
 {
   ssize_t ret;
-  struct sockaddr_in addr;
   
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(PTP_EVENT_PORT);
-  addr.sin_addr.s_addr = ptpClock->netPath.multicastAddr;
-  ptpClock->netPath.lastNetSendEventLength = length;
-
-  ret = sendto(ptpClock->netPath.eventSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-  if(ret <= 0)
-    DBG("error sending multi-cast event message\n");
-  else if(sendTimeStamp)
-  {
-    /*
-     * The packet is assumed to generated a time stamp soon. For
-     * simplicity reasons wait until it got time stamped.
-     *
-     * Tests under load showed that the time stamp was not
-     * always generated (packet dropped inside the driver?).
-     * This situation is handled by trying only for a while,
-     * then giving up and returning a zero timestamp.
-     */
-#undef DEBUG_PACKET_LOSS
-#ifdef DEBUG_PACKET_LOSS
-    /* to debug the error case drop every 10th outgoing packet */
-    static int debugPacketCounter;
-    debugPacketCounter++;
-#endif
-    sendTimeStamp->seconds = 0;
-    sendTimeStamp->nanoseconds = 0;
-
-    /* fast path: get send time stamp directly */
-    if(
-#ifdef DEBUG_PACKET_LOSS
-       (debugPacketCounter % 10) &&
-#endif
-       getSendTime(sendTimeStamp, ptpClock)) {
-        DBGV("got send time stamp in first attempt\n");
-    } else {
-        /*
-         * need to wait for it: need to check system time, counting
-         * the number of nanoSleep()s is too inaccurate because it
-         * each call sleeps much longer than requested
-         */
-      TimeInternal start, now;
-      timerNow(&start);
-      while(TRUE) {
-        Boolean gotTime;
-        TimeInternal delayAfterPacketSend;
-        delayAfterPacketSend.seconds = 0;
-        delayAfterPacketSend.nanoseconds = 1000;
-        nanoSleep(&delayAfterPacketSend);
-        gotTime =
-#ifdef DEBUG_PACKET_LOSS
-          (debugPacketCounter % 10) &&
-#endif
-          getSendTime(sendTimeStamp, ptpClock);
-        timerNow(&now);
-        subTime(&now, &now, &start);
-        /* 0.5 seconds is the maximum we wait... */
-        if(gotTime || now.seconds >= 1 || now.nanoseconds >= 500000000) {
-          DBGV("%s send time stamp after %d.%09ds\n",
-               gotTime ? "got" : "failed to get",
-               now.seconds, now.nanoseconds);
-#ifdef PTPD_DBGV
-          if (!gotTime) {
-              /* unpack the message because that logs its content */
-              MsgHeader header;
-              DBGV("unpacking message without time stamp\n");
-              msgUnpackHeader(buf, &header);
-          }
-#endif
-          break;
-        }
-      }
-    }
-  }
-
-  /**
-   * @TODO: why is the packet sent twice when unicast is enabled?
-   * If that's correct, deal with the send time stamps.
-   */
-  if(ptpClock->netPath.unicastAddr)
+  for(;;)
   {
-    addr.sin_addr.s_addr = ptpClock->netPath.unicastAddr;
+    if(batch->next >= batch->count)
+    {
+      batch->count = batch->next = 0;
+      if((ret = netRecvBatch(sock, batch, wantTime, ptpClock)) <= 0)
+        return ret;
+    }
     
-    ret = sendto(ptpClock->netPath.eventSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-    if(ret <= 0)
-      DBG("error sending uni-cast event message\n");
+    if(batch->length[batch->next])
+      break;
+    ++batch->next;
   }
   
+  ret = batch->length[batch->next];
+  memcpy(buf, batch->buf[batch->next], ret);
+  if(stamp)
+    *stamp = batch->stamp[batch->next];
+  ++batch->next;
+  
   return ret;
 }
 
-ssize_t netSendGeneral(Octet *buf, UInteger16 length, PtpClock *ptpClock)
+/* TRUE if datagrams are waiting in the receive batches */
+Boolean netRecvPending(PtpClock *ptpClock)
 {
-  ssize_t ret;
-  struct sockaddr_in addr;
+  return ptpClock->netPath.eventBatch.next < ptpClock->netPath.eventBatch.count
+    || ptpClock->netPath.generalBatch.next < ptpClock->netPath.generalBatch.count;
+}
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+/* TRUE if the last 'pending->length' bytes of the bounce are that message */
+static Boolean netBounceMatches(NetPendingSend *pending, Octet *buf, ssize_t length)
+{
+  Octet *payload = buf + length - pending->length;
   
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(PTP_GENERAL_PORT);
-  addr.sin_addr.s_addr = ptpClock->netPath.multicastAddr;
+  return pending->valid
+    && length >= pending->length
+    && flip16(*(UInteger16*)(payload + 30)) == pending->sequenceId
+    && *(UInteger8*)(payload + 32) == pending->control;
+}
+
+/*
+ * Find the pending send which a bounce from the error queue belongs
+ * to: by the key in the extended error if the kernel provides one,
+ * else by the sequence id in the bounced payload.
+ */
+static NetPendingSend *netFindPendingSend(struct msghdr *msg, Octet *buf, ssize_t length, PtpClock *ptpClock)
+{
+  struct cmsghdr *cmsg;
+  int i;
   
-  ret = sendto(ptpClock->netPath.generalSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-  if(ret <= 0)
-    DBG("error sending multi-cast general message\n");
+  if(ptpClock->netPath.sendKeys)
+  {
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+      struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      
+      if(cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR
+        || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+        continue;
+      
+      for(i = 0; i < NET_PENDING_SENDS; ++i)
+        if(ptpClock->netPath.pendingSends[i].key == err->ee_data
+          && netBounceMatches(&ptpClock->netPath.pendingSends[i], buf, length))
+          return &ptpClock->netPath.pendingSends[i];
+      
+      DBGV("no pending send for key %u\n", err->ee_data);
+      return NULL;
+    }
+  }
   
-  if(ptpClock->netPath.unicastAddr)
+  for(i = 0; i < NET_PENDING_SENDS; ++i)
+    if(netBounceMatches(&ptpClock->netPath.pendingSends[i], buf, length))
+      return &ptpClock->netPath.pendingSends[i];
+  
+  return NULL;
+}
+#endif /* HAVE_LINUX_NET_TSTAMP_H */
+
+static ssize_t netReceiveEvent(Octet *buf, TimeInternal *time, PtpClock *ptpClock)
+{
+  ssize_t ret = 0;
+  struct timespec stamp;
+  Boolean have_time = FALSE;
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+  if(ptpClock->netPath.sendBounce) {
+      struct msghdr msg;
+      struct iovec vec[1];
+      struct sockaddr_in from_addr;
+      union {
+          struct cmsghdr cm;
+          char control[NET_CONTROL_LENGTH];
+      } cmsg_un;
+      
+      vec[0].iov_base = buf;
+      vec[0].iov_len = PACKET_SIZE;
+      
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = (caddr_t)&from_addr;
+      msg.msg_namelen = sizeof(from_addr);
+      msg.msg_iov = vec;
+      msg.msg_iovlen = 1;
+      msg.msg_control = cmsg_un.control;
+      msg.msg_controllen = sizeof(cmsg_un.control);
+      msg.msg_flags = 0;
+      
+      ret = recvmsg(ptpClock->netPath.eventSock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT);
+      if(ret <= 0) {
+          if (errno != EAGAIN && errno != EINTR)
+              return ret;
+          ret = 0;
+      } else {
+          /* strip network transport header of the message it belongs to */
+          NetPendingSend *pending = netFindPendingSend(&msg, buf, ret, ptpClock);
+          
+          if(pending) {
+              memmove(buf, buf + ret - pending->length, pending->length);
+              ret = pending->length;
+              pending->valid = FALSE;
+              have_time = time && netGetTimeStamp(&msg, &stamp, ptpClock);
+          } else {
+              /* No clue what this message is. Skip it. */
+              ++ptpClock->netPath.unmatchedBounces;
+              DBG("received unexpected bounce via error queue\n");
+              ret = 0;
+          }
+      }
+  }
+#endif /* HAVE_LINUX_NET_TSTAMP_H */
+
+  if(ret <= 0)
   {
-    addr.sin_addr.s_addr = ptpClock->netPath.unicastAddr;
-    
-    ret = sendto(ptpClock->netPath.eventSock, buf, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+    ret = netRecvNext(buf, &stamp, ptpClock->netPath.eventSock,
+                      &ptpClock->netPath.eventBatch, time != NULL, ptpClock);
     if(ret <= 0)
-      DBG("error sending uni-cast general message\n");
+      return ret;
+    have_time = stamp.tv_sec || stamp.tv_nsec;
+    e1000SimPacket(FALSE, buf, ret, ptpClock);
+  }
+  
+  /* get time stamp of packet? */
+  if(!time)
+  {
+    /* caller does not need time (probably wasn't even enabled) */
+    return ret;
   }
   
+  if(have_time)
+  {
+    *time = TIMESPEC_NSEC(stamp);
+    DBGV("kernel recv time stamp %lldns\n", *time);
+  }
+  else
+  {
+    /* do not try to get by with recording the time here, better to fail
+       because the time recorded could be well after the message receive,
+       which would put a big spike in the offset signal sent to the clock servo */
+    DBG("no receive time stamp\n");
+    return 0;
+  }
+
   return ret;
 }
 
+ssize_t netRecvEvent(Octet *buf, TimeInternal *time, PtpClock *ptpClock)
+{
+  return capturePacket(CAPTURE_RECV_EVENT,
+                       captureReplaying() ? 0 : netReceiveEvent(buf, time, ptpClock),
+                       buf, time);
+}
+
+ssize_t netRecvGeneral(Octet *buf, PtpClock *ptpClock)
+{
+  return capturePacket(CAPTURE_RECV_GENERAL,
+                       captureReplaying() ? 0 :
+                       netRecvNext(buf, NULL, ptpClock->netPath.generalSock,
+                                   &ptpClock->netPath.generalBatch, FALSE, ptpClock),
+                       buf, NULL);
+}
@@ -20,6 +20,14 @@
 #include<sys/ioctl.h>
 #include<arpa/inet.h>
 
+/* stepping clocks with adjtimex(), not declared by older C libraries */
+#ifndef ADJ_SETOFFSET
+# define ADJ_SETOFFSET 0x0100
+#endif
+#ifndef ADJ_NANO
+# define ADJ_NANO 0x2000
+#endif
+
 #ifdef HAVE_LINUX_NET_TSTAMP_H
 #include "asm/types.h"
 #include "linux/net_tstamp.h"
@@ -33,6 +41,14 @@
 # define SO_TIMESTAMPING 37
 #endif
 
+#ifndef SOF_TIMESTAMPING_OPT_ID
+# define SOF_TIMESTAMPING_OPT_ID (1<<7)
+#endif
+
+#ifndef SO_EE_ORIGIN_TIMESTAMPING
+# define SO_EE_ORIGIN_TIMESTAMPING 4
+#endif
+
 #ifndef SIOCGSTAMPNS
 # define SIOCGSTAMPNS 0x8907
 #endif
@@ -76,6 +92,21 @@ extern Boolean useSyslog;
 #define DBG(x, ...)
 #endif
 
+/* latency of the Sync processing, see latency.c */
+#ifdef PTPD_LATENCY
+#define LATENCY_MARK(point)     latencyMark(point)
+#define LATENCY_ARRIVAL(stamp, ptpClock)  latencyArrival(stamp, ptpClock)
+#define LATENCY_INIT()          latencyInit()
+#define LATENCY_POLL()          latencyPoll()
+#define LATENCY_DUMP()          latencyDump()
+#else
+#define LATENCY_MARK(point)
+#define LATENCY_ARRIVAL(stamp, ptpClock)
+#define LATENCY_INIT()
+#define LATENCY_POLL()
+#define LATENCY_DUMP()
+#endif
+
 /* endian corrections */
 #if defined(PTPD_MSBF)
 #define shift8(x,y)   ( (x) << ((3-y)<<3) )
@@ -114,6 +145,13 @@ static inline Integer32 flip32(x)
 #define clearFlag(x,y)  ( *(UInteger8*)((x)+((y)<8?1:0)) &= ~(1<<((y)<8?(y):(y)-8)) )
 
 
+/* latency.c */
+void latencyMark(LatencyPoint);
+void latencyArrival(TimeInternal*,PtpClock*);
+void latencyInit(void);
+void latencyPoll(void);
+void latencyDump(void);
+
 /* msg.c */
 Boolean msgPeek(void*,ssize_t);
 void msgUnpackHeader(void*,MsgHeader*);
@@ -125,10 +163,10 @@ void msgUnpackManagement(void*,MsgManagement*);
 UInteger8 msgUnloadManagement(void*,MsgManagement*,PtpClock*);
 void msgUnpackManagementPayload(void *buf, MsgManagement *manage);
 void msgPackHeader(void*,PtpClock*);
-void msgPackSync(void*,Boolean,Boolean,TimeRepresentation*,PtpClock*);
-void msgPackDelayReq(void*,Boolean,Boolean,TimeRepresentation*,PtpClock*);
-void msgPackFollowUp(void*,UInteger16,TimeRepresentation*,PtpClock*);
-void msgPackDelayResp(void*,MsgHeader*,TimeRepresentation*,PtpClock*);
+void msgPackSync(void*,Boolean,Boolean,TimeInternal*,PtpClock*);
+void msgPackDelayReq(void*,Boolean,Boolean,TimeInternal*,PtpClock*);
+void msgPackFollowUp(void*,UInteger16,TimeInternal*,PtpClock*);
+void msgPackDelayResp(void*,MsgHeader*,TimeInternal*,PtpClock*);
 UInteger16 msgPackManagement(void*,MsgManagement*,PtpClock*);
 UInteger16 msgPackManagementResponse(void*,MsgHeader*,MsgManagement*,PtpClock*);
 
@@ -139,19 +177,103 @@ Boolean netShutdown(PtpClock*);
 int netSelect(TimeInternal*,PtpClock*);
 ssize_t netRecvEvent(Octet*,TimeInternal*,PtpClock*);
 ssize_t netRecvGeneral(Octet*,PtpClock*);
-ssize_t netSendEvent(Octet*,UInteger16,TimeInternal*,PtpClock*);
+Boolean netRecvPending(PtpClock*);
+Boolean netEnableTimeStamping(int,PtpClock*);
+ssize_t netSendEvent(Octet*,UInteger16,PtpClock*);
 ssize_t netSendGeneral(Octet*,UInteger16,PtpClock*);
 
+/* capture.c */
+Boolean captureOpen(const char*,Boolean);
+void captureClose(void);
+Boolean captureReplaying(void);
+void captureSuspend(void);
+void captureResume(void);
+void captureTime(CaptureType,Integer64*);
+Boolean captureStamp(CaptureType,Boolean,TimeInternal*);
+int captureSelect(int);
+ssize_t capturePacket(CaptureType,ssize_t,Octet*,TimeInternal*);
+void captureSend(CaptureType,Octet*,UInteger16);
+void captureAdjust(CaptureType,Integer64);
+Boolean captureTimer(UInteger16,Boolean);
+Boolean captureNet(Boolean,PtpClock*);
+void captureBackend(PtpClock*);
+
+/* e1000_sim.c */
+int e1000SimIoctl(unsigned long,struct ifreq*,PtpClock*);
+void e1000SimPacket(Boolean,Octet*,ssize_t,PtpClock*);
+
+/* event.c */
+/* linux API dependent, select() elsewhere */
+Boolean eventInit(PtpClock*);
+void eventShutdown(PtpClock*);
+Boolean eventAdd(Integer32,UInteger32,PtpClock*);
+int eventWait(TimeInternal*,PtpClock*);
+
+/* filter.c */
+void initSampleWindow(SampleWindow*);
+void initAppliedPhase(AppliedPhase*);
+void applyPhase(TimeInternal,TimeInternal,Integer32,PtpClock*);
+Boolean filterSample(TimeInternal*,TimeInternal*,Boolean,SampleWindow*,PtpClock*);
+const char * filterName(SampleFilter);
+void initOutlierGate(outlier_gate*);
+Boolean gateOffset(TimeInternal*,TimeInternal*,PtpClock*);
+Boolean gateDelay(TimeInternal*,TimeInternal*,PtpClock*);
+void filterShutdown(PtpClock*);
+
+/* holdover.c */
+void holdoverSample(PtpClock*);
+Boolean startHoldover(PtpClock*);
+void updateHoldover(PtpClock*);
+void stopHoldover(PtpClock*);
+
 /* servo.c */
 void initClock(PtpClock*);
+void initServo(PtpClock*);
+void initCalibration(PtpClock*);
+Boolean calibrateClock(PtpClock*);
 void updateDelay(TimeInternal*,TimeInternal*,
   one_way_delay_filter*,PtpClock*);
 void updateOffset(TimeInternal*,TimeInternal*,
   offset_from_master_filter*,PtpClock*);
 void updateClock(PtpClock*);
+const struct ClockServo * findServo(Servo);
+Integer32 clampAdj(double,Integer32);
+
+typedef enum {
+  SERVO_UNLOCKED,  /**< not enough samples yet for a frequency estimate */
+  SERVO_LOCKED
+} ServoState;
+
+/**
+ * Implementation of one clock servo, selected by initClock()
+ * according to runTimeOpts.servo. Servos only compute, updateClock()
+ * applies their output, so they can also be driven by servocmp.
+ */
+typedef struct ClockServo {
+  const char *name;
+  /** forget all samples; observed_drift is the frequency to start from */
+  void (*reset)(PtpClock*);
+  /**
+   * Feed the offset from master measured at local time 'localTime'
+   * (both nsec). Returns the frequency correction in ppb in *adj,
+   * which is applied as adjTime(-adj). It must not exceed +-maxAdj,
+   * which is 0 if nothing gets applied: the servo state has to
+   * describe the correction in effect, not the one it would like.
+   */
+  ServoState (*sample)(TimeInternal offset, TimeInternal localTime, Integer32 maxAdj, Integer32 *adj, PtpClock*);
+  /**
+   * optional: unfiltered slave to master delay measured by a
+   * Delay_Req sent at local time 'localTime'
+   */
+  void (*delay)(TimeInternal slaveToMaster, TimeInternal localTime, PtpClock*);
+} ClockServo;
+
+/* servo_pi.c, servo_linreg.c, servo_kalman.c */
+extern const ClockServo servoPI, servoAdaptive, servoLinreg, servoKalman;
 
 /* startup.c */
 /* unix API dependent */
+void ptpdDefaults(RunTimeOpts*);
 PtpClock * ptpdStartup(int,char**,Integer16*,RunTimeOpts*);
 void ptpdShutdown(void);
 
@@ -159,6 +281,8 @@ void ptpdShutdown(void);
 /* unix API dependent */
 void displayStats(PtpClock*);
 UInteger16 getRand(UInteger32*);
+void readDrift(PtpClock*);
+void writeDrift(PtpClock*);
 
 /**
  * @defgroup time Time Source
@@ -175,6 +299,8 @@ UInteger16 getRand(UInteger32*);
 /*@{*/
 /** @file time.c */
 Boolean initTime(PtpClock*);
+/** releases the time source, logs its statistics */
+void shutdownTime(PtpClock*);
 void getTime(TimeInternal*, PtpClock*);
 void setTime(TimeInternal*, PtpClock*);
 
@@ -200,7 +326,8 @@ void adjTimeOffset(TimeInternal *offset, PtpClock*);
  * There is no way to identify the packet the time stamp belongs to,
  * so this must be called after sending each packet until the time
  * stamp for the packet is available. This can be some (hopefully
- * small) time after the packet was passed to the IP stack.
+ * small) time after the packet was passed to the IP stack; the
+ * protocol polls for it from the event loop in the meantime.
  *
  * There is no mechanism either to determine packet loss and thus a
  * time stamp which never becomes available.
@@ -252,20 +379,99 @@ void timeNoActivity(PtpClock*);
  */
 void timeToState(UInteger8 state, PtpClock *ptpClock);
 
+/**
+ * Implementation of one time source, selected by initTime() according
+ * to runTimeOpts.time. The functions have the semantic of the
+ * corresponding functions above; optional ones may be NULL.
+ */
+typedef struct TimeBackend {
+  const char *name;
+  /** TRUE if send time stamps must be polled for with getSendTime() */
+  Boolean delayedTiming;
+  Boolean (*init)(PtpClock*);                          /**< optional */
+  void (*getTime)(TimeInternal*, PtpClock*);
+  void (*setTime)(TimeInternal*, PtpClock*);
+  void (*adjTime)(Integer32, TimeInternal*, PtpClock*);
+  void (*adjTimeOffset)(TimeInternal*, PtpClock*);
+  Boolean (*getSendTime)(TimeInternal*, PtpClock*);    /**< optional */
+  Boolean (*getReceiveTime)(TimeInternal*, Octet*, UInteger16, PtpClock*); /**< optional */
+  void (*noActivity)(PtpClock*);                       /**< optional */
+  void (*toState)(UInteger8, PtpClock*);               /**< optional, only called on change */
+  void (*shutdown)(PtpClock*);                         /**< optional */
+  /**
+   * optional: correlate the clock with system time, with the result in
+   * the format of E1000_TSYNC_COMPARETS (clock - system time =
+   * (systemToNIC - NICToSystem)/2)
+   */
+  Boolean (*crossTimestamp)(TimeInternal *systemToNIC, TimeInternal *NICToSystem, PtpClock*);
+} TimeBackend;
+
+/** @file time_system.c */
+extern const TimeBackend timeSystemBackend;
+void systemGetTime(TimeInternal*, PtpClock*);
+void systemSetTime(TimeInternal*, PtpClock*);
+void systemAdjTime(Integer32, TimeInternal*, PtpClock*);
+void systemAdjTimeOffset(TimeInternal*, PtpClock*);
+
+/** @file time_e1000.c */
+extern const TimeBackend timeNICBackend, timeAssistedBackend;
+
+/** @file time_linux.c */
+extern const TimeBackend timeLinuxHWBackend, timeLinuxSWBackend;
+Boolean linuxSelectHWTimeStamping(Boolean, int, PtpClock*);
+
+/** @file time_phc.c */
+extern const TimeBackend timePHCBackend;
+
+/** @file time_both.c */
+extern const TimeBackend timeBothBackend;
+
+/** @file capture.c */
+extern const TimeBackend timeReplayBackend;
+
+/** @file time_sim.c */
+extern const TimeBackend timeSimBackend;
+/** reading of the simulated clock at timerMonotonic() time 'now' */
+TimeInternal simClockRead(SimClock*, Integer64 now);
+/** normal distributed random number */
+double simGauss(UInteger32 *seed);
+
+/** TimeInternal from/to struct timespec (the latter only for times >= 0) */
+#define TIMESPEC_NSEC(ts) ((ts).tv_sec*1000000000LL + (ts).tv_nsec)
+#define NSEC_TIMESPEC(ts, t) ((ts).tv_sec = (t) / 1000000000, (ts).tv_nsec = (t) % 1000000000)
+
+/**
+ * FixedPoint from/to integers, the latter rounded: 48.16 bits cover
+ * +-39 hours in nsec with a resolution of 15 fsec
+ */
+#define FIXED_SHIFT 16
+#define TO_FIXED(x) ((FixedPoint)(x) * (1LL << FIXED_SHIFT))
+#define FROM_FIXED(x) (((x) + (1LL << (FIXED_SHIFT - 1))) >> FIXED_SHIFT)
+
+/* helpers for the backends, in time.c */
+void timeStepOffset(TimeInternal*, PtpClock*);
+Boolean initRecvTimes(PtpClock*);
+void addRecvTime(TimeInternal*, Octet*, UInteger16, PtpClock*);
+Boolean findRecvTime(TimeInternal*, Octet*, UInteger16, PtpClock*);
+
 /*@}*/
 
 /**
  * @defgroup timer regular wakeup at different timer intervals
  *
- * This timing is always done using the system time of the host.
+ * This timing is always done using the monotonic time of the host,
+ * with intervals in nanoseconds. Expirations wake up the event loop.
  */
 /*@{*/
 /** @file timer.c */
-void initTimer(void);
+Boolean initTimer(PtpClock*);
 void timerUpdate(IntervalTimer*);
 void timerStop(UInteger16,IntervalTimer*);
-void timerStart(UInteger16,UInteger16,IntervalTimer*);
+void timerStart(UInteger16,Integer64,IntervalTimer*);
 Boolean timerExpired(UInteger16,IntervalTimer*);
+/** time until the next expiration, FALSE if the event loop need not know */
+Boolean timerNext(TimeInternal*,IntervalTimer*);
+Integer64 timerMonotonic(void);
 Boolean nanoSleep(TimeInternal*);
 /** gets the current system time */
 void timerNow(TimeInternal*);
@@ -1,57 +1,206 @@
 #include "../ptpd.h"
 
+/* the clock servos which can be selected with -S, indexed by Servo */
+static const ClockServo *servos[SERVO_MAX] = {
+  [SERVO_PI] = &servoPI,
+  [SERVO_LINREG] = &servoLinreg,
+  [SERVO_KALMAN] = &servoKalman,
+  [SERVO_ADAPTIVE] = &servoAdaptive,
+};
+
+const ClockServo * findServo(Servo servo)
+{
+  return servo < SERVO_MAX ? servos[servo] : NULL;
+}
+
+/* frequency correction 'adj' in ppb limited to +-max */
+Integer32 clampAdj(double adj, Integer32 max)
+{
+  if(adj > max)
+    return max;
+  else if(adj < -max)
+    return -max;
+  else
+    return (Integer32)adj;
+}
+
+/* append one input of the servo to runTimeOpts.servoLog, see servocmp.c */
+static void logServo(Integer32 adj, Boolean step, PtpClock *ptpClock)
+{
+  if(!ptpClock->runTimeOpts.servoLog)
+    return;
+
+  fprintf(ptpClock->runTimeOpts.servoLog, "%lld %lld %d %d %lld %lld\n",
+          ptpClock->sync_receive_time,
+          ptpClock->offset_from_master,
+          adj, step,
+          ptpClock->master_to_slave_delay,
+          ptpClock->slave_to_master_delay);
+  fflush(ptpClock->runTimeOpts.servoLog);
+}
+
+/* -x never steps the clock, -X only before its first correction */
+static Boolean stepAllowed(PtpClock *ptpClock)
+{
+  return !ptpClock->runTimeOpts.noResetClock &&
+    !(ptpClock->runTimeOpts.stepFirstOnly && ptpClock->clockUpdated);
+}
+
 void initClock(PtpClock *ptpClock)
 {
   DBG("%sinitClock\n", ptpClock->name);
   
   /* clear vars */
-  ptpClock->master_to_slave_delay.seconds = ptpClock->master_to_slave_delay.nanoseconds = 0;
-  ptpClock->slave_to_master_delay.seconds = ptpClock->slave_to_master_delay.nanoseconds = 0;
+  ptpClock->master_to_slave_delay = 0;
+  ptpClock->slave_to_master_delay = 0;
   ptpClock->observed_variance = 0;
-  ptpClock->observed_drift = 0;  /* clears clock servo accumulator (the I term) */
+  ptpClock->observed_drift = ptpClock->saved_drift;  /* resets clock servo accumulator (the I term) */
   ptpClock->owd_filt.s_exp = 0;  /* clears one-way delay filter */
   ptpClock->halfEpoch = ptpClock->halfEpoch || ptpClock->runTimeOpts.halfEpoch;
   ptpClock->runTimeOpts.halfEpoch = 0;
   
-  /* level clock */
+  initServo(ptpClock);
+  
+  /* level clock, or start from the frequency in the drift file */
   if(!ptpClock->runTimeOpts.noAdjust)
-    adjTime(0, NULL, ptpClock);
+    adjTime(-ptpClock->observed_drift,
+            ptpClock->observed_drift ? &ptpClock->offset_from_master : NULL,
+            ptpClock);
+}
+
+/*
+ * start the servo and the filters in front of it from scratch, but
+ * keep the frequency in observed_drift
+ */
+void initServo(PtpClock *ptpClock)
+{
+  initSampleWindow(&ptpClock->m2s_window);
+  initSampleWindow(&ptpClock->s2m_window);
+  initAppliedPhase(&ptpClock->applied_phase);
+  initOutlierGate(&ptpClock->offset_gate);
+  initOutlierGate(&ptpClock->delay_gate);
+  
+  ptpClock->servo = findServo(ptpClock->runTimeOpts.servo);
+  if(!ptpClock->servo)
+    ptpClock->servo = &servoPI;
+  ptpClock->servo->reset(ptpClock);
+}
+
+void initCalibration(PtpClock *ptpClock)
+{
+  memset(&ptpClock->calibration, 0, sizeof(ptpClock->calibration));
+}
+
+/*
+ * PTP_UNCALIBRATED: called for each Sync after updateOffset(). The
+ * slope of the master to slave delays of runTimeOpts.calibrationSyncs
+ * intervals is the frequency error of the clock. Once it is known and
+ * there is a delay measurement, the frequency is corrected, the clock
+ * stepped to the master and TRUE returned: the servo takes over.
+ */
+Boolean calibrateClock(PtpClock *ptpClock)
+{
+  Calibration *c = &ptpClock->calibration;
+  Boolean apply = !ptpClock->runTimeOpts.noAdjust || ptpClock->nic_instead_of_system;
+  TimeInternal step = 0;
+  double x, y, n, det, slope = 0;
+  
+  if(!c->syncs)
+  {
+    c->firstTime = ptpClock->sync_receive_time;
+    c->firstDelay = ptpClock->master_to_slave_delay;
+  }
+  x = (ptpClock->sync_receive_time - c->firstTime) / 1000000000.0;
+  y = ptpClock->master_to_slave_delay - c->firstDelay;
+  c->sx += x;
+  c->sy += y;
+  c->sxx += x * x;
+  c->sxy += x * y;
+  n = ++c->syncs;
+  
+  if(ptpClock->runTimeOpts.displayStats)
+    displayStats(ptpClock);
+  
+  if(c->syncs <= ptpClock->runTimeOpts.calibrationSyncs)
+    return FALSE;
+  
+  if(!ptpClock->slave_to_master_delay &&
+     c->syncs <= ptpClock->runTimeOpts.calibrationSyncs * MAX_CALIBRATION_FACTOR)
+  {
+    DBGV("%scalibration waits for delay measurement\n", ptpClock->name);
+    return FALSE;
+  }
+  
+  /* least-squares slope in nsec/sec = ppb */
+  det = n * c->sxx - c->sx * c->sx;
+  if(det > 0)
+    slope = (n * c->sxy - c->sx * c->sy) / det;
+  
+  slope += ptpClock->observed_drift;
+  if(slope > ADJ_FREQ_MAX)
+    slope = ADJ_FREQ_MAX;
+  else if(slope < -ADJ_FREQ_MAX)
+    slope = -ADJ_FREQ_MAX;
+  ptpClock->observed_drift = slope;
+  
+  INFO("%scalibrated frequency %dppb from %d Syncs, offset %lldns\n",
+       ptpClock->name, ptpClock->observed_drift, c->syncs, ptpClock->offset_from_master);
+  
+  if(apply)
+  {
+    adjTime(-ptpClock->observed_drift, &ptpClock->offset_from_master, ptpClock);
+    
+    if(stepAllowed(ptpClock) &&
+       llabs(ptpClock->offset_from_master) >= CALIBRATION_STEP_MIN)
+    {
+      step = ptpClock->offset_from_master;
+      adjTimeOffset(&ptpClock->offset_from_master, ptpClock);
+      /* the previous offset is meaningless now */
+      ptpClock->ofm_filt.nsec_prev = 0;
+    }
+    ptpClock->clockUpdated = TRUE;
+  }
+  applyPhase(ptpClock->sync_receive_time, step,
+             apply ? 0 : -ptpClock->observed_drift, ptpClock);
+  
+  return TRUE;
 }
 
 void updateDelay(TimeInternal *send_time, TimeInternal *recv_time,
   one_way_delay_filter *owd_filt, PtpClock *ptpClock)
 {
   Integer16 s;
+  TimeInternal send = *send_time, recv = *recv_time;
+  FixedPoint delay;
+  Boolean windowed;
   
-  DBGV("%supdateDelay send %10ds %11dns recv %10ds %11dns\n",
-       ptpClock->name,
-       send_time->seconds, send_time->nanoseconds,
-       recv_time->seconds, recv_time->nanoseconds);
+  DBGV("%supdateDelay send %20lldns recv %20lldns\n",
+       ptpClock->name, *send_time, *recv_time);
+  
+  /* a window filter picks one of the recent pairs instead */
+  windowed = filterSample(&send, &recv, FALSE, &ptpClock->s2m_window, ptpClock);
   
   /* calc 'slave_to_master_delay' */
-  subTime(&ptpClock->slave_to_master_delay, recv_time, send_time);
+  ptpClock->slave_to_master_delay = recv - send;
+  
+  if(ptpClock->servo && ptpClock->servo->delay)
+    ptpClock->servo->delay(ptpClock->slave_to_master_delay, send, ptpClock);
   
   /* update 'one_way_delay' */
-  addTime(&ptpClock->one_way_delay, &ptpClock->master_to_slave_delay, &ptpClock->slave_to_master_delay);
-  ptpClock->one_way_delay.seconds /= 2;
-  ptpClock->one_way_delay.nanoseconds /= 2;
+  ptpClock->one_way_delay = (ptpClock->master_to_slave_delay + ptpClock->slave_to_master_delay)/2;
 
-  DBGV("%supdateDelay slave_to_master_delay %10ds %11dns one_way_delay %10ds %11dns\n",
+  DBGV("%supdateDelay slave_to_master_delay %13lldns one_way_delay %13lldns\n",
        ptpClock->name,
-       ptpClock->slave_to_master_delay.seconds, ptpClock->slave_to_master_delay.nanoseconds,
-       ptpClock->one_way_delay.seconds, ptpClock->one_way_delay.nanoseconds);
+       ptpClock->slave_to_master_delay, ptpClock->one_way_delay);
   
-  if(ptpClock->one_way_delay.seconds)
-  {
-    /* cannot filter with secs, clear filter */
-    owd_filt->s_exp = owd_filt->nsec_prev = 0;
+  if(windowed)
     return;
-  }
   
-  /* avoid overflowing filter */
-  s =  ptpClock->runTimeOpts.s;
-  while(abs(owd_filt->y)>>(31-s))
-    --s;
+  s = ptpClock->runTimeOpts.s;
+  if(s < 0)
+    s = 0;
+  else if(s > MAX_DELAY_S)
+    s = MAX_DELAY_S;
   
   /* crank down filter cutoff by increasing 's_exp' */
   if(owd_filt->s_exp < 1)
@@ -61,114 +210,128 @@ void updateDelay(TimeInternal *send_time, TimeInternal *recv_time,
   else if(owd_filt->s_exp > 1<<s)
     owd_filt->s_exp = 1<<s;
   
-  /* filter 'one_way_delay' */
-  owd_filt->y = (owd_filt->s_exp-1)*owd_filt->y/owd_filt->s_exp +
-    (ptpClock->one_way_delay.nanoseconds/2 + owd_filt->nsec_prev/2)/owd_filt->s_exp;
+  /*
+   * filter 'one_way_delay' in fixed point: y += (x - y)/s_exp is
+   * y*(s_exp-1)/s_exp + x/s_exp without the product which could overflow
+   */
+  delay = TO_FIXED(ptpClock->one_way_delay);
+  owd_filt->y += ((delay + owd_filt->nsec_prev)/2 - owd_filt->y) / owd_filt->s_exp;
   
-  owd_filt->nsec_prev = ptpClock->one_way_delay.nanoseconds;
-  ptpClock->one_way_delay.nanoseconds = owd_filt->y;
+  owd_filt->nsec_prev = delay;
+  ptpClock->one_way_delay = FROM_FIXED(owd_filt->y);
   
-  DBG("%sdelay filter %d, %d\n", ptpClock->name, owd_filt->y, owd_filt->s_exp);
+  DBG("%sdelay filter %lld, %d\n", ptpClock->name, ptpClock->one_way_delay, owd_filt->s_exp);
 }
 
 void updateOffset(TimeInternal *send_time, TimeInternal *recv_time,
   offset_from_master_filter *ofm_filt, PtpClock *ptpClock)
 {
-    DBGV("%supdateOffset send %10ds %11dns recv %10ds %11dns\n",
-         ptpClock->name,
-         send_time->seconds, send_time->nanoseconds,
-         recv_time->seconds, recv_time->nanoseconds);
+  TimeInternal send = *send_time, recv = *recv_time;
+  FixedPoint offset;
+  Boolean windowed;
+  
+  LATENCY_MARK(LATENCY_OFFSET);
+    DBGV("%supdateOffset send %20lldns recv %20lldns\n",
+         ptpClock->name, *send_time, *recv_time);
+  
+  /* a window filter picks one of the recent pairs instead */
+  windowed = filterSample(&send, &recv, TRUE, &ptpClock->m2s_window, ptpClock);
   
   /* calc 'master_to_slave_delay' */
-  subTime(&ptpClock->master_to_slave_delay, recv_time, send_time);
+  ptpClock->master_to_slave_delay = recv - send;
   
   /* update 'offset_from_master' */
-  subTime(&ptpClock->offset_from_master, &ptpClock->master_to_slave_delay, &ptpClock->one_way_delay);
+  ptpClock->offset_from_master = ptpClock->master_to_slave_delay - ptpClock->one_way_delay;
   
-  DBGV("%supdateOffset master_to_slave_delay %10ds %11dns offset_from_master %10ds %11dns\n",
+  DBGV("%supdateOffset master_to_slave_delay %13lldns offset_from_master %13lldns\n",
        ptpClock->name,
-       ptpClock->master_to_slave_delay.seconds, ptpClock->master_to_slave_delay.nanoseconds,
-       ptpClock->offset_from_master.seconds, ptpClock->offset_from_master.nanoseconds);
+       ptpClock->master_to_slave_delay, ptpClock->offset_from_master);
 
-  if(ptpClock->offset_from_master.seconds)
-  {
-    /* cannot filter with secs, clear filter */
-    ofm_filt->nsec_prev = 0;
+  if(windowed)
     return;
-  }
-  
+
   /* filter 'offset_from_master' */
-  ofm_filt->y = ptpClock->offset_from_master.nanoseconds/2 + ofm_filt->nsec_prev/2;
-  ofm_filt->nsec_prev = ptpClock->offset_from_master.nanoseconds;
-  ptpClock->offset_from_master.nanoseconds = ofm_filt->y;
+  offset = TO_FIXED(ptpClock->offset_from_master);
+  ofm_filt->y = (offset + ofm_filt->nsec_prev)/2;
+  ofm_filt->nsec_prev = offset;
+  ptpClock->offset_from_master = FROM_FIXED(ofm_filt->y);
   
-  DBGV("%soffset filter %d\n", ptpClock->name, ofm_filt->y);
+  DBGV("%soffset filter %lld\n", ptpClock->name, ptpClock->offset_from_master);
 }
 
 void updateClock(PtpClock *ptpClock)
 {
-  Integer32 adj;
+  Integer32 adj = 0;
+  Boolean apply = !ptpClock->runTimeOpts.noAdjust || ptpClock->nic_instead_of_system;
+  Integer32 maxAdj = apply ? ptpClock->runTimeOpts.maxSlew : 0;
   
+  LATENCY_MARK(LATENCY_CLOCK);
   DBGV("%supdateClock\n", ptpClock->name);
   
-  if(ptpClock->offset_from_master.seconds)
+  if(llabs(ptpClock->offset_from_master) >= ptpClock->runTimeOpts.stepThreshold)
   {
-    /* if secs, reset clock or set freq adjustment to max */
-    if(!ptpClock->runTimeOpts.noAdjust || ptpClock->nic_instead_of_system)
+    /* step the clock, or slew it as fast as allowed */
+    if(apply)
     {
-      if(!ptpClock->runTimeOpts.noResetClock)
+      if(stepAllowed(ptpClock))
       {
+        /*
+         * the filtered offset still averages samples from before the
+         * jump, step by the last one and forget the others
+         */
+        ptpClock->offset_from_master = ptpClock->master_to_slave_delay - ptpClock->one_way_delay;
+        logServo(0, TRUE, ptpClock);
         adjTimeOffset(&ptpClock->offset_from_master, ptpClock);
+        ptpClock->ofm_filt.nsec_prev = 0;
         initClock(ptpClock);
       }
       else
       {
-        adj = ptpClock->offset_from_master.nanoseconds > 0 ? ADJ_FREQ_MAX : -ADJ_FREQ_MAX;
+        adj = ptpClock->offset_from_master > 0 ?
+          ptpClock->runTimeOpts.maxSlew : -ptpClock->runTimeOpts.maxSlew;
+        logServo(adj, FALSE, ptpClock);
         adjTime(-adj, &ptpClock->offset_from_master, ptpClock);
+        /* the servo did not choose this correction, it starts over below the threshold */
+        ptpClock->servo->reset(ptpClock);
+        applyPhase(ptpClock->sync_receive_time, 0, adj - ptpClock->observed_drift, ptpClock);
       }
     }
+    else
+    {
+      logServo(0, FALSE, ptpClock);
+      applyPhase(ptpClock->sync_receive_time, 0, -ptpClock->observed_drift, ptpClock);
+    }
   }
   else
   {
-    /* the PI controller */
-    
-    /* no negative or zero attenuation */
-    if(ptpClock->runTimeOpts.ap < 1)
-     ptpClock->runTimeOpts.ap = 1;
-    if(ptpClock->runTimeOpts.ai < 1)
-      ptpClock->runTimeOpts.ai = 1;
+    if(ptpClock->servo->sample(ptpClock->offset_from_master,
+                               ptpClock->sync_receive_time,
+                               maxAdj, &adj, ptpClock) != SERVO_LOCKED)
+      DBGV("%s%s servo not locked yet\n", ptpClock->name, ptpClock->servo->name);
     
-    /* the accumulator for the I component */
-    ptpClock->observed_drift += ptpClock->offset_from_master.nanoseconds/ptpClock->runTimeOpts.ai;
-    
-    /* clamp the accumulator to ADJ_FREQ_MAX for sanity */
-    if(ptpClock->observed_drift > ADJ_FREQ_MAX)
-      ptpClock->observed_drift = ADJ_FREQ_MAX;
-    else if(ptpClock->observed_drift < -ADJ_FREQ_MAX)
-      ptpClock->observed_drift = -ADJ_FREQ_MAX;
-    
-    adj = ptpClock->offset_from_master.nanoseconds/ptpClock->runTimeOpts.ap + ptpClock->observed_drift;
+    logServo(adj, FALSE, ptpClock);
     
     /* apply controller output as a clock tick rate adjustment */
-    if(!ptpClock->runTimeOpts.noAdjust || ptpClock->nic_instead_of_system)
+    if(apply)
       adjTime(-adj, &ptpClock->offset_from_master, ptpClock);
+    /* adj is 0 if not applied */
+    applyPhase(ptpClock->sync_receive_time, 0, adj - ptpClock->observed_drift, ptpClock);
   }
   
+  if(apply)
+    ptpClock->clockUpdated = TRUE;
+  
   if(ptpClock->runTimeOpts.displayStats)
     displayStats(ptpClock);
   
-  DBGV("%smaster-to-slave delay:   %10ds %11dns\n",
-    ptpClock->name,
-    ptpClock->master_to_slave_delay.seconds, ptpClock->master_to_slave_delay.nanoseconds);
-  DBGV("%sslave-to-master delay:   %10ds %11dns\n",
-       ptpClock->name,
-    ptpClock->slave_to_master_delay.seconds, ptpClock->slave_to_master_delay.nanoseconds);
-  DBGV("%sone-way delay:           %10ds %11dns\n",
-    ptpClock->name,
-    ptpClock->one_way_delay.seconds, ptpClock->one_way_delay.nanoseconds);
-  DBG("%soffset from master:      %10ds %11dns\n",
-    ptpClock->name,
-    ptpClock->offset_from_master.seconds, ptpClock->offset_from_master.nanoseconds);
+  DBGV("%smaster-to-slave delay:   %13lldns\n",
+    ptpClock->name, ptpClock->master_to_slave_delay);
+  DBGV("%sslave-to-master delay:   %13lldns\n",
+    ptpClock->name, ptpClock->slave_to_master_delay);
+  DBGV("%sone-way delay:           %13lldns\n",
+    ptpClock->name, ptpClock->one_way_delay);
+  DBG("%soffset from master:      %13lldns\n",
+    ptpClock->name, ptpClock->offset_from_master);
   DBG("%sobserved drift: %10d\n", ptpClock->name, ptpClock->observed_drift);
 }
 
@@ -0,0 +1,157 @@
+/* servo_kalman.c */
+
+#include "../ptpd.h"
+
+#include <math.h>
+
+/*
+ * Clock servo built around a Kalman filter with the state
+ *   x[0] = offset from master (nsec)
+ *   x[1] = frequency error of the free running clock (ppb)
+ *   x[2] = mean path delay (nsec)
+ * Instead of the filtered offset_from_master it uses the unfiltered
+ * delays of both directions as measurements:
+ *   master_to_slave_delay =  offset + delay
+ *   slave_to_master_delay = -offset + delay
+ * The measurement noise of each direction is estimated from the
+ * residuals, so a direction which suffers from queuing is trusted
+ * less. The frequency estimate is compensated directly, the offset
+ * with the P attenuation like in the other servos.
+ */
+
+#define KALMAN_M2S 0
+#define KALMAN_S2M 1
+
+static void kalmanReset(PtpClock *ptpClock)
+{
+  ServoKalman *k = &ptpClock->servoKalman;
+
+  memset(k, 0, sizeof(*k));
+  k->x[1] = ptpClock->observed_drift;
+  k->P[0][0] = KALMAN_P0_OFFSET * KALMAN_P0_OFFSET;
+  k->P[1][1] = KALMAN_P0_FREQ * KALMAN_P0_FREQ;
+  k->P[2][2] = KALMAN_P0_DELAY * KALMAN_P0_DELAY;
+  k->R[KALMAN_M2S] = k->R[KALMAN_S2M] = KALMAN_R0;
+  k->adj = ptpClock->observed_drift;
+}
+
+/* advance the estimate to local time 't' */
+static void kalmanPredict(TimeInternal t, ServoKalman *k)
+{
+  double dt;
+  int i;
+
+  if(t <= k->time)
+    return;
+
+  dt = (t - k->time) / 1000000000.0;
+  k->time = t;
+
+  /* the offset moves with the frequency error minus the applied correction */
+  k->x[0] += (k->x[1] - k->adj) * dt;
+
+  /* P = F P F' + Q dt with F = [1 dt 0; 0 1 0; 0 0 1] */
+  for(i = 0; i < 3; i++)
+    k->P[0][i] += dt * k->P[1][i];
+  for(i = 0; i < 3; i++)
+    k->P[i][0] += dt * k->P[i][1];
+  k->P[0][0] += KALMAN_Q_OFFSET * dt;
+  k->P[1][1] += KALMAN_Q_FREQ * dt;
+  k->P[2][2] += KALMAN_Q_DELAY * dt;
+}
+
+/* incorporate measurement z = h x of the direction 'dir' */
+static void kalmanUpdate(double z, const double h[3], int dir, ServoKalman *k)
+{
+  double Ph[3], S, hPh, y, K[3], P[3][3];
+  int i, j;
+
+  for(i = 0; i < 3; i++)
+    Ph[i] = k->P[i][0]*h[0] + k->P[i][1]*h[1] + k->P[i][2]*h[2];
+  hPh = h[0]*Ph[0] + h[1]*Ph[1] + h[2]*Ph[2];
+  S = hPh + k->R[dir];
+  y = z - (h[0]*k->x[0] + h[1]*k->x[1] + h[2]*k->x[2]);
+
+  for(i = 0; i < 3; i++)
+  {
+    K[i] = Ph[i] / S;
+    k->x[i] += K[i] * y;
+  }
+
+  /* P = (I - K h) P */
+  for(i = 0; i < 3; i++)
+    for(j = 0; j < 3; j++)
+      P[i][j] = k->P[i][j] - K[i] * Ph[j];
+  memcpy(k->P, P, sizeof(P));
+
+  /*
+   * residual based estimate of the measurement noise: the expected
+   * squared residual after the update is R - h P h'
+   */
+  y = z - (h[0]*k->x[0] + h[1]*k->x[1] + h[2]*k->x[2]);
+  hPh = h[0]*(P[0][0]*h[0] + P[0][1]*h[1] + P[0][2]*h[2]) +
+        h[1]*(P[1][0]*h[0] + P[1][1]*h[1] + P[1][2]*h[2]) +
+        h[2]*(P[2][0]*h[0] + P[2][1]*h[1] + P[2][2]*h[2]);
+  k->R[dir] = (1 - KALMAN_R_WEIGHT) * k->R[dir] + KALMAN_R_WEIGHT * (y*y + hPh);
+  if(k->R[dir] < KALMAN_MIN_R)
+    k->R[dir] = KALMAN_MIN_R;
+}
+
+static void kalmanDelay(TimeInternal slaveToMaster, TimeInternal localTime, PtpClock *ptpClock)
+{
+  static const double h[3] = { -1, 0, 1 };
+  ServoKalman *k = &ptpClock->servoKalman;
+
+  /* no estimate to update yet */
+  if(!k->time)
+    return;
+
+  kalmanPredict(localTime, k);
+  kalmanUpdate(slaveToMaster, h, KALMAN_S2M, k);
+  k->delayKnown = TRUE;
+
+  DBGV("%skalman: slave to master %lldns, noise %.0fns\n",
+       ptpClock->name, slaveToMaster, sqrt(k->R[KALMAN_S2M]));
+}
+
+static ServoState kalmanSample(TimeInternal offset, TimeInternal localTime, Integer32 maxAdj, Integer32 *adj, PtpClock *ptpClock)
+{
+  static const double h[3] = { 1, 0, 1 };
+  ServoKalman *k = &ptpClock->servoKalman;
+
+  if(ptpClock->runTimeOpts.ap < 1)
+    ptpClock->runTimeOpts.ap = 1;
+
+  if(!k->time)
+  {
+    /* start from the result of the delay filter, if there is one */
+    k->time = localTime;
+    k->x[2] = ptpClock->one_way_delay;
+    k->x[0] = ptpClock->master_to_slave_delay - k->x[2];
+  }
+  else
+  {
+    kalmanPredict(localTime, k);
+    kalmanUpdate(ptpClock->master_to_slave_delay, h, KALMAN_M2S, k);
+  }
+
+  ptpClock->observed_drift = clampAdj(k->x[1], ADJ_FREQ_MAX);
+  *adj = clampAdj(k->x[1] + k->x[0]/ptpClock->runTimeOpts.ap, maxAdj);
+
+  DBGV("%skalman: offset %.0fns (+-%.0f), drift %.0fppb, delay %.0fns, noise %.0f/%.0fns\n",
+       ptpClock->name, k->x[0], sqrt(k->P[0][0]), k->x[1], k->x[2],
+       sqrt(k->R[KALMAN_M2S]), sqrt(k->R[KALMAN_S2M]));
+
+  /* changes the offset until the next sample, maxAdj is 0 if it does not get applied */
+  k->adj = *adj;
+
+  return k->delayKnown && k->P[0][0] < KALMAN_LOCK_OFFSET * KALMAN_LOCK_OFFSET ?
+    SERVO_LOCKED : SERVO_UNLOCKED;
+}
+
+const ClockServo servoKalman = {
+  .name = "kalman",
+  .reset = kalmanReset,
+  .sample = kalmanSample,
+  .delay = kalmanDelay,
+};
@@ -0,0 +1,98 @@
+/* servo_linreg.c */
+
+#include "../ptpd.h"
+
+/*
+ * Clock servo which fits a line through the last runTimeOpts.servoWindow
+ * offsets by least squares. The frequency corrections applied since the
+ * last reset are integrated and added back to each offset, so that the
+ * samples describe the phase of the free running clock: the slope of
+ * the line is its frequency error, which is compensated directly. The
+ * offset predicted by the line for the current sample is removed with
+ * the attenuation ap, like the P component of the PI servo.
+ */
+
+static void linregReset(PtpClock *ptpClock)
+{
+  ServoWindow *w = &ptpClock->servoSamples;
+
+  w->count = w->next = 0;
+  w->correction = 0;
+  w->adj = ptpClock->observed_drift;
+}
+
+static ServoState linregSample(TimeInternal offset, TimeInternal localTime, Integer32 maxAdj, Integer32 *adj, PtpClock *ptpClock)
+{
+  ServoWindow *w = &ptpClock->servoSamples;
+  Integer16 size = ptpClock->runTimeOpts.servoWindow;
+  double meanTime = 0, meanPhase = 0, sxx = 0, sxy = 0, slope, estimate;
+  int i;
+
+  if(size < MIN_SERVO_WINDOW)
+    size = MIN_SERVO_WINDOW;
+  else if(size > MAX_SERVO_WINDOW)
+    size = MAX_SERVO_WINDOW;
+  if(ptpClock->runTimeOpts.ap < 1)
+    ptpClock->runTimeOpts.ap = 1;
+
+  /* integrate the correction which was in effect since the previous sample */
+  if(w->count)
+    w->correction += (Integer64)w->adj * (localTime - w->time[(w->next + size - 1) % size]) / 1000000000;
+
+  w->time[w->next] = localTime;
+  w->phase[w->next] = offset + w->correction;
+  w->next = (w->next + 1) % size;
+  if(w->count < size)
+    ++w->count;
+
+  if(w->count < MIN_SERVO_WINDOW)
+  {
+    /* too few samples for a line, only remove the offset */
+    *adj = clampAdj(ptpClock->observed_drift + (double)offset/ptpClock->runTimeOpts.ap, maxAdj);
+    goto done;
+  }
+
+  /* times relative to the current sample keep the sums small */
+  for(i = 0; i < w->count; i++)
+  {
+    meanTime += w->time[i] - localTime;
+    meanPhase += w->phase[i];
+  }
+  meanTime /= w->count;
+  meanPhase /= w->count;
+
+  for(i = 0; i < w->count; i++)
+  {
+    double x = w->time[i] - localTime - meanTime;
+
+    sxx += x * x;
+    sxy += x * (w->phase[i] - meanPhase);
+  }
+
+  if(sxx <= 0)
+  {
+    *adj = w->adj = clampAdj(w->adj, maxAdj);
+    return SERVO_UNLOCKED;
+  }
+
+  slope = sxy / sxx;
+  ptpClock->observed_drift = clampAdj(slope * 1000000000.0, ADJ_FREQ_MAX);
+
+  /* offset at the current sample according to the line */
+  estimate = meanPhase - slope * meanTime - w->correction;
+  *adj = clampAdj(ptpClock->observed_drift + estimate/ptpClock->runTimeOpts.ap, maxAdj);
+
+  DBGV("%slinreg: %d samples, drift %dppb, offset estimate %.0fns\n",
+       ptpClock->name, w->count, ptpClock->observed_drift, estimate);
+
+done:
+  /* integrated until the next sample, maxAdj is 0 if it does not get applied */
+  w->adj = *adj;
+  return w->count < MIN_SERVO_WINDOW ? SERVO_UNLOCKED : SERVO_LOCKED;
+}
+
+const ClockServo servoLinreg = {
+  .name = "linreg",
+  .reset = linregReset,
+  .sample = linregSample,
+};
@@ -0,0 +1,139 @@
+/* servo_pi.c */
+
+#include "../ptpd.h"
+
+#include <math.h>
+
+/*
+ * The original ptpd clock servo: a PI controller whose proportional
+ * and integral gains are the inverse of the attenuations ap and ai
+ * (-a option). The I component is accumulated in fixed point, so that
+ * offsets smaller than ai still count, and rounded to observed_drift.
+ */
+
+static void piReset(PtpClock *ptpClock)
+{
+  /* continue from observed_drift, initClock() decides about it */
+  ptpClock->servoIntegral = TO_FIXED(ptpClock->observed_drift);
+}
+
+/* one step of the PI controller with attenuations 'ap', 'ai' */
+static void piControl(TimeInternal offset, Integer32 ap, Integer32 ai, Integer32 maxAdj, Integer32 *adj, PtpClock *ptpClock)
+{
+  FixedPoint *integral = &ptpClock->servoIntegral, out;
+  
+  /* the accumulator for the I component */
+  *integral += TO_FIXED(offset)/ai;
+  
+  /*
+   * clamp the accumulator to the correction which can be applied, it
+   * must not wind up beyond it
+   */
+  if(*integral > TO_FIXED(maxAdj))
+    *integral = TO_FIXED(maxAdj);
+  else if(*integral < TO_FIXED(-maxAdj))
+    *integral = TO_FIXED(-maxAdj);
+  ptpClock->observed_drift = FROM_FIXED(*integral);
+  
+  /* so does the output, large offsets would not fit into Integer32 */
+  out = TO_FIXED(offset)/ap + *integral;
+  if(out > TO_FIXED(maxAdj))
+    out = TO_FIXED(maxAdj);
+  else if(out < TO_FIXED(-maxAdj))
+    out = TO_FIXED(-maxAdj);
+  *adj = FROM_FIXED(out);
+}
+
+/* no negative or zero attenuation */
+static void piCheckGains(PtpClock *ptpClock)
+{
+  if(ptpClock->runTimeOpts.ap < 1)
+   ptpClock->runTimeOpts.ap = 1;
+  if(ptpClock->runTimeOpts.ai < 1)
+    ptpClock->runTimeOpts.ai = 1;
+}
+
+static ServoState piSample(TimeInternal offset, TimeInternal localTime, Integer32 maxAdj, Integer32 *adj, PtpClock *ptpClock)
+{
+  piCheckGains(ptpClock);
+  piControl(offset, ptpClock->runTimeOpts.ap, ptpClock->runTimeOpts.ai, maxAdj, adj, ptpClock);
+  
+  return SERVO_LOCKED;
+}
+
+const ClockServo servoPI = {
+  .name = "pi",
+  .reset = piReset,
+  .sample = piSample,
+};
+
+/*
+ * The adaptive variant schedules the gains: it starts with the
+ * attenuations of -a, which acquire lock fast, and narrows the loop
+ * bandwidth in stages while the offsets are dominated by noise, i.e.
+ * their mean is small compared to their standard deviation. Each
+ * stage halves the bandwidth at the same damping: twice the P and four
+ * times the I attenuation. A persistent mean offset, as left by a
+ * frequency change the narrow loop cannot follow, widens it again one
+ * stage at a time, an offset far outside the noise right back to the
+ * first stage. Every change is followed by GAIN_AVERAGE samples
+ * without another one; together with the gap between GAIN_NARROW and
+ * GAIN_WIDEN this is the hysteresis which keeps the gains from
+ * toggling.
+ */
+
+static void adaptiveReset(PtpClock *ptpClock)
+{
+  piReset(ptpClock);
+  memset(&ptpClock->servoGain, 0, sizeof(ptpClock->servoGain));
+}
+
+static void adaptiveStage(Integer16 stage, PtpClock *ptpClock)
+{
+  ServoGain *g = &ptpClock->servoGain;
+  
+  DBG("%sadaptive: stage %d -> %d, offset mean %.0fns, deviation %.0fns\n",
+      ptpClock->name, g->stage, stage, g->mean, sqrt(g->variance));
+  g->stage = stage;
+  g->samples = 0;
+}
+
+static ServoState adaptiveSample(TimeInternal offset, TimeInternal localTime, Integer32 maxAdj, Integer32 *adj, PtpClock *ptpClock)
+{
+  ServoGain *g = &ptpClock->servoGain;
+  double deviation;
+  
+  piCheckGains(ptpClock);
+  
+  /* the averages start from the first offset */
+  if(!g->samples && !g->stage && !g->variance)
+    g->mean = offset;
+  g->mean += (offset - g->mean) / GAIN_AVERAGE;
+  g->variance += ((offset - g->mean) * (offset - g->mean) - g->variance) / GAIN_AVERAGE;
+  deviation = sqrt(g->variance);
+  if(g->samples < GAIN_AVERAGE)
+    ++g->samples;
+  
+  if(g->stage && llabs(offset) > GAIN_RESET * deviation)
+    adaptiveStage(0, ptpClock);
+  else if(g->samples >= GAIN_AVERAGE)
+  {
+    if(g->stage < GAIN_STAGES - 1 && fabs(g->mean) < GAIN_NARROW * deviation)
+      adaptiveStage(g->stage + 1, ptpClock);
+    else if(g->stage && fabs(g->mean) > GAIN_WIDEN * deviation)
+      adaptiveStage(g->stage - 1, ptpClock);
+  }
+  
+  piControl(offset,
+            ptpClock->runTimeOpts.ap << g->stage,
+            ptpClock->runTimeOpts.ai << 2*g->stage,
+            maxAdj, adj, ptpClock);
+  
+  return g->stage ? SERVO_LOCKED : SERVO_UNLOCKED;
+}
+
+const ClockServo servoAdaptive = {
+  .name = "adaptive",
+  .reset = adaptiveReset,
+  .sample = adaptiveSample,
+};
@@ -35,18 +35,62 @@ void catch_close(int sig)
 
 void ptpdShutdown()
 {
+  if(ptpClock->port_state == PTP_SLAVE)
+    writeDrift(ptpClock);
+  
   netShutdown(ptpClock);
+  shutdownTime(ptpClock);
+  filterShutdown(ptpClock);
+  captureClose();
+  LATENCY_DUMP();
   
   free(ptpClock->foreign);
   free(ptpClock);
 }
 
+/* initialize run-time options to reasonable values */
+void ptpdDefaults(RunTimeOpts *rtOpts)
+{
+  rtOpts->syncInterval = DEFUALT_SYNC_INTERVAL;
+  memcpy(rtOpts->subdomainName, DEFAULT_PTP_DOMAIN_NAME, PTP_SUBDOMAIN_NAME_LENGTH);
+  memcpy(rtOpts->clockIdentifier, IDENTIFIER_DFLT, PTP_CODE_STRING_LENGTH);
+  rtOpts->clockVariance = DEFAULT_CLOCK_VARIANCE;
+  rtOpts->clockStratum = DEFAULT_CLOCK_STRATUM;
+  rtOpts->unicastAddress[0] = 0;
+  rtOpts->inboundLatency = DEFAULT_INBOUND_LATENCY;
+  rtOpts->outboundLatency = DEFAULT_OUTBOUND_LATENCY;
+  rtOpts->noResetClock = DEFAULT_NO_RESET_CLOCK;
+  rtOpts->stepThreshold = DEFAULT_STEP_THRESHOLD;
+  rtOpts->maxSlew = DEFAULT_MAX_SLEW;
+  rtOpts->noAdjust = DEFAULT_NO_ADJUST_CLOCK;
+  rtOpts->s = DEFAULT_DELAY_S;
+  rtOpts->ap = DEFAULT_AP;
+  rtOpts->ai = DEFAULT_AI;
+  rtOpts->max_foreign_records = DEFUALT_MAX_FOREIGN_RECORDS;
+  rtOpts->recvBatch = DEFAULT_RECV_BATCH;
+  rtOpts->recvTimeStore = DEFAULT_RECV_TIME_STORE;
+  rtOpts->crossSamples = DEFAULT_CROSS_SAMPLES;
+  rtOpts->crossRate = DEFAULT_CROSS_RATE;
+  rtOpts->filter = DEFAULT_SAMPLE_FILTER;
+  rtOpts->filterWindow = DEFAULT_FILTER_WINDOW;
+  rtOpts->filterPercentile = DEFAULT_FILTER_PERCENTILE;
+  rtOpts->gateSigma = DEFAULT_GATE_SIGMA;
+  rtOpts->gateConsecutive = DEFAULT_GATE_CONSECUTIVE;
+  rtOpts->calibrationSyncs = DEFAULT_CALIBRATION_SYNCS;
+  rtOpts->holdover = DEFAULT_HOLDOVER;
+  rtOpts->servo = DEFAULT_SERVO;
+  rtOpts->servoWindow = DEFAULT_SERVO_WINDOW;
+  rtOpts->currentUtcOffset = DEFAULT_UTC_OFFSET;
+}
+
 PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpts)
 {
-  int c, fd = -1, nondaemon = 0, noclose = 0;
+  int c, i, fd = -1, nondaemon = 0, noclose = 0;
+  const char *capture = NULL;
+  Boolean replay = FALSE;
 
   /* parse command line arguments */
-  while( (c = getopt(argc, argv, "?cf:dDz:xta:w:b:u:l:o:e:hy:m:gps:i:v:n:k:r")) != -1 ) {
+  while( (c = getopt(argc, argv, "?cf:dDz:xXT:L:ta:w:F:G:U:Y:H:C:E:S:O:W:V:b:u:l:o:e:hy:m:B:R:gpP:s:i:v:n:k:r")) != -1 ) {
     switch(c) {
     case '?':
       printf(
@@ -63,16 +107,57 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
 "                  nic = the network interface\n"
 "                  both = NIC time is synchronized over the network via PTP\n"
 "                         and system time against NIC via local PTP\n"
+"                         (-x, -X, -T, -L, -t, -a, -w apply to the latter,\n"
+"                         -S to both)\n"
 "                  assisted = system time is synchronized across network via\n"
 "                             NIC assisted time stamping\n"
 "                  linux_hw = synchronize system time with Linux kernel assistance\n"
 "                          via net_tstamp API, uses NIC time stamping\n"
 "                  linux_sw = synchronize system time with Linux kernel assistance\n"
 "                          via net_tstamp API, uses software time stamping\n"
-"-x                do not reset the clock if off by more than one second\n"
+"                  phc = PTP hardware clock of the interface, via clock_adjtime()\n"
+"                        and net_tstamp API\n"
+"-P DEVICE         use PTP hardware clock DEVICE (/dev/ptpN) with -z phc,\n"
+"                  'realtime' = CLOCK_REALTIME with software time stamping\n"
+"-x                never step the clock, slew it\n"
+"-X                step the clock only before its first correction\n"
+"-T NUMBER         step the clock if off by NUMBER nsec or more\n"
+"                  (default 1000000000)\n"
+"-L NUMBER         slew larger offsets by at most NUMBER ppb, also limits\n"
+"                  the clock servo\n"
 "-t                do not adjust the system clock\n"
 "-a NUMBER,NUMBER  specify clock servo P and I attenuations\n"
 "-w NUMBER         specify one way delay filter stiffness\n"
+"-F NAME[,NUMBER[,NUMBER]]  filter delay measurements before the clock servo:\n"
+"                  iir = average offsets, -w delay filter (default)\n"
+"                  min, median = use the pair with the smallest, median delay\n"
+"                  percentile = use the pair at the third NUMBER percentile\n"
+"                  of the delays (default 10)\n"
+"                  among the last NUMBER (1-64, default 8) pairs\n"
+"-U NUMBER         estimate frequency from NUMBER Syncs (0-64, default 4) and\n"
+"                  step before the clock servo takes over, 0 = no calibration\n"
+"-Y FILE           save the frequency correction in FILE while slave and at exit,\n"
+"                  start with it next time\n"
+"-H NUMBER         keep the learned frequency for up to NUMBER seconds when\n"
+"                  the master disappears (default 3600, 0 = no holdover)\n"
+"-G NUMBER,NUMBER  drop offsets and delays more than NUMBER standard deviations\n"
+"                  (default 4, 0 = never) from the mean, up to NUMBER in a row\n"
+"-C NUMBER,NUMBER  with -z both: compare NIC and system time NUMBER times\n"
+"                  per measurement (1-25), NUMBER measurements per second\n"
+"-E NUMBER,NUMBER,NUMBER[,overwrite]  with -z nic, both, assisted: emulate\n"
+"                  the NIC in software, NUMBER nsec off from system time,\n"
+"                  NUMBER ppb fast, NUMBER nsec time stamp jitter; overwrite =\n"
+"                  new time stamps replace unread ones instead of being lost\n"
+"-S NAME[,NUMBER]  select the clock servo:\n"
+"                  pi = PI controller with the -a attenuations (default)\n"
+"                  linreg = linear regression over the last NUMBER (4-64) offsets\n"
+"                  kalman = Kalman filter for offset, frequency and path delay\n"
+"                  adaptive = PI controller which starts with the -a attenuations\n"
+"                             and narrows them as the offsets settle\n"
+"-O FILE           append the input of the clock servo to FILE, see servocmp\n"
+"-W FILE           record received packets, time stamps and timers in FILE\n"
+"-V FILE           replay FILE written with -W instead of using network and\n"
+"                  clock, with the same options, as fast as possible\n"
 "\n"
 "-b NAME           bind PTP to network interface NAME\n"
 "-u ADDRESS        also send uni-cast to ADDRESS\n"
@@ -82,8 +167,10 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
 "-e NUMBER         specify epoch NUMBER\n"
 "-h                specify half epoch\n"
 "\n"
-"-y NUMBER         specify sync interval in 2^NUMBER sec\n"
+"-y NUMBER         specify sync interval in 2^NUMBER sec (-7 to 16)\n"
 "-m NUMBER         specify max number of foreign master records\n"
+"-B NUMBER         receive up to NUMBER messages per socket wakeup (1-32, 1 = no batching)\n"
+"-R NUMBER         keep up to NUMBER NIC receive time stamps (nic, both, assisted)\n"
 "\n"
 "-g                run as slave only\n"
 "-p                make this a preferred clock\n"
@@ -157,6 +244,10 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
       {
         rtOpts->time = TIME_SYSTEM_LINUX_SW;
       }
+      else if(!strcasecmp(optarg, "phc"))
+      {
+        rtOpts->time = TIME_PHC;
+      }
       else
       {
         ERROR("Unsupported -z clock '%s'.\n", optarg);
@@ -168,6 +259,22 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
       rtOpts->noResetClock = TRUE;
       break;
       
+    case 'X':
+      rtOpts->stepFirstOnly = TRUE;
+      break;
+      
+    case 'T':
+      rtOpts->stepThreshold = strtoll(optarg, 0, 0);
+      if(rtOpts->stepThreshold < 1)
+        rtOpts->stepThreshold = 1;
+      break;
+      
+    case 'L':
+      rtOpts->maxSlew = strtol(optarg, 0, 0);
+      if(rtOpts->maxSlew < 1 || rtOpts->maxSlew > ADJ_FREQ_MAX)
+        rtOpts->maxSlew = ADJ_FREQ_MAX;
+      break;
+      
     case 't':
       rtOpts->noAdjust = TRUE;
       break;
@@ -182,6 +289,122 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
       rtOpts->s = strtol(optarg, &optarg, 0);
       break;
       
+    case 'F':
+      for(i = 0; i < FILTER_MAX; i++)
+        if(!strncasecmp(optarg, filterName(i), strcspn(optarg, ",")) &&
+           !filterName(i)[strcspn(optarg, ",")])
+          break;
+      if(i == FILTER_MAX)
+      {
+        ERROR("Unsupported -F filter '%s'.\n", optarg);
+        *ret = 1;
+        break;
+      }
+      rtOpts->filter = i;
+      optarg += strcspn(optarg, ",");
+      if(optarg[0])
+        rtOpts->filterWindow = strtol(optarg+1, &optarg, 0);
+      if(optarg[0])
+        rtOpts->filterPercentile = strtol(optarg+1, 0, 0);
+      if(rtOpts->filterWindow < 1)
+        rtOpts->filterWindow = 1;
+      else if(rtOpts->filterWindow > MAX_FILTER_WINDOW)
+        rtOpts->filterWindow = MAX_FILTER_WINDOW;
+      if(rtOpts->filterPercentile < 0)
+        rtOpts->filterPercentile = 0;
+      else if(rtOpts->filterPercentile > 100)
+        rtOpts->filterPercentile = 100;
+      break;
+      
+    case 'U':
+      rtOpts->calibrationSyncs = strtol(optarg, 0, 0);
+      if(rtOpts->calibrationSyncs < 0)
+        rtOpts->calibrationSyncs = 0;
+      else if(rtOpts->calibrationSyncs > MAX_CALIBRATION_SYNCS)
+        rtOpts->calibrationSyncs = MAX_CALIBRATION_SYNCS;
+      break;
+      
+    case 'Y':
+      strncpy(rtOpts->driftFile, optarg, sizeof(rtOpts->driftFile) - 1);
+      break;
+      
+    case 'H':
+      rtOpts->holdover = strtol(optarg, 0, 0);
+      if(rtOpts->holdover < 0)
+        rtOpts->holdover = 0;
+      break;
+      
+    case 'G':
+      rtOpts->gateSigma = strtol(optarg, &optarg, 0);
+      if(optarg[0])
+        rtOpts->gateConsecutive = strtol(optarg+1, 0, 0);
+      if(rtOpts->gateSigma < 0)
+        rtOpts->gateSigma = 0;
+      if(rtOpts->gateConsecutive < 0)
+        rtOpts->gateConsecutive = 0;
+      break;
+      
+    case 'C':
+      rtOpts->crossSamples = strtol(optarg, &optarg, 0);
+      if(optarg[0])
+        rtOpts->crossRate = strtol(optarg+1, 0, 0);
+      if(rtOpts->crossSamples < 1)
+        rtOpts->crossSamples = 1;
+      else if(rtOpts->crossSamples > MAX_CROSS_SAMPLES)
+        rtOpts->crossSamples = MAX_CROSS_SAMPLES;
+      if(rtOpts->crossRate < 1)
+        rtOpts->crossRate = 1;
+      else if(rtOpts->crossRate > MAX_CROSS_RATE)
+        rtOpts->crossRate = MAX_CROSS_RATE;
+      break;
+      
+    case 'E':
+      rtOpts->e1000Sim = TRUE;
+      rtOpts->e1000SimOffset = strtoll(optarg, &optarg, 0);
+      if(optarg[0])
+        rtOpts->e1000SimDrift = strtol(optarg+1, &optarg, 0);
+      if(optarg[0])
+        rtOpts->e1000SimJitter = strtol(optarg+1, &optarg, 0);
+      if(optarg[0])
+        rtOpts->e1000SimOverwrite = !strcasecmp(optarg+1, "overwrite");
+      if(rtOpts->e1000SimJitter < 0)
+        rtOpts->e1000SimJitter = 0;
+      break;
+      
+    case 'S':
+      for(i = 0; i < SERVO_MAX; i++)
+        if(!strncasecmp(optarg, findServo(i)->name, strcspn(optarg, ",")) &&
+           !findServo(i)->name[strcspn(optarg, ",")])
+          break;
+      if(i == SERVO_MAX)
+      {
+        ERROR("Unsupported -S servo '%s'.\n", optarg);
+        *ret = 1;
+        break;
+      }
+      rtOpts->servo = i;
+      optarg += strcspn(optarg, ",");
+      if(optarg[0])
+        rtOpts->servoWindow = strtol(optarg+1, 0, 0);
+      if(rtOpts->servoWindow < MIN_SERVO_WINDOW)
+        rtOpts->servoWindow = MIN_SERVO_WINDOW;
+      else if(rtOpts->servoWindow > MAX_SERVO_WINDOW)
+        rtOpts->servoWindow = MAX_SERVO_WINDOW;
+      break;
+      
+    case 'O':
+      if(!(rtOpts->servoLog = fopen(optarg, "a")))
+        PERROR("could not open servo log file");
+      break;
+      
+    case 'W':
+    case 'V':
+      capture = optarg;
+      replay = c == 'V';
+      if(replay)
+        nondaemon = 1;
+      break;
+      
     case 'b':
       memset(rtOpts->ifaceName, 0, IFACE_NAME_LENGTH);
       strncpy(rtOpts->ifaceName, optarg, IFACE_NAME_LENGTH);
@@ -192,9 +415,9 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
       break;
       
     case 'l':
-      rtOpts->inboundLatency.nanoseconds = strtol(optarg, &optarg, 0);
+      rtOpts->inboundLatency = strtol(optarg, &optarg, 0);
       if(optarg[0])
-        rtOpts->outboundLatency.nanoseconds = strtol(optarg+1, 0, 0);
+        rtOpts->outboundLatency = strtol(optarg+1, 0, 0);
       break;
       
     case 'o':
@@ -219,6 +442,24 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
         rtOpts->max_foreign_records = 1;
       break;
       
+    case 'B':
+      rtOpts->recvBatch = strtol(optarg, 0, 0);
+      if(rtOpts->recvBatch < 1)
+        rtOpts->recvBatch = 1;
+      else if(rtOpts->recvBatch > NET_RECV_BATCH_MAX)
+        rtOpts->recvBatch = NET_RECV_BATCH_MAX;
+      break;
+      
+    case 'P':
+      strncpy(rtOpts->phcDevice, optarg, sizeof(rtOpts->phcDevice) - 1);
+      break;
+      
+    case 'R':
+      rtOpts->recvTimeStore = strtol(optarg, 0, 0);
+      if(rtOpts->recvTimeStore < RECV_TIME_PROBES)
+        rtOpts->recvTimeStore = RECV_TIME_PROBES;
+      break;
+      
     case 'g':
       rtOpts->slaveOnly = TRUE;
       break;
@@ -269,6 +510,31 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
     }
   }
   
+  if(rtOpts->e1000Sim &&
+     rtOpts->time != TIME_NIC && rtOpts->time != TIME_BOTH && rtOpts->time != TIME_SYSTEM_ASSISTED)
+  {
+    ERROR("-E needs -z nic, both or assisted\n");
+    *ret = 1;
+    return 0;
+  }
+  
+  if(capture)
+  {
+    if(rtOpts->time == TIME_BOTH)
+    {
+      ERROR("capture and replay do not work with -z both\n");
+      *ret = 1;
+      return 0;
+    }
+    if(!captureOpen(capture, replay))
+    {
+      *ret = 1;
+      return 0;
+    }
+    if(replay)
+      rtOpts->time = TIME_REPLAY;
+  }
+  
   ptpClock = (PtpClock*)calloc(1, sizeof(PtpClock));
   ptpClock->name = "";
   if(!ptpClock)
@@ -311,6 +577,7 @@ PtpClock * ptpdStartup(int argc, char **argv, Integer16 *ret, RunTimeOpts *rtOpt
   signal(SIGINT, catch_close);
   signal(SIGTERM, catch_close);
   signal(SIGHUP, catch_close);
+  LATENCY_INIT();
   
   *ret = 0;
   return ptpClock;
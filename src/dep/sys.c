@@ -40,11 +40,11 @@ void message(int priority, const char *format, ...)
 static size_t sprintfTime(PtpClock *ptpClock, char *buffer, TimeInternal *t, const char *prefix)
 {
   return sprintf(buffer,
-                 ", %s%s%d.%09d",
+                 ", %s%s%lld.%09lld",
                  ptpClock->runTimeOpts.csvStats ? "" : prefix,
-                 (t->seconds < 0 || t->nanoseconds < 0) ? "-" : "",
-                 abs(t->seconds),
-                 abs(t->nanoseconds));
+                 *t < 0 ? "-" : "",
+                 llabs(*t) / 1000000000,
+                 llabs(*t) % 1000000000);
 }
 
 void displayStats(PtpClock *ptpClock)
@@ -79,7 +79,7 @@ void displayStats(PtpClock *ptpClock)
   
   len += sprintf(sbuf + len, "%s%s%s", ptpClock->runTimeOpts.csvStats ? "": "state: ", ptpClock->name, s);
   
-  if(ptpClock->port_state == PTP_SLAVE ||
+  if(ptpClock->port_state == PTP_SLAVE || ptpClock->port_state == PTP_UNCALIBRATED ||
      (ptpClock->port_state == PTP_MASTER && ptpClock->nic_instead_of_system))
   {
     len += sprintfTime(ptpClock, sbuf + len, &ptpClock->one_way_delay, "owd: ");
@@ -114,3 +114,114 @@ UInteger16 getRand(UInteger32 *seed)
   return rand_r((unsigned int*)seed);
 }
 
+
+/*
+ * The drift file holds one "<interface> <time source> <ppb>" line for
+ * each interface and -z clock, so that several daemons can share it.
+ */
+static void loadDrift(PtpClock *ptpClock)
+{
+  FILE *file;
+  char line[128], iface[IFACE_NAME_LENGTH + 1], clock[32];
+  long drift;
+
+  if(!ptpClock->runTimeOpts.driftFile[0])
+    return;
+
+  if(!(file = fopen(ptpClock->runTimeOpts.driftFile, "r")))
+  {
+    if(errno != ENOENT)
+      PERROR("could not read drift file %s", ptpClock->runTimeOpts.driftFile);
+    return;
+  }
+
+  while(fgets(line, sizeof(line), file))
+  {
+    if(sscanf(line, "%16s %31s %ld", iface, clock, &drift) != 3 ||
+       strcmp(iface, ptpClock->runTimeOpts.ifaceName) ||
+       strcmp(clock, ptpClock->timeBackend->name))
+      continue;
+
+    if(labs(drift) > MAX_DRIFT_FILE)
+      NOTIFY("ignoring drift of %ld ppb from %s\n", drift, ptpClock->runTimeOpts.driftFile);
+    else
+    {
+      INFO("starting with drift of %ld ppb from %s\n", drift, ptpClock->runTimeOpts.driftFile);
+      ptpClock->saved_drift = drift;
+    }
+  }
+
+  fclose(file);
+}
+
+void readDrift(PtpClock *ptpClock)
+{
+  Integer64 drift;
+
+  /* a replay starts from the drift of the recording */
+  if(!captureReplaying())
+    loadDrift(ptpClock);
+  drift = ptpClock->saved_drift;
+  captureTime(CAPTURE_DRIFT, &drift);
+  ptpClock->saved_drift = drift;
+}
+
+/* replace the line for this interface and time source, atomically */
+void writeDrift(PtpClock *ptpClock)
+{
+  FILE *file;
+  char lines[DRIFT_FILE_ENTRIES][128], tmp[PATH_MAX + 4];
+  char iface[IFACE_NAME_LENGTH + 1], clock[32];
+  long drift;
+  int i, count = 0;
+
+  if(!ptpClock->runTimeOpts.driftFile[0])
+    return;
+
+  if(labs(ptpClock->observed_drift) > MAX_DRIFT_FILE)
+  {
+    DBG("not saving drift of %d ppb\n", ptpClock->observed_drift);
+    return;
+  }
+
+  /* the file stays as recorded, but the result is the same */
+  if(captureReplaying())
+  {
+    ptpClock->saved_drift = ptpClock->observed_drift;
+    return;
+  }
+
+  /* keep the entries of other interfaces and time sources */
+  if((file = fopen(ptpClock->runTimeOpts.driftFile, "r")))
+  {
+    while(count < DRIFT_FILE_ENTRIES - 1 && fgets(lines[count], sizeof(lines[count]), file))
+      if(sscanf(lines[count], "%16s %31s %ld", iface, clock, &drift) == 3 &&
+         (strcmp(iface, ptpClock->runTimeOpts.ifaceName) ||
+          strcmp(clock, ptpClock->timeBackend->name)))
+        ++count;
+    fclose(file);
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ptpClock->runTimeOpts.driftFile);
+  if(!(file = fopen(tmp, "w")))
+  {
+    PERROR("could not write drift file %s", tmp);
+    return;
+  }
+
+  for(i = 0; i < count; i++)
+    fputs(lines[i], file);
+  fprintf(file, "%s %s %d\n",
+          ptpClock->runTimeOpts.ifaceName, ptpClock->timeBackend->name,
+          ptpClock->observed_drift);
+
+  if(fclose(file) || rename(tmp, ptpClock->runTimeOpts.driftFile) < 0)
+  {
+    PERROR("could not write drift file %s", ptpClock->runTimeOpts.driftFile);
+    unlink(tmp);
+    return;
+  }
+
+  ptpClock->saved_drift = ptpClock->observed_drift;
+  DBG("saved drift of %d ppb in %s\n", ptpClock->observed_drift, ptpClock->runTimeOpts.driftFile);
+}
@@ -1,687 +1,249 @@
-#include "../ptpd.h"
-#include <stdarg.h>
-
-#include "e1000_ioctl.h"
-
-/** global state for controlling system time when TIME_BOTH is selected */
-static PtpClock timeBothClock;
+/* time.c */
 
-/**
- * Most recent send time stamp from NIC, 0/0 if none available right now.
- * Reset by getSendTime().
- */
-static TimeInternal lastSendTime;
-
-#ifndef RECV_ARRAY_SIZE
-/**
- * Must be large enough to buffer all time stamps received from the NIC
- * but not yet requested by the protocol processor. Because new information
- * can only be added when the protocol asks for old one, this should not
- * get very full.
- */
-# define RECV_ARRAY_SIZE 10
-#endif
+#include "../ptpd.h"
 
-/**
- * An array of the latest RECV_ARRAY_SIZE packet receive information.
- * Once it overflows the oldest ones are overwritten in a round-robin
- * fashion.
- */
-static struct {
-  TimeInternal recvTimeStamp;
-  UInteger16 sequenceId;
-  Octet sourceUuid[PTP_UUID_LENGTH];
-} lastRecvTimes[RECV_ARRAY_SIZE];
-
-/**
- * Oldest valid and next free entry in lastRecvTimes.
- * Valid ones are [oldest, free[ if oldest <= free,
- * otherwise [oldest, RECV_ARRAY_SIZE[ and [0, free[.
+/*
+ * The time source is chosen once by initTime(): each Time mode is
+ * implemented by a TimeBackend in one of the time_*.c files and the
+ * functions here only dispatch to it.
  */
-static int oldestRecv, nextFreeRecv;
-
-/**
- * if TIME_BOTH: measure NIC<->system time offsets and adapt system time
- *
- * This function is called whenever init.c gets control; to prevent to
- * frequent changes it ignores invocations less than one second away from
- * the previous one.
+static const TimeBackend *timeBackends[TIME_MAX] = {
+  [TIME_SYSTEM] = &timeSystemBackend,
+  [TIME_NIC] = &timeNICBackend,
+  [TIME_BOTH] = &timeBothBackend,
+  [TIME_SYSTEM_ASSISTED] = &timeAssistedBackend,
+  [TIME_SYSTEM_LINUX_HW] = &timeLinuxHWBackend,
+  [TIME_SYSTEM_LINUX_SW] = &timeLinuxSWBackend,
+  [TIME_PHC] = &timePHCBackend,
+  [TIME_REPLAY] = &timeReplayBackend,
+  [TIME_SIM] = &timeSimBackend,
+};
+
+/*
+ * NIC receive time stamps are read whenever the protocol asks for
+ * one and kept in ptpClock->recvTimes until their packet is processed.
+ * A master serving many slaves needs a lot of them, so they are
+ * hashed by (sourceUuid, sequenceId) instead of searched linearly.
  */
-static void syncSystemWithNIC(PtpClock *ptpClock)
+static UInteger32 recvTimeHash(Octet *sourceUuid, UInteger16 sequenceId)
 {
-  struct E1000_TSYNC_COMPARETS_ARGU ts;
-  TimeInternal delay;
-  static TimeInternal zero;
+  /* FNV-1a */
+  UInteger32 h = 2166136261U;
+  int i;
 
-  if(ptpClock->runTimeOpts.time != TIME_BOTH)
-    return;
-  else
-  {
-#if 1
-    static TimeInternal lastsync;
-    TimeInternal now, offset;
-    timerNow(&now);
-    subTime(&offset, &now, &lastsync);
-    if(offset.seconds <= 0)
-      return;
-    lastsync = now;
-#endif
-  }
+  for(i = 0; i < PTP_UUID_LENGTH; i++)
+    h = (h ^ (UInteger8)sourceUuid[i]) * 16777619U;
+  h = (h ^ (sequenceId & 0xff)) * 16777619U;
+  h = (h ^ (sequenceId >> 8)) * 16777619U;
 
-  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-  memset(&ts, 0, sizeof(ts));
-  if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_COMPARETS_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-    ERROR("could not correlate E1000 hardware and system time on %s: %s\n",
-          ptpClock->netPath.eventSockIFR.ifr_name,
-          strerror(errno));
-    return;
-  }
-  delay.seconds = ts.systemToNIC.seconds * ts.systemToNICSign;
-  delay.nanoseconds = ts.systemToNIC.nanoseconds * ts.systemToNICSign;
-  DBGV("system to NIC delay %ld.%09d\n",
-       delay.seconds, delay.nanoseconds);
-  updateDelay(&delay, &zero, &timeBothClock.owd_filt, &timeBothClock);
-
-  delay.seconds = ts.NICToSystem.seconds * ts.NICToSystemSign;
-  delay.nanoseconds = ts.NICToSystem.nanoseconds * ts.NICToSystemSign;
-  DBGV("NIC to system delay %ld.%09d\n",
-       delay.seconds, delay.nanoseconds);
-  updateOffset(&delay, &zero, &timeBothClock.ofm_filt, &timeBothClock);
-
-  if(ptpClock->port_state == PTP_MASTER)
-  {
-    timeBothClock.nic_instead_of_system = TRUE;
-    timeBothClock.runTimeOpts.time = TIME_NIC;
-  }
-  else
-  {
-    timeBothClock.nic_instead_of_system = FALSE;
-    timeBothClock.runTimeOpts.time = TIME_SYSTEM;
-  }
-  updateClock(&timeBothClock);
-  DBGV("system time updated\n");
+  return h;
 }
 
-static Boolean selectNICTimeMode(Boolean sync, PtpClock *ptpClock)
+Boolean initRecvTimes(PtpClock *ptpClock)
 {
-  DBGV("time stamp incoming %s packets\n", sync ? "Sync" : "Delay_Req");
-
-  switch (ptpClock->runTimeOpts.time) {
-#ifdef HAVE_LINUX_NET_TSTAMP_H
-  case TIME_SYSTEM_LINUX_HW: {
-      struct hwtstamp_config hwconfig;
-      int so_timestamping_flags;
-
-      ptpClock->netPath.eventSockIFR.ifr_data = (void *)&hwconfig;
-      memset(&hwconfig, 0, sizeof(&hwconfig));
-
-      /*
-       * Configure for time stamping of incoming Sync or Delay_Req
-       * messages and for time stamping of all out-going event
-       * messages. Out-going messages will be bounced via the error
-       * queue of the event socket.
-       */
-      hwconfig.tx_type = HWTSTAMP_TX_ON;
-      hwconfig.rx_filter = sync ?
-          HWTSTAMP_FILTER_PTP_V1_L4_SYNC :
-          HWTSTAMP_FILTER_PTP_V1_L4_DELAY_REQ;
-      so_timestamping_flags = SOF_TIMESTAMPING_TX_HARDWARE|SOF_TIMESTAMPING_RX_HARDWARE|SOF_TIMESTAMPING_SYS_HARDWARE;
-
-      if (ioctl(ptpClock->netPath.eventSock, SIOCSHWTSTAMP, &ptpClock->netPath.eventSockIFR) < 0) {
-          if (errno == ERANGE) {
-              /* hardware time stamping not supported */
-              PERROR("net_tstamp SIOCSHWTSTAMP: mode of operation not supported");
-              return FALSE;
-          } else {
-              PERROR("net_tstamp SIOCSHWTSTAMP: %s", strerror(errno));
-              return FALSE;
-          }
-      }
+  RecvTimeStore *store = &ptpClock->recvTimes;
 
-      if (setsockopt(ptpClock->netPath.eventSock, SOL_SOCKET, SO_TIMESTAMPING, &so_timestamping_flags, sizeof(so_timestamping_flags)) < 0) {
-          PERROR("net_tstamp SO_TIMESTAMPING: %s", strerror(errno));
-          return FALSE;
-      }
-      break;
-  }
-  case TIME_SYSTEM_LINUX_SW: {
-      /* same as before, but without requiring support by the NIC */
-      int so_timestamping_flags =
-          SOF_TIMESTAMPING_TX_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|SOF_TIMESTAMPING_SOFTWARE;
-      if (setsockopt(ptpClock->netPath.eventSock, SOL_SOCKET, SO_TIMESTAMPING, &so_timestamping_flags, sizeof(so_timestamping_flags)) < 0) {
-          PERROR("net_tstamp SO_TIMESTAMPING: %s", strerror(errno));
-          return FALSE;
-      }
-      break;
-  }
-#else
-  case TIME_SYSTEM_LINUX_SW:
-  case TIME_SYSTEM_LINUX_HW:
-      PERROR("net_tstamp interface not supported");
-      return FALSE;
-#endif /* HAVE_LINUX_NET_TSTAMP_H */
-  default:
-      *(int *)&ptpClock->netPath.eventSockIFR.ifr_data = sync ? E1000_UDP_V1_SYNC : E1000_UDP_V1_DELAY;
-      if(ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_ENABLERX_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-          ERROR("could not activate E1000 hardware receive time stamping on %s: %s\n",
-                ptpClock->netPath.eventSockIFR.ifr_name,
-                strerror(errno));
-          return FALSE;
-      }
-      break;
+  store->size = ptpClock->runTimeOpts.recvTimeStore;
+  if(store->size < RECV_TIME_PROBES)
+    store->size = RECV_TIME_PROBES;
+
+  store->entries = (RecvTime *)calloc(store->size, sizeof(RecvTime));
+  if(!store->entries)
+  {
+    PERROR("failed to allocate %d receive time stamps", store->size);
+    store->size = 0;
+    return FALSE;
   }
 
+  store->evictions = store->misses = store->staleHits = 0;
   return TRUE;
 }
 
-static Boolean initNICTime(Boolean sync, PtpClock *ptpClock)
+/* store a new time stamp, replacing a matching, unused or the oldest entry */
+void addRecvTime(TimeInternal *recvTimeStamp, Octet *sourceUuid, UInteger16 sequenceId, PtpClock *ptpClock)
 {
-  /** @todo also check success indicator in ifr_data */
-  if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_INIT_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-    ERROR("could not activate E1000 hardware time stamping on %s: %s\n",
-          ptpClock->netPath.eventSockIFR.ifr_name,
-          strerror(errno));
-  }
-  else if(ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_ENABLETX_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-    ERROR("could not activate E1000 hardware send time stamping on %s: %s\n",
-          ptpClock->netPath.eventSockIFR.ifr_name,
-          strerror(errno));
-  }
-  else if(!selectNICTimeMode(sync, ptpClock)) {
-    // error already printed
-  }
-  else {
-#if 0
-    // move the NIC time for debugging purposes
-    TimeInternal timeTmp;
-
-    DBGV("shift NIC time\n");
-    getTime(&timeTmp, ptpClock);
-    timeTmp.seconds -= 2;
-    setTime(&timeTmp, ptpClock);
-    DBGV("shift NIC time done\n");
-#endif
-    return TRUE;
-  }
-
-  return FALSE;
-}
+  RecvTimeStore *store = &ptpClock->recvTimes;
+  RecvTime *entry, *victim = NULL;
+  Integer64 now = timerMonotonic();
+  UInteger32 h;
+  int i;
 
-Boolean initTime(PtpClock *ptpClock)
-{
-  switch(ptpClock->runTimeOpts.time) {
-  case TIME_SYSTEM:
-    return TRUE;
-    break;
-  case TIME_BOTH:
-    /* prepare clock servo for controlling system time */
-    timeBothClock = *ptpClock;
-    timeBothClock.runTimeOpts.time = TIME_SYSTEM;
-    timeBothClock.name = "sys ";
-    initClock(&timeBothClock);
-
-    /* default options for NIC synchronization */
-    ptpClock->runTimeOpts.noResetClock = DEFAULT_NO_RESET_CLOCK;
-    ptpClock->runTimeOpts.noAdjust = DEFAULT_NO_ADJUST_CLOCK;
-    ptpClock->runTimeOpts.s = DEFAULT_DELAY_S;
-    ptpClock->runTimeOpts.ap = DEFAULT_AP;
-    ptpClock->runTimeOpts.ai = DEFAULT_AI;
-
-    return initNICTime(TRUE, ptpClock);
-    break;
-  case TIME_SYSTEM_LINUX_HW:
-  case TIME_SYSTEM_LINUX_SW:
-    return selectNICTimeMode(TRUE, ptpClock);
-    break;
-  case TIME_NIC:
-  case TIME_SYSTEM_ASSISTED:
-    return initNICTime(TRUE, ptpClock);
-    break;
-  default:
-    ERROR("unsupported selection of time source\n");
-    return FALSE;
-    break;
-  }
-}
+  if(!store->size)
+    return;
 
-void getTime(TimeInternal *time, PtpClock *ptpClock)
-{
-  switch(ptpClock->runTimeOpts.time)
+  h = recvTimeHash(sourceUuid, sequenceId);
+  for(i = 0; i < RECV_TIME_PROBES; i++)
   {
-  case TIME_SYSTEM_LINUX_HW:
-  case TIME_SYSTEM_LINUX_SW:
-  case TIME_SYSTEM_ASSISTED:
-  case TIME_SYSTEM: {
-    struct timeval tv;
-
-    gettimeofday(&tv, 0);
-    time->seconds = tv.tv_sec;
-    time->nanoseconds = tv.tv_usec*1000;
-    break;
-  }
-  case TIME_BOTH:
-  case TIME_NIC: {
-    struct E1000_TSYNC_SYSTIME_ARGU ts;
-
-    ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-    memset(&ts, 0, sizeof(ts));
-    if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_SYSTIME_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-      ERROR("could not read E1000 hardware time on %s: %s\n",
-            ptpClock->netPath.eventSockIFR.ifr_name,
-            strerror(errno));
-      return;
+    entry = &store->entries[(h + i) % store->size];
+    if(!entry->valid
+       || now - entry->arrival > RECV_TIME_MAX_AGE
+       || (entry->sequenceId == sequenceId &&
+           !memcmp(entry->sourceUuid, sourceUuid, PTP_UUID_LENGTH)))
+    {
+      victim = entry;
+      break;
     }
-    time->seconds = ts.time.seconds;
-    time->nanoseconds = ts.time.nanoseconds;
-
-    syncSystemWithNIC(ptpClock);
-    break;
+    if(!victim || entry->arrival < victim->arrival)
+      victim = entry;
   }
-  default:
-    ERROR("unsupported selection of time source\n");
-    break;
-  }
-}
 
-void setTime(TimeInternal *time, PtpClock *ptpClock)
-{
-  switch(ptpClock->runTimeOpts.time)
+  if(i == RECV_TIME_PROBES)
   {
-  case TIME_SYSTEM_LINUX_HW:
-  case TIME_SYSTEM_LINUX_SW:
-  case TIME_SYSTEM_ASSISTED:
-  case TIME_SYSTEM: {
-    NOTIFY("resetting system clock to %ds %dns\n", time->seconds, time->nanoseconds);
-    struct timeval tv;
-    tv.tv_sec = time->seconds;
-    tv.tv_usec = time->nanoseconds/1000;
-    settimeofday(&tv, 0);
-    break;
-  }
-  case TIME_BOTH:
-  case TIME_NIC: {
-    struct E1000_TSYNC_SYSTIME_ARGU ts;
-    TimeInternal currentTime, offset;
-
-    NOTIFY("resetting NIC clock to %ds %dns\n", time->seconds, time->nanoseconds);
-    memset(&ts, 0, sizeof(ts));
-    getTime(&currentTime, ptpClock);
-    subTime(&offset, time, &currentTime);
-    ts.negative_offset = (offset.seconds < 0 || offset.nanoseconds < 0) ? -1 : 1;
-    ts.time.seconds = ts.negative_offset * offset.seconds;
-    ts.time.nanoseconds = ts.negative_offset * offset.nanoseconds;
-    ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-    NOTIFY("adding NIC offset %s%ld.%09d (%ld/%p)\n",
-         ts.negative_offset < 0 ? "-" : "",
-         ts.time.seconds,
-         ts.time.nanoseconds,
-         sizeof(ts), &ts);
-    if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_SYSTIME_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-      ERROR("could not set E1000 hardware time on %s: %s\n",
-            ptpClock->netPath.eventSockIFR.ifr_name,
-            strerror(errno));
-    }
-    else
-    {
-      DBGV("new NIC time %ld.%09d\n",
-           ts.time.seconds,
-           ts.time.nanoseconds);
-      syncSystemWithNIC(ptpClock);
-    }
-    break;
-  }
-  default:
-    ERROR("unsupported selection of time source\n");
-    break;
+    ++store->evictions;
+    DBG("evicted rx time stamp of sequence %u\n", victim->sequenceId);
   }
+
+  victim->valid = TRUE;
+  victim->recvTimeStamp = *recvTimeStamp;
+  victim->arrival = now;
+  victim->sequenceId = sequenceId;
+  memcpy(victim->sourceUuid, sourceUuid, PTP_UUID_LENGTH);
 }
 
-void adjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+/* look up and consume the time stamp of a packet */
+Boolean findRecvTime(TimeInternal *recvTimeStamp,
+                     Octet *sourceUuid,
+                     UInteger16 sequenceId,
+                     PtpClock *ptpClock)
 {
-  switch(ptpClock->runTimeOpts.time)
-  {
-  case TIME_SYSTEM_LINUX_HW:
-  case TIME_SYSTEM_LINUX_SW:
-  case TIME_SYSTEM_ASSISTED:
-  case TIME_SYSTEM: {
-    struct timex t;
-    static Boolean maxAdjValid;
-    static long maxAdj;
-    static long minTick, maxTick;
-    static long userHZ;
-    static long tickRes; /* USER_HZ * 1000 [ppb] */
-    long tickAdj;
-    long freqAdj;
-    int res;
-
-    if (!maxAdjValid) {
-        userHZ = sysconf(_SC_CLK_TCK);
-        t.modes = 0;
-        adjtimex(&t);
-        maxAdj = t.tolerance / ((1<<16)/1000);
-        tickRes = userHZ * 1000;
-        /* limits from the adjtimex command man page; could be determined via binary search */
-        minTick = (900000 - 1000000) / userHZ;
-        maxTick = (1100000 - 1000000) / userHZ;
-        maxAdjValid = TRUE;
-    }
+  RecvTimeStore *store = &ptpClock->recvTimes;
+  RecvTime *entry;
+  UInteger32 h;
+  int i;
 
-    /*
-     * The Linux man page for the adjtimex() system call does not
-     * describe limits for frequency. The more recent man page for
-     * the adjtimex command on RH5 does and says that
-     * -tolerance <= frequency <= tolerance
-     * which was confirmed by trying out values just outside that interval.
-     *
-     * Note that this contradicts the comments for struct timex which say
-     * that freq and tolerance have different units (scaled ppm vs ppm).
-     *
-     * We follow the actual implementation on Linux 2.6.22 and do the
-     * range check after scaling.
-     */
-
-    t.modes = MOD_FREQUENCY|MOD_CLKB;
-    /*
-     * @todo
-     * Where is the official documentation for "scaled  ppm"?
-     * Should this perhaps be adj * (1<<16) / 1000 (more accurate
-     * than multiplying by ((1<<16)/1000) == 65)?
-     */
-
-    /*
-     * 1 t.tick = 1 e-6 s * USER_HZ 1/s = 1 USER_HZ * 1000 ppb
-     *
-     * Large values of adj can be turned into t.tick adjustments:
-     * tickAdj t.tick = adj ppb / ( USER_HZ * 1000 ppb )
-     *
-     * Round this so that the error is as small is possible,
-     * because we need to fit that into t.freq.
-     */
-    freqAdj = adj;
-    tickAdj = 0;
-    if(freqAdj > maxAdj)
-    {
-      tickAdj = (adj - maxAdj + tickRes - 1) / tickRes;
-      if(tickAdj > maxTick)
-        tickAdj = maxTick;
-      freqAdj = adj - tickAdj * tickRes;
-    }
-    else if(freqAdj < -maxAdj)
-    {
-      tickAdj = -((-adj - maxAdj + tickRes - 1) / tickRes);
-      if(tickAdj < minTick)
-        tickAdj = minTick;
-      freqAdj = adj - tickAdj * tickRes;
-    }
-    if(freqAdj > maxAdj)
-      freqAdj = maxAdj;
-    else if(freqAdj < -maxAdj)
-      freqAdj = -maxAdj;
-
-    t.freq = freqAdj * ((1<<16)/1000);
-    t.tick = tickAdj + 1000000 / userHZ;
-    ptpClock->adj = tickAdj * tickRes + freqAdj;
-
-    INFO("requested adj %d ppb => adjust system frequency by %d scaled ppm (%d ppb) + %ld us/tick (%d ppb) = adj %d ppb (freq limit %ld/%ld ppm, tick limit %ld/%ld us*USER_HZ)\n",
-         adj,
-         t.freq, freqAdj,
-         t.tick - 1000000 / userHZ, tickAdj * tickRes,
-         ptpClock->adj,
-         -maxAdj, maxAdj,
-         minTick, maxTick);
-
-    res = adjtimex(&t);
-    switch (res) {
-    case -1:
-        ERROR("adjtimex(freq = %d) failed: %s\n",
-              t.freq, strerror(errno));
-        break;
-    case TIME_OK:
-        INFO("  -> TIME_OK\n");
-        break;
-    case TIME_INS:
-        ERROR("adjtimex -> insert leap second?!\n");
-        break;
-    case TIME_DEL:
-        ERROR("adjtimex -> delete leap second?!\n");
-        break;
-    case TIME_OOP:
-        ERROR("adjtimex -> leap second in progress?!\n");
-        break;
-    case TIME_WAIT:
-        ERROR("adjtimex -> leap second has occurred?!\n");
-        break;
-    case TIME_BAD:
-        ERROR("adjtimex -> time bad\n");
-        break;
-    default:
-        ERROR("adjtimex -> unknown result %d\n", res);
-        break;
-    }
-    break;
-  }
-  case TIME_BOTH:
-  case TIME_NIC: {
-    if(offset)
+  if(!store->size)
+    return FALSE;
+
+  h = recvTimeHash(sourceUuid, sequenceId);
+  for(i = 0; i < RECV_TIME_PROBES; i++)
+  {
+    entry = &store->entries[(h + i) % store->size];
+    if(entry->valid &&
+       entry->sequenceId == sequenceId &&
+       !memcmp(entry->sourceUuid, sourceUuid, PTP_UUID_LENGTH))
     {
-#if 0
-      struct E1000_TSYNC_SYSTIME_ARGU ts;
-      memset(&ts, 0, sizeof(ts));
-      // always store positive seconds/nanoseconds
-      ts.negative_offset = (offset->seconds < 0 || offset->nanoseconds < 0) ? -1 : 1;
-      ts.time.seconds = ts.negative_offset * offset->seconds;
-      ts.time.nanoseconds = ts.negative_offset * offset->nanoseconds;
-      // invert the sign: if offset is positive, we need to substract it and vice versa
-      ts.negative_offset *= -1;
-      DBGV("adjust NIC time by offset %s%lu.%09d (adj %d)\n",
-           ts.negative_offset < 0 ? "-" : "",
-           ts.time.seconds, ts.time.nanoseconds,
-           adj);
-      ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-      if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_SYSTIME_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-        ERROR("could not modify E1000 hardware time on %s: %s\n",
-              ptpClock->netPath.eventSockIFR.ifr_name,
-              strerror(errno));
-      }
-      else
-        syncSystemWithNIC(ptpClock);
-#else
-      // adjust NIC frequency
-      struct E1000_TSYNC_ADJTIME_ARGU ts;
-      memset(&ts, 0, sizeof(ts));
-      ts.adj = (long long)adj;
-      if(ptpClock->nic_instead_of_system)
-        ts.adj = -ts.adj;
-      ts.set_adj = TRUE;
-      ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-      DBGV("adjust NIC frequency by %d ppb\n", ts.adj);
-      ptpClock->adj = ts.adj;
-      if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_ADJTIME_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-        ERROR("could not modify E1000 hardware frequency on %s: %s\n",
-              ptpClock->netPath.eventSockIFR.ifr_name,
-              strerror(errno));
+      // invalidate entry to prevent accidental reuse (happened when slaves were
+      // restarted quickly while the master still had their old sequence IDs in the array)
+      entry->valid = FALSE;
+
+      if(timerMonotonic() - entry->arrival > RECV_TIME_MAX_AGE)
+      {
+        ++store->staleHits;
+        DBG("ignoring stale rx time stamp of sequence %u\n", sequenceId);
+        return FALSE;
       }
-      else
-        syncSystemWithNIC(ptpClock);
-#endif
+
+      DBGV("found rx time %lldns, sequence %u\n",
+           entry->recvTimeStamp, sequenceId);
+      *recvTimeStamp = entry->recvTimeStamp;
+      return TRUE;
     }
-    else
-      syncSystemWithNIC(ptpClock);
-    break;
-  }
-  default:
-    ERROR("unsupported selection of time source\n");
-    break;
   }
+
+  ++store->misses;
+  return FALSE;
 }
 
-void adjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+Boolean initTime(PtpClock *ptpClock)
 {
-  switch(ptpClock->runTimeOpts.time)
+  const TimeBackend *backend = NULL;
+  Boolean ok;
+
+  if(ptpClock->runTimeOpts.time < TIME_MAX)
+    backend = timeBackends[ptpClock->runTimeOpts.time];
+  if(!backend)
   {
-  case TIME_BOTH:
-  case TIME_NIC: {
-    struct E1000_TSYNC_SYSTIME_ARGU ts;
-    memset(&ts, 0, sizeof(ts));
-    // always store positive seconds/nanoseconds
-    ts.negative_offset = (offset->seconds < 0 || offset->nanoseconds < 0) ? -1 : 1;
-    ts.time.seconds = ts.negative_offset * offset->seconds;
-    ts.time.nanoseconds = ts.negative_offset * offset->nanoseconds;
-
-    // invert the sign: if offset is positive, we need to substract it and vice versa;
-    // when in nic_instead_of_system the logic is already inverted
-    if (!ptpClock->nic_instead_of_system)
-      ts.negative_offset *= -1;
-
-    DBGV("adjust NIC time by offset %s%lu.%09d\n",
-         ts.negative_offset < 0 ? "-" : "",
-         ts.time.seconds, ts.time.nanoseconds);
-    ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-    if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_SYSTIME_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-        ERROR("could not modify E1000 hardware time on %s: %s\n",
-              ptpClock->netPath.eventSockIFR.ifr_name,
-              strerror(errno));
-    }
-    else
-      syncSystemWithNIC(ptpClock);
-    break;
+    ERROR("unsupported selection of time source\n");
+    return FALSE;
   }
-  default: {
-    TimeInternal timeTmp;
 
-    getTime(&timeTmp, ptpClock);
-    subTime(&timeTmp, &timeTmp, offset);
-    setTime(&timeTmp, ptpClock);
-  }
-  }
+  DBG("initTime: %s\n", backend->name);
+  ptpClock->timeBackend = backend;
+  ptpClock->delayedTiming = backend->delayedTiming;
+
+  captureSuspend();
+  ok = !backend->init || backend->init(ptpClock);
+  captureResume();
+  if(ok)
+    captureBackend(ptpClock);
+  return ok;
 }
 
-static void getTimeStamps(PtpClock *ptpClock)
+void shutdownTime(PtpClock *ptpClock)
 {
-  struct E1000_TSYNC_READTS_ARGU ts;
-
-  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
-  memset(&ts, 0, sizeof(ts));
-  ts.withSystemTime = (ptpClock->runTimeOpts.time == TIME_SYSTEM_ASSISTED);
-  if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_READTS_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-    ERROR("could not read E1000 hardware time stamps on %s: %s\n",
-          ptpClock->netPath.eventSockIFR.ifr_name,
-          strerror(errno));
-    return;
-  }
+  RecvTimeStore *store = &ptpClock->recvTimes;
 
-  DBGV("rx %s, tx %s\n",
-       ts.rx_valid ? "valid" : "invalid",
-       ts.tx_valid ? "valid" : "invalid");
+  if(ptpClock->timeBackend && ptpClock->timeBackend->shutdown)
+    ptpClock->timeBackend->shutdown(ptpClock);
 
-  if(ts.rx_valid)
-  {
-    int newIndex;
+  if(store->entries)
+    INFO("receive time stamps: %u evicted, %u missing, %u stale\n",
+      store->evictions, store->misses, store->staleHits);
 
-    if(nextFreeRecv == RECV_ARRAY_SIZE)
-    {
-      newIndex = 0;
-      nextFreeRecv = 1;
-      oldestRecv = 2;
-    }
-    else
-    {
-      newIndex = nextFreeRecv;
-      nextFreeRecv++;
-      if(oldestRecv && nextFreeRecv == oldestRecv)
-        ++oldestRecv;
-    }
+  free(store->entries);
+  memset(store, 0, sizeof(*store));
+}
 
-    if(oldestRecv >= RECV_ARRAY_SIZE)
-      oldestRecv = 0;
-
-    DBGV("new entry %d, oldest %d, next free %d\n", newIndex, oldestRecv, nextFreeRecv);
-
-    lastRecvTimes[newIndex].recvTimeStamp.seconds = ts.withSystemTime ? ts.rx_sys.seconds : ts.rx.seconds;
-    lastRecvTimes[newIndex].recvTimeStamp.nanoseconds = ts.withSystemTime ? ts.rx_sys.nanoseconds : ts.rx.nanoseconds;
-    lastRecvTimes[newIndex].sequenceId = ts.sourceSequenceId;
-    memcpy(lastRecvTimes[newIndex].sourceUuid, ts.sourceIdentity, sizeof(ts.sourceIdentity));
-
-    DBGV("rx %d: time %lu.%09u (%lu.%09u), sequence %u, uuid %02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx\n",
-         newIndex,
-         lastRecvTimes[newIndex].recvTimeStamp.seconds,
-         lastRecvTimes[newIndex].recvTimeStamp.nanoseconds,
-         ts.withSystemTime ? ts.rx.seconds : 0,
-         ts.withSystemTime ? ts.rx.nanoseconds : 0,
-         lastRecvTimes[newIndex].sequenceId,
-         ts.sourceIdentity[0],
-         ts.sourceIdentity[1],
-         ts.sourceIdentity[2],
-         ts.sourceIdentity[3],
-         ts.sourceIdentity[4],
-         ts.sourceIdentity[5]);
-  }
+/* adjTimeOffset() for clocks which can only be set */
+void timeStepOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  TimeInternal timeTmp;
 
-  if(ts.tx_valid)
-  {
-    lastSendTime.seconds = ts.withSystemTime ? ts.tx_sys.seconds : ts.tx.seconds;
-    lastSendTime.nanoseconds = ts.withSystemTime ? ts.tx_sys.nanoseconds : ts.tx.nanoseconds;
-
-    DBGV("tx time %lu.%09u (%lu.%09u)\n",
-         lastSendTime.seconds,
-         lastSendTime.nanoseconds,
-         ts.withSystemTime ? ts.tx.seconds : 0,
-         ts.withSystemTime ? ts.tx.nanoseconds : 0);
-  }
+  getTime(&timeTmp, ptpClock);
+  timeTmp -= *offset;
+  setTime(&timeTmp, ptpClock);
 }
 
-Boolean getSendTime(TimeInternal *sendTimeStamp,
-                    PtpClock *ptpClock)
+/*
+ * The backends are called with capture suspended: only what the
+ * protocol gets to see is recorded, see capture.c.
+ */
+void getTime(TimeInternal *time, PtpClock *ptpClock)
 {
-  /* check for new time stamps */
-  getTimeStamps(ptpClock);
+  captureSuspend();
+  ptpClock->timeBackend->getTime(time, ptpClock);
+  captureResume();
+  captureTime(CAPTURE_TIME, time);
+}
 
-  if(lastSendTime.seconds || lastSendTime.nanoseconds)
-  {
-    *sendTimeStamp = lastSendTime;
-    lastSendTime.seconds = 0;
-    lastSendTime.nanoseconds = 0;
-    return TRUE;
-  }
-  else
-    return FALSE;
+void setTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  captureAdjust(CAPTURE_SET_TIME, *time);
+  captureSuspend();
+  ptpClock->timeBackend->setTime(time, ptpClock);
+  captureResume();
 }
 
-/**
- * helper function for getReceiveTime() which searches for time stamp
- * in lastRecvTimes[leftIndex, rightIndex[
- */
-static Boolean getReceiveTimeFromArray(TimeInternal *recvTimeStamp,
-                                       Octet sourceUuid[PTP_UUID_LENGTH],
-                                       UInteger16 sequenceId,
-                                       int leftIndex, int rightIndex)
+void adjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
 {
-  int i;
+  captureAdjust(CAPTURE_ADJ, adj);
+  captureSuspend();
+  LATENCY_MARK(LATENCY_ADJ);
+  ptpClock->timeBackend->adjTime(adj, offset, ptpClock);
+  LATENCY_MARK(LATENCY_DONE);
+  captureResume();
+}
 
-  for(i = leftIndex; i < rightIndex; i++)
-  {
-    if(!memcmp(lastRecvTimes[i].sourceUuid, sourceUuid, sizeof(lastRecvTimes[i].sourceUuid)) &&
-       lastRecvTimes[i].sequenceId == sequenceId)
-    {
-      DBGV("found rx index %d: time %lu.%09u, sequence %u, uuid %02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx\n",
-           i,
-           lastRecvTimes[i].recvTimeStamp.seconds,
-           lastRecvTimes[i].recvTimeStamp.nanoseconds,
-           lastRecvTimes[i].sequenceId,
-           lastRecvTimes[i].sourceUuid[0],
-           lastRecvTimes[i].sourceUuid[1],
-           lastRecvTimes[i].sourceUuid[2],
-           lastRecvTimes[i].sourceUuid[3],
-           lastRecvTimes[i].sourceUuid[4],
-           lastRecvTimes[i].sourceUuid[5]);
-      *recvTimeStamp = lastRecvTimes[i].recvTimeStamp;
-      // invalidate entry to prevent accidental reuse (happened when slaves were
-      // restarted quickly while the master still had their old sequence IDs in the array)
-      memset(&lastRecvTimes[i], 0, sizeof(lastRecvTimes[i]));
-      return TRUE;
-    }
-  }
-  return FALSE;
+void adjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  captureAdjust(CAPTURE_STEP, *offset);
+  captureSuspend();
+  LATENCY_MARK(LATENCY_ADJ);
+  ptpClock->timeBackend->adjTimeOffset(offset, ptpClock);
+  LATENCY_MARK(LATENCY_DONE);
+  captureResume();
+}
+
+Boolean getSendTime(TimeInternal *sendTimeStamp,
+                    PtpClock *ptpClock)
+{
+  Boolean ok;
+
+  captureSuspend();
+  ok = ptpClock->timeBackend->getSendTime &&
+    ptpClock->timeBackend->getSendTime(sendTimeStamp, ptpClock);
+  captureResume();
+  return captureStamp(CAPTURE_SEND_TIME, ok, sendTimeStamp);
 }
 
 Boolean getReceiveTime(TimeInternal *recvTimeStamp,
@@ -689,83 +251,33 @@ Boolean getReceiveTime(TimeInternal *recvTimeStamp,
                        UInteger16 sequenceId,
                        PtpClock *ptpClock)
 {
-  /* check for new time stamps */
-  getTimeStamps(ptpClock);
+  Boolean ok;
 
-  if(oldestRecv <= nextFreeRecv)
-    return getReceiveTimeFromArray(recvTimeStamp, sourceUuid, sequenceId, oldestRecv, nextFreeRecv);
-  else
-  {
-    if(getReceiveTimeFromArray(recvTimeStamp, sourceUuid, sequenceId, oldestRecv, RECV_ARRAY_SIZE))
-      return TRUE;
-    else
-      return getReceiveTimeFromArray(recvTimeStamp, sourceUuid, sequenceId, 0, nextFreeRecv);
-  }
+  captureSuspend();
+  ok = ptpClock->timeBackend->getReceiveTime &&
+    ptpClock->timeBackend->getReceiveTime(recvTimeStamp, sourceUuid, sequenceId, ptpClock);
+  captureResume();
+  return captureStamp(CAPTURE_RECV_TIME, ok, recvTimeStamp);
 }
 
+/* these two may be called before initTime() succeeded */
 void timeNoActivity(PtpClock *ptpClock)
 {
-#ifdef PTPD_DBGV
-  switch(ptpClock->runTimeOpts.time) {
-  case TIME_NIC:
-  case TIME_BOTH:
-  case TIME_SYSTEM_ASSISTED:
+  if(ptpClock->timeBackend && ptpClock->timeBackend->noActivity)
   {
-    TimeInternal now, ts, offset;
-    struct E1000_TSYNC_COMPARETS_ARGU argu;
-    int sign;
-
-    getTime(&ts, ptpClock);
-    timerNow(&now);
-    subTime(&offset, &now, &ts);
-    sign = (offset.seconds < 0 || offset.nanoseconds < 0) ? -1 : 1;
-    DBGV("system time %d.%09d, NIC time %d.%09d => system time - NIC time = %s%d.%09d\n",
-         now.seconds, now.nanoseconds,
-         ts.seconds, ts.nanoseconds,
-         sign < 0 ? "-" : "",
-         sign * offset.seconds, sign * offset.nanoseconds);
-
-    ptpClock->netPath.eventSockIFR.ifr_data = (void *)&argu;
-    memset(&ts, 0, sizeof(ts));
-    if (ioctl(ptpClock->netPath.eventSock, E1000_TSYNC_COMPARETS_IOCTL, &ptpClock->netPath.eventSockIFR) < 0) {
-      ERROR("could not correlate E1000 hardware and system time on %s: %s\n",
-            ptpClock->netPath.eventSockIFR.ifr_name,
-            strerror(errno));
-      return;
-    }
-
-    now.seconds = argu.systemToNICSign * argu.systemToNIC.seconds;
-    now.nanoseconds = argu.systemToNICSign * argu.systemToNIC.nanoseconds;
-    ts.seconds = argu.NICToSystemSign * argu.NICToSystem.seconds;
-    ts.nanoseconds = argu.NICToSystemSign * argu.NICToSystem.nanoseconds;
-    subTime(&offset, &now, &ts);
-    offset.seconds /= 2;
-    offset.nanoseconds /= 2;
-    DBGV("delay system to NIC %s%ld.%09d/NIC to system %s%ld.%09d => system - NIC time = %d.%09d\n",
-         argu.systemToNICSign > 0 ? "" : argu.systemToNICSign < 0 ? "-" : "?",
-         argu.systemToNIC.seconds, argu.systemToNIC.nanoseconds,
-         argu.NICToSystemSign > 0 ? "" : argu.NICToSystemSign < 0 ? "-" : "?",
-         argu.NICToSystem.seconds, argu.NICToSystem.nanoseconds,
-         offset.seconds, offset.nanoseconds);
-    break;
-  }
+    captureSuspend();
+    ptpClock->timeBackend->noActivity(ptpClock);
+    captureResume();
   }
-#endif
-  syncSystemWithNIC(ptpClock);
 }
 
 void timeToState(UInteger8 state, PtpClock *ptpClock)
 {
-  if(ptpClock->runTimeOpts.time > TIME_SYSTEM &&
+  if(ptpClock->timeBackend && ptpClock->timeBackend->toState &&
      state != ptpClock->port_state)
   {
-    if(state == PTP_MASTER)
-      /* only master listens for Delay_Req... */
-      selectNICTimeMode(FALSE, ptpClock);
-    else if(ptpClock->port_state == PTP_MASTER)
-      /** ... and only while he still is master */
-      selectNICTimeMode(TRUE, ptpClock);
-
-    timeBothClock.port_state = state;
+    captureSuspend();
+    ptpClock->timeBackend->toState(state, ptpClock);
+    captureResume();
   }
 }
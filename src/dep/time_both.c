@@ -0,0 +1,176 @@
+/* time_both.c */
+
+#include "../ptpd.h"
+
+/*
+ * TIME_BOTH: PTP controls the clock of the NIC, either the E1000 clock
+ * of TIME_NIC or a PTP hardware clock (TIME_PHC, if -P is given).
+ * System time follows NIC time: a second clock servo (timeBothClock)
+ * is fed with cross time stamps of NIC and system time, taken at
+ * runTimeOpts.crossRate per second when CROSS_TIMESTAMP_TIMER expires.
+ */
+
+/** global state for controlling system time when TIME_BOTH is selected */
+static PtpClock timeBothClock;
+
+/** the backend of the NIC clock */
+static const TimeBackend *bothNIC;
+
+/**
+ * measure NIC<->system time offsets and adapt system time
+ *
+ * This function is called whenever the protocol gets control; the
+ * rate of the measurements is limited by CROSS_TIMESTAMP_TIMER.
+ */
+static void syncSystemWithNIC(PtpClock *ptpClock)
+{
+  TimeInternal systemToNIC, NICToSystem;
+  static TimeInternal zero;
+
+  if(!timerExpired(CROSS_TIMESTAMP_TIMER, ptpClock->itimer))
+    return;
+
+  if(!bothNIC->crossTimestamp ||
+     !bothNIC->crossTimestamp(&systemToNIC, &NICToSystem, ptpClock))
+    return;
+
+  /* both measurements are taken now */
+  timerNow(&timeBothClock.sync_receive_time);
+  timeBothClock.delay_req_send_time = timeBothClock.sync_receive_time;
+
+  DBGV("system to NIC delay %lldns\n", systemToNIC);
+  updateDelay(&systemToNIC, &zero, &timeBothClock.owd_filt, &timeBothClock);
+
+  DBGV("NIC to system delay %lldns\n", NICToSystem);
+  updateOffset(&NICToSystem, &zero, &timeBothClock.ofm_filt, &timeBothClock);
+
+  /* the master disciplines NIC time against system time, see nic_instead_of_system */
+  if(ptpClock->port_state == PTP_MASTER)
+  {
+    timeBothClock.nic_instead_of_system = TRUE;
+    timeBothClock.timeBackend = bothNIC;
+  }
+  else
+  {
+    timeBothClock.nic_instead_of_system = FALSE;
+    timeBothClock.timeBackend = &timeSystemBackend;
+  }
+  updateClock(&timeBothClock);
+  DBGV("system time updated\n");
+}
+
+static Boolean bothInit(PtpClock *ptpClock)
+{
+  bothNIC = ptpClock->runTimeOpts.phcDevice[0] ? &timePHCBackend : &timeNICBackend;
+  DBG("TIME_BOTH with %s clock\n", bothNIC->name);
+
+  /* prepare clock servo for controlling system time */
+  timeBothClock = *ptpClock;
+  timeBothClock.timeBackend = &timeSystemBackend;
+  timeBothClock.name = "sys ";
+  /* only the PTP servo is recorded */
+  timeBothClock.runTimeOpts.servoLog = NULL;
+  initClock(&timeBothClock);
+
+  /* default options for NIC synchronization, the given ones control system time */
+  if(ptpClock->runTimeOpts.noResetClock != DEFAULT_NO_RESET_CLOCK ||
+     ptpClock->runTimeOpts.stepThreshold != DEFAULT_STEP_THRESHOLD ||
+     ptpClock->runTimeOpts.stepFirstOnly ||
+     ptpClock->runTimeOpts.maxSlew != DEFAULT_MAX_SLEW ||
+     ptpClock->runTimeOpts.noAdjust != DEFAULT_NO_ADJUST_CLOCK ||
+     ptpClock->runTimeOpts.s != DEFAULT_DELAY_S ||
+     ptpClock->runTimeOpts.ap != DEFAULT_AP ||
+     ptpClock->runTimeOpts.ai != DEFAULT_AI)
+    NOTIFY("-x, -X, -T, -L, -t, -a and -w only apply to system time, "
+           "%s time uses the defaults; -S applies to both\n", bothNIC->name);
+  ptpClock->runTimeOpts.noResetClock = DEFAULT_NO_RESET_CLOCK;
+  ptpClock->runTimeOpts.stepThreshold = DEFAULT_STEP_THRESHOLD;
+  ptpClock->runTimeOpts.stepFirstOnly = FALSE;
+  ptpClock->runTimeOpts.maxSlew = DEFAULT_MAX_SLEW;
+  ptpClock->runTimeOpts.noAdjust = DEFAULT_NO_ADJUST_CLOCK;
+  ptpClock->runTimeOpts.s = DEFAULT_DELAY_S;
+  ptpClock->runTimeOpts.ap = DEFAULT_AP;
+  ptpClock->runTimeOpts.ai = DEFAULT_AI;
+
+  ptpClock->delayedTiming = bothNIC->delayedTiming;
+  if(!bothNIC->init(ptpClock))
+    return FALSE;
+
+  /* the servo for system time steers the NIC clock opened just now */
+  timeBothClock.phc = ptpClock->phc;
+
+  timerStart(CROSS_TIMESTAMP_TIMER, 1000000000LL / ptpClock->runTimeOpts.crossRate, ptpClock->itimer);
+  return TRUE;
+}
+
+static void bothShutdown(PtpClock *ptpClock)
+{
+  if(bothNIC && bothNIC->shutdown)
+    bothNIC->shutdown(ptpClock);
+}
+
+static void bothGetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  bothNIC->getTime(time, ptpClock);
+  syncSystemWithNIC(ptpClock);
+}
+
+static void bothSetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  bothNIC->setTime(time, ptpClock);
+  syncSystemWithNIC(ptpClock);
+}
+
+static void bothAdjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+{
+  bothNIC->adjTime(adj, offset, ptpClock);
+  syncSystemWithNIC(ptpClock);
+}
+
+static void bothAdjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  bothNIC->adjTimeOffset(offset, ptpClock);
+  syncSystemWithNIC(ptpClock);
+}
+
+static Boolean bothGetSendTime(TimeInternal *sendTimeStamp, PtpClock *ptpClock)
+{
+  return bothNIC->getSendTime && bothNIC->getSendTime(sendTimeStamp, ptpClock);
+}
+
+static Boolean bothGetReceiveTime(TimeInternal *recvTimeStamp,
+                                  Octet sourceUuid[PTP_UUID_LENGTH],
+                                  UInteger16 sequenceId,
+                                  PtpClock *ptpClock)
+{
+  return bothNIC->getReceiveTime &&
+    bothNIC->getReceiveTime(recvTimeStamp, sourceUuid, sequenceId, ptpClock);
+}
+
+static void bothNoActivity(PtpClock *ptpClock)
+{
+  if(bothNIC->noActivity)
+    bothNIC->noActivity(ptpClock);
+  syncSystemWithNIC(ptpClock);
+}
+
+static void bothToState(UInteger8 state, PtpClock *ptpClock)
+{
+  if(bothNIC->toState)
+    bothNIC->toState(state, ptpClock);
+  timeBothClock.port_state = state;
+}
+
+const TimeBackend timeBothBackend = {
+  .name = "both",
+  .init = bothInit,
+  .getTime = bothGetTime,
+  .setTime = bothSetTime,
+  .adjTime = bothAdjTime,
+  .adjTimeOffset = bothAdjTimeOffset,
+  .getSendTime = bothGetSendTime,
+  .getReceiveTime = bothGetReceiveTime,
+  .noActivity = bothNoActivity,
+  .toState = bothToState,
+  .shutdown = bothShutdown,
+};
@@ -0,0 +1,347 @@
+/* time_e1000.c */
+
+#include "../ptpd.h"
+
+#include "e1000_ioctl.h"
+
+/*
+ * Time sources which rely on the time stamping of an Intel NIC,
+ * accessed via the private ioctl() interface of the igb driver:
+ * - TIME_NIC: NIC time is read and adjusted, also the NIC clock
+ *   of TIME_BOTH (see time_both.c)
+ * - TIME_SYSTEM_ASSISTED: system time is adjusted, the NIC provides
+ *   packet time stamps in system time
+ * With -E the driver is emulated in software, see e1000_sim.c.
+ */
+
+/**
+ * Most recent send time stamp from NIC, 0/0 if none available right now.
+ * Reset by getSendTime().
+ */
+static TimeInternal lastSendTime;
+
+/* ioctl() on the event socket, or its emulation */
+static int e1000Ioctl(unsigned long request, PtpClock *ptpClock)
+{
+  if(ptpClock->runTimeOpts.e1000Sim)
+    return e1000SimIoctl(request, &ptpClock->netPath.eventSockIFR, ptpClock);
+  return ioctl(ptpClock->netPath.eventSock, request, &ptpClock->netPath.eventSockIFR);
+}
+
+static Boolean e1000SelectMode(Boolean sync, PtpClock *ptpClock)
+{
+  int mode = sync ? E1000_UDP_V1_SYNC : E1000_UDP_V1_DELAY;
+
+  DBGV("time stamp incoming %s packets\n", sync ? "Sync" : "Delay_Req");
+
+  /* the driver expects the mode in place of the ifr_data pointer */
+  memcpy(&ptpClock->netPath.eventSockIFR.ifr_data, &mode, sizeof(mode));
+  if(e1000Ioctl(E1000_TSYNC_ENABLERX_IOCTL, ptpClock) < 0) {
+    ERROR("could not activate E1000 hardware receive time stamping on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static Boolean e1000Init(PtpClock *ptpClock)
+{
+  if(!ptpClock->recvTimes.entries && !initRecvTimes(ptpClock))
+    return FALSE;
+
+  /** @todo also check success indicator in ifr_data */
+  if (e1000Ioctl(E1000_TSYNC_INIT_IOCTL, ptpClock) < 0) {
+    ERROR("could not activate E1000 hardware time stamping on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+  }
+  else if(e1000Ioctl(E1000_TSYNC_ENABLETX_IOCTL, ptpClock) < 0) {
+    ERROR("could not activate E1000 hardware send time stamping on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+  }
+  else if(!e1000SelectMode(TRUE, ptpClock)) {
+    // error already printed
+  }
+  else {
+#if 0
+    // move the NIC time for debugging purposes
+    TimeInternal timeTmp;
+
+    DBGV("shift NIC time\n");
+    getTime(&timeTmp, ptpClock);
+    timeTmp -= 2000000000LL;
+    setTime(&timeTmp, ptpClock);
+    DBGV("shift NIC time done\n");
+#endif
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+#define E1000_NSEC(ts) ((Integer64)(ts).seconds*1000000000LL + (ts).nanoseconds)
+
+static void nicGetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  struct E1000_TSYNC_SYSTIME_ARGU ts;
+
+  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
+  memset(&ts, 0, sizeof(ts));
+  if (e1000Ioctl(E1000_TSYNC_SYSTIME_IOCTL, ptpClock) < 0) {
+    ERROR("could not read E1000 hardware time on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+    return;
+  }
+  *time = E1000_NSEC(ts.time);
+}
+
+/* returns FALSE if the NIC time could not be modified */
+static Boolean nicSetTimeOffset(TimeInternal *offset, Boolean negate, PtpClock *ptpClock)
+{
+  struct E1000_TSYNC_SYSTIME_ARGU ts;
+
+  memset(&ts, 0, sizeof(ts));
+  // always store positive seconds/nanoseconds
+  ts.negative_offset = *offset < 0 ? -1 : 1;
+  ts.time.seconds = llabs(*offset) / 1000000000;
+  ts.time.nanoseconds = llabs(*offset) % 1000000000;
+  if(negate)
+    ts.negative_offset *= -1;
+
+  DBGV("adjust NIC time by offset %s%llu.%09u\n",
+       ts.negative_offset < 0 ? "-" : "",
+       ts.time.seconds, ts.time.nanoseconds);
+  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
+  if (e1000Ioctl(E1000_TSYNC_SYSTIME_IOCTL, ptpClock) < 0) {
+    ERROR("could not modify E1000 hardware time on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void nicSetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  TimeInternal currentTime, offset;
+
+  NOTIFY("resetting NIC clock to %lldns\n", *time);
+  nicGetTime(&currentTime, ptpClock);
+  offset = *time - currentTime;
+  nicSetTimeOffset(&offset, FALSE, ptpClock);
+}
+
+static void nicAdjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+{
+  // adjust NIC frequency
+  struct E1000_TSYNC_ADJTIME_ARGU ts;
+
+  if(!offset)
+    return;
+
+  memset(&ts, 0, sizeof(ts));
+  ts.adj = (long long)adj;
+  if(ptpClock->nic_instead_of_system)
+    ts.adj = -ts.adj;
+  ts.set_adj = TRUE;
+  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
+  DBGV("adjust NIC frequency by %d ppb\n", ts.adj);
+  ptpClock->adj = ts.adj;
+  if (e1000Ioctl(E1000_TSYNC_ADJTIME_IOCTL, ptpClock) < 0) {
+    ERROR("could not modify E1000 hardware frequency on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+  }
+}
+
+static void nicAdjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  // invert the sign: if offset is positive, we need to substract it and vice versa;
+  // when in nic_instead_of_system the logic is already inverted
+  nicSetTimeOffset(offset, !ptpClock->nic_instead_of_system, ptpClock);
+}
+
+static void getTimeStamps(PtpClock *ptpClock)
+{
+  struct E1000_TSYNC_READTS_ARGU ts;
+
+  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
+  memset(&ts, 0, sizeof(ts));
+  ts.withSystemTime = (ptpClock->timeBackend == &timeAssistedBackend);
+  if (e1000Ioctl(E1000_TSYNC_READTS_IOCTL, ptpClock) < 0) {
+    ERROR("could not read E1000 hardware time stamps on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+    return;
+  }
+
+  DBGV("rx %s, tx %s\n",
+       ts.rx_valid ? "valid" : "invalid",
+       ts.tx_valid ? "valid" : "invalid");
+
+  if(ts.rx_valid)
+  {
+    TimeInternal recvTimeStamp;
+
+    recvTimeStamp = E1000_NSEC(ts.withSystemTime ? ts.rx_sys : ts.rx);
+    addRecvTime(&recvTimeStamp, (Octet *)ts.sourceIdentity, ts.sourceSequenceId, ptpClock);
+
+    DBGV("rx time %lldns (%lldns), sequence %u, uuid %02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx\n",
+         recvTimeStamp,
+         ts.withSystemTime ? E1000_NSEC(ts.rx) : 0,
+         ts.sourceSequenceId,
+         ts.sourceIdentity[0],
+         ts.sourceIdentity[1],
+         ts.sourceIdentity[2],
+         ts.sourceIdentity[3],
+         ts.sourceIdentity[4],
+         ts.sourceIdentity[5]);
+  }
+
+  if(ts.tx_valid)
+  {
+    lastSendTime = E1000_NSEC(ts.withSystemTime ? ts.tx_sys : ts.tx);
+
+    DBGV("tx time %lldns (%lldns)\n",
+         lastSendTime,
+         ts.withSystemTime ? E1000_NSEC(ts.tx) : 0);
+  }
+}
+
+static Boolean e1000GetSendTime(TimeInternal *sendTimeStamp,
+                                PtpClock *ptpClock)
+{
+  /* check for new time stamps */
+  getTimeStamps(ptpClock);
+
+  if(lastSendTime)
+  {
+    *sendTimeStamp = lastSendTime;
+    lastSendTime = 0;
+    return TRUE;
+  }
+  else
+    return FALSE;
+}
+
+static Boolean e1000GetReceiveTime(TimeInternal *recvTimeStamp,
+                                   Octet sourceUuid[PTP_UUID_LENGTH],
+                                   UInteger16 sequenceId,
+                                   PtpClock *ptpClock)
+{
+  /* check for new time stamps */
+  getTimeStamps(ptpClock);
+
+  return findRecvTime(recvTimeStamp, sourceUuid, sequenceId, ptpClock);
+}
+
+/*
+ * Correlate NIC and system time: the driver measures the delays in
+ * both directions, keep the sample with the smallest round trip.
+ */
+static Boolean e1000CrossTimestamp(TimeInternal *systemToNIC, TimeInternal *NICToSystem, PtpClock *ptpClock)
+{
+  struct E1000_TSYNC_COMPARETS_ARGU ts;
+  TimeInternal toNIC, toSystem, best = 0;
+  int i;
+
+  for(i = 0; i < ptpClock->runTimeOpts.crossSamples; i++)
+  {
+    ptpClock->netPath.eventSockIFR.ifr_data = (void *)&ts;
+    memset(&ts, 0, sizeof(ts));
+    if (e1000Ioctl(E1000_TSYNC_COMPARETS_IOCTL, ptpClock) < 0) {
+      ERROR("could not correlate E1000 hardware and system time on %s: %s\n",
+            ptpClock->netPath.eventSockIFR.ifr_name,
+            strerror(errno));
+      return FALSE;
+    }
+
+    toNIC = E1000_NSEC(ts.systemToNIC) * ts.systemToNICSign;
+    toSystem = E1000_NSEC(ts.NICToSystem) * ts.NICToSystemSign;
+
+    if(!i || toNIC + toSystem < best)
+    {
+      best = toNIC + toSystem;
+      *systemToNIC = toNIC;
+      *NICToSystem = toSystem;
+    }
+  }
+
+  return i > 0;
+}
+
+static void e1000NoActivity(PtpClock *ptpClock)
+{
+#ifdef PTPD_DBGV
+  TimeInternal now, ts, offset;
+  struct E1000_TSYNC_COMPARETS_ARGU argu;
+
+  getTime(&ts, ptpClock);
+  timerNow(&now);
+  DBGV("system time %lldns, NIC time %lldns => system time - NIC time = %lldns\n",
+       now, ts, now - ts);
+
+  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&argu;
+  memset(&argu, 0, sizeof(argu));
+  if (e1000Ioctl(E1000_TSYNC_COMPARETS_IOCTL, ptpClock) < 0) {
+    ERROR("could not correlate E1000 hardware and system time on %s: %s\n",
+          ptpClock->netPath.eventSockIFR.ifr_name,
+          strerror(errno));
+    return;
+  }
+
+  now = argu.systemToNICSign * E1000_NSEC(argu.systemToNIC);
+  ts = argu.NICToSystemSign * E1000_NSEC(argu.NICToSystem);
+  offset = (now - ts)/2;
+  DBGV("delay system to NIC %s%lldns/NIC to system %s%lldns => system - NIC time = %lldns\n",
+       argu.systemToNICSign > 0 ? "" : argu.systemToNICSign < 0 ? "-" : "?",
+       E1000_NSEC(argu.systemToNIC),
+       argu.NICToSystemSign > 0 ? "" : argu.NICToSystemSign < 0 ? "-" : "?",
+       E1000_NSEC(argu.NICToSystem),
+       offset);
+#endif
+}
+
+static void e1000ToState(UInteger8 state, PtpClock *ptpClock)
+{
+  if(state == PTP_MASTER)
+    /* only master listens for Delay_Req... */
+    e1000SelectMode(FALSE, ptpClock);
+  else if(ptpClock->port_state == PTP_MASTER)
+    /** ... and only while he still is master */
+    e1000SelectMode(TRUE, ptpClock);
+}
+
+const TimeBackend timeNICBackend = {
+  .name = "nic",
+  .delayedTiming = TRUE,
+  .init = e1000Init,
+  .getTime = nicGetTime,
+  .setTime = nicSetTime,
+  .adjTime = nicAdjTime,
+  .adjTimeOffset = nicAdjTimeOffset,
+  .getSendTime = e1000GetSendTime,
+  .getReceiveTime = e1000GetReceiveTime,
+  .noActivity = e1000NoActivity,
+  .toState = e1000ToState,
+  .crossTimestamp = e1000CrossTimestamp,
+};
+
+const TimeBackend timeAssistedBackend = {
+  .name = "assisted",
+  .delayedTiming = TRUE,
+  .init = e1000Init,
+  .getTime = systemGetTime,
+  .setTime = systemSetTime,
+  .adjTime = systemAdjTime,
+  .adjTimeOffset = systemAdjTimeOffset,
+  .getSendTime = e1000GetSendTime,
+  .getReceiveTime = e1000GetReceiveTime,
+  .noActivity = e1000NoActivity,
+  .toState = e1000ToState,
+};
@@ -0,0 +1,118 @@
+/* time_linux.c */
+
+#include "../ptpd.h"
+
+/*
+ * TIME_SYSTEM_LINUX_HW/SW: system time is adjusted like with
+ * TIME_SYSTEM, packets are time stamped via the Linux net_tstamp API
+ * either by the NIC or by the kernel. Send time stamps are bounced
+ * back through the error queue of the event socket, see net.c.
+ */
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+
+/*
+ * Time stamp incoming Sync (sync = TRUE) or Delay_Req messages and
+ * all outgoing event messages in the NIC, then request these time
+ * stamps with SO_TIMESTAMPING 'flags'.
+ */
+Boolean linuxSelectHWTimeStamping(Boolean sync, int flags, PtpClock *ptpClock)
+{
+  struct hwtstamp_config hwconfig;
+
+  DBGV("time stamp incoming %s packets\n", sync ? "Sync" : "Delay_Req");
+
+  ptpClock->netPath.eventSockIFR.ifr_data = (void *)&hwconfig;
+  memset(&hwconfig, 0, sizeof(hwconfig));
+
+  /*
+   * Configure for time stamping of incoming Sync or Delay_Req
+   * messages and for time stamping of all out-going event
+   * messages. Out-going messages will be bounced via the error
+   * queue of the event socket.
+   */
+  hwconfig.tx_type = HWTSTAMP_TX_ON;
+  hwconfig.rx_filter = sync ?
+      HWTSTAMP_FILTER_PTP_V1_L4_SYNC :
+      HWTSTAMP_FILTER_PTP_V1_L4_DELAY_REQ;
+
+  if (ioctl(ptpClock->netPath.eventSock, SIOCSHWTSTAMP, &ptpClock->netPath.eventSockIFR) < 0) {
+      if (errno == ERANGE) {
+          /* hardware time stamping not supported */
+          PERROR("net_tstamp SIOCSHWTSTAMP: mode of operation not supported");
+          return FALSE;
+      } else {
+          PERROR("net_tstamp SIOCSHWTSTAMP: %s", strerror(errno));
+          return FALSE;
+      }
+  }
+
+  return netEnableTimeStamping(flags, ptpClock);
+}
+
+static Boolean linuxHWSelectMode(Boolean sync, PtpClock *ptpClock)
+{
+  /* use the NIC time stamps transformed into system time */
+  return linuxSelectHWTimeStamping(sync,
+    SOF_TIMESTAMPING_TX_HARDWARE|SOF_TIMESTAMPING_RX_HARDWARE|SOF_TIMESTAMPING_SYS_HARDWARE,
+    ptpClock);
+}
+
+static Boolean linuxHWInit(PtpClock *ptpClock)
+{
+  return linuxHWSelectMode(TRUE, ptpClock);
+}
+
+static void linuxHWToState(UInteger8 state, PtpClock *ptpClock)
+{
+  if(state == PTP_MASTER)
+    /* only master listens for Delay_Req... */
+    linuxHWSelectMode(FALSE, ptpClock);
+  else if(ptpClock->port_state == PTP_MASTER)
+    /** ... and only while he still is master */
+    linuxHWSelectMode(TRUE, ptpClock);
+}
+
+static Boolean linuxSWInit(PtpClock *ptpClock)
+{
+  /* same as before, but without requiring support by the NIC */
+  int so_timestamping_flags =
+      SOF_TIMESTAMPING_TX_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|SOF_TIMESTAMPING_SOFTWARE;
+
+  return netEnableTimeStamping(so_timestamping_flags, ptpClock);
+}
+
+#else /* HAVE_LINUX_NET_TSTAMP_H */
+
+static Boolean linuxUnsupported(PtpClock *ptpClock)
+{
+  PERROR("net_tstamp interface not supported");
+  return FALSE;
+}
+
+#define linuxHWInit linuxUnsupported
+#define linuxSWInit linuxUnsupported
+#define linuxHWToState NULL
+
+#endif /* HAVE_LINUX_NET_TSTAMP_H */
+
+const TimeBackend timeLinuxHWBackend = {
+  .name = "linux_hw",
+  .delayedTiming = FALSE,
+  .init = linuxHWInit,
+  .getTime = systemGetTime,
+  .setTime = systemSetTime,
+  .adjTime = systemAdjTime,
+  .adjTimeOffset = systemAdjTimeOffset,
+  .toState = linuxHWToState,
+};
+
+const TimeBackend timeLinuxSWBackend = {
+  .name = "linux_sw",
+  .delayedTiming = FALSE,
+  .init = linuxSWInit,
+  .getTime = systemGetTime,
+  .setTime = systemSetTime,
+  .adjTime = systemAdjTime,
+  .adjTimeOffset = systemAdjTimeOffset,
+};
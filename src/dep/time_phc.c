@@ -0,0 +1,327 @@
+/* time_phc.c */
+
+#include "../ptpd.h"
+
+/*
+ * TIME_PHC: a PTP hardware clock (/dev/ptpN) is read and steered
+ * through the dynamic POSIX clock API, so any NIC with a PHC driver
+ * works without the patched igb driver. Packets are time stamped by
+ * the NIC in PHC time (SOF_TIMESTAMPING_RAW_HARDWARE).
+ *
+ * With "-P realtime" CLOCK_REALTIME takes the place of the PHC and
+ * the kernel time stamps packets in software: same code paths, no
+ * hardware needed.
+ */
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+
+#include <sys/timex.h>
+#include <sys/syscall.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/ptp_clock.h>
+
+#define PHC_CLOCKID(fd) ((~(clockid_t)(fd) << 3) | 3)
+#define PHC_REALTIME(ptpClock) ((ptpClock)->phc.fd < 0)
+
+#define PHC_HW_FLAGS (SOF_TIMESTAMPING_TX_HARDWARE|SOF_TIMESTAMPING_RX_HARDWARE|SOF_TIMESTAMPING_RAW_HARDWARE)
+#define PHC_SW_FLAGS (SOF_TIMESTAMPING_TX_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|SOF_TIMESTAMPING_SOFTWARE)
+
+/* clock_adjtime() is not declared by older C libraries */
+static int phcAdjtime(clockid_t clock, struct timex *t)
+{
+  return syscall(__NR_clock_adjtime, clock, t);
+}
+
+/* find the PHC which time stamps packets on the PTP interface */
+static Boolean phcFindDevice(char *device, size_t len, PtpClock *ptpClock)
+{
+  struct ethtool_ts_info info;
+  struct ifreq ifr;
+
+  memset(&info, 0, sizeof(info));
+  info.cmd = ETHTOOL_GET_TS_INFO;
+  ifr = ptpClock->netPath.eventSockIFR;
+  ifr.ifr_data = (void *)&info;
+  if(ioctl(ptpClock->netPath.eventSock, SIOCETHTOOL, &ifr) < 0)
+  {
+    PERROR("could not query time stamping capabilities of %s", ifr.ifr_name);
+    return FALSE;
+  }
+
+  if(info.phc_index < 0)
+  {
+    ERROR("%s has no PTP hardware clock, try -P realtime\n", ifr.ifr_name);
+    return FALSE;
+  }
+
+  snprintf(device, len, "/dev/ptp%d", info.phc_index);
+  return TRUE;
+}
+
+static Boolean phcInit(PtpClock *ptpClock)
+{
+  char device[PATH_MAX];
+  struct ptp_clock_caps caps;
+  struct timex t;
+
+  ptpClock->phc.fd = -1;
+  ptpClock->phc.precise = ptpClock->phc.sysOffset = FALSE;
+
+  if(!strcasecmp(ptpClock->runTimeOpts.phcDevice, "realtime"))
+  {
+    ptpClock->phc.clock = CLOCK_REALTIME;
+
+    /* same limit as for the system clock, see systemAdjTime() */
+    memset(&t, 0, sizeof(t));
+    adjtimex(&t);
+    ptpClock->phc.maxAdj = t.tolerance / ((1<<16)/1000);
+
+    INFO("using CLOCK_REALTIME instead of a PHC\n");
+    return netEnableTimeStamping(PHC_SW_FLAGS, ptpClock);
+  }
+
+  if(ptpClock->runTimeOpts.phcDevice[0])
+    strncpy(device, ptpClock->runTimeOpts.phcDevice, sizeof(device));
+  else if(!phcFindDevice(device, sizeof(device), ptpClock))
+    return FALSE;
+  device[sizeof(device) - 1] = 0;
+
+  if((ptpClock->phc.fd = open(device, O_RDWR)) < 0)
+  {
+    PERROR("could not open PTP hardware clock %s", device);
+    return FALSE;
+  }
+  ptpClock->phc.clock = PHC_CLOCKID(ptpClock->phc.fd);
+
+  memset(&caps, 0, sizeof(caps));
+  if(ioctl(ptpClock->phc.fd, PTP_CLOCK_GETCAPS, &caps) < 0)
+  {
+    PERROR("could not get capabilities of %s", device);
+    close(ptpClock->phc.fd);
+    ptpClock->phc.fd = -1;
+    return FALSE;
+  }
+  ptpClock->phc.maxAdj = caps.max_adj;
+  ptpClock->phc.precise = ptpClock->phc.sysOffset = TRUE;
+
+  INFO("using PTP hardware clock %s, max adj %d ppb\n", device, caps.max_adj);
+  return linuxSelectHWTimeStamping(TRUE, PHC_HW_FLAGS, ptpClock);
+}
+
+static void phcShutdown(PtpClock *ptpClock)
+{
+  if(ptpClock->phc.fd >= 0)
+    close(ptpClock->phc.fd);
+  ptpClock->phc.fd = -1;
+}
+
+static void phcGetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  struct timespec ts;
+
+  if(clock_gettime(ptpClock->phc.clock, &ts) < 0)
+  {
+    PERROR("could not read PTP hardware clock");
+    return;
+  }
+  *time = TIMESPEC_NSEC(ts);
+}
+
+static void phcSetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  struct timespec ts;
+
+  NOTIFY("resetting %s clock to %lldns\n",
+    PHC_REALTIME(ptpClock) ? "system" : "PTP hardware", *time);
+  NSEC_TIMESPEC(ts, *time);
+  if(clock_settime(ptpClock->phc.clock, &ts) < 0)
+    PERROR("could not set PTP hardware clock");
+}
+
+static void phcAdjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+{
+  struct timex t;
+
+  if(ptpClock->nic_instead_of_system)
+    adj = -adj;
+  if(adj > ptpClock->phc.maxAdj)
+    adj = ptpClock->phc.maxAdj;
+  else if(adj < -ptpClock->phc.maxAdj)
+    adj = -ptpClock->phc.maxAdj;
+
+  /* ppb => scaled ppm (ppm with 16 bit fraction) */
+  memset(&t, 0, sizeof(t));
+  t.modes = ADJ_FREQUENCY;
+  t.freq = (long)adj * 65536 / 1000;
+
+  DBGV("adjust PHC frequency by %d ppb\n", adj);
+  ptpClock->adj = adj;
+  if(phcAdjtime(ptpClock->phc.clock, &t) < 0)
+    PERROR("clock_adjtime(freq = %ld) failed", t.freq);
+}
+
+static void phcAdjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  struct timex t;
+  TimeInternal step = ptpClock->nic_instead_of_system ? *offset : -*offset;
+
+  /* shift the clock by -offset in one go, without read-modify-write */
+  memset(&t, 0, sizeof(t));
+  t.modes = ADJ_SETOFFSET|ADJ_NANO;
+  t.time.tv_sec = step / 1000000000;
+  t.time.tv_usec = step % 1000000000;
+  if(t.time.tv_usec < 0)
+  {
+    t.time.tv_sec -= 1;
+    t.time.tv_usec += 1000000000;
+  }
+
+  DBGV("adjust PHC time by offset %lldns\n", step);
+  if(phcAdjtime(ptpClock->phc.clock, &t) < 0)
+  {
+    DBG("ADJ_SETOFFSET failed (%s), setting clock\n", strerror(errno));
+    timeStepOffset(offset, ptpClock);
+  }
+}
+
+/*
+ * sys1 < phc < sys2 in the sign convention of E1000_TSYNC_COMPARETS:
+ * NIC time - system time = (systemToNIC - NICToSystem)/2
+ */
+static void phcCrossDelays(TimeInternal sys1, TimeInternal phc, TimeInternal sys2,
+                           TimeInternal *systemToNIC, TimeInternal *NICToSystem)
+{
+  *systemToNIC = phc - sys1;
+  *NICToSystem = sys2 - phc;
+}
+
+#define PHC_NSEC(pct) ((pct).sec*1000000000LL + (pct).nsec)
+
+/*
+ * Correlate PHC and system time. Best is a simultaneous reading by
+ * the hardware (PTP_SYS_OFFSET_PRECISE). Otherwise take
+ * runTimeOpts.crossSamples readings sys, phc, sys (by the kernel with
+ * PTP_SYS_OFFSET, else here) and keep the one with the tightest
+ * bracket around the PHC reading.
+ */
+static Boolean phcCrossTimestamp(TimeInternal *systemToNIC, TimeInternal *NICToSystem, PtpClock *ptpClock)
+{
+  struct timespec ts[3];
+  TimeInternal sys1, phc, sys2, best[3];
+  int i, samples = ptpClock->runTimeOpts.crossSamples;
+
+#ifdef PTP_SYS_OFFSET_PRECISE
+  if(ptpClock->phc.precise)
+  {
+    struct ptp_sys_offset_precise precise;
+
+    memset(&precise, 0, sizeof(precise));
+    if(ioctl(ptpClock->phc.fd, PTP_SYS_OFFSET_PRECISE, &precise) == 0)
+    {
+      sys1 = PHC_NSEC(precise.sys_realtime);
+      phcCrossDelays(sys1, PHC_NSEC(precise.device), sys1, systemToNIC, NICToSystem);
+      return TRUE;
+    }
+    DBG("PTP_SYS_OFFSET_PRECISE not available: %s\n", strerror(errno));
+    ptpClock->phc.precise = FALSE;
+  }
+#endif
+
+  if(samples > PTP_MAX_SAMPLES)
+    samples = PTP_MAX_SAMPLES;
+
+  if(ptpClock->phc.sysOffset)
+  {
+    struct ptp_sys_offset offset;
+
+    memset(&offset, 0, sizeof(offset));
+    offset.n_samples = samples;
+    if(ioctl(ptpClock->phc.fd, PTP_SYS_OFFSET, &offset) == 0)
+    {
+      for(i = 0; i < samples; i++)
+      {
+        sys1 = PHC_NSEC(offset.ts[2*i]);
+        phc = PHC_NSEC(offset.ts[2*i + 1]);
+        sys2 = PHC_NSEC(offset.ts[2*i + 2]);
+        if(!i || sys2 - sys1 < best[2] - best[0])
+        {
+          best[0] = sys1;
+          best[1] = phc;
+          best[2] = sys2;
+        }
+      }
+      phcCrossDelays(best[0], best[1], best[2], systemToNIC, NICToSystem);
+      return TRUE;
+    }
+    DBG("PTP_SYS_OFFSET not available: %s\n", strerror(errno));
+    ptpClock->phc.sysOffset = FALSE;
+  }
+
+  for(i = 0; i < samples; i++)
+  {
+    if(clock_gettime(CLOCK_REALTIME, &ts[0]) < 0 ||
+       clock_gettime(ptpClock->phc.clock, &ts[1]) < 0 ||
+       clock_gettime(CLOCK_REALTIME, &ts[2]) < 0)
+    {
+      PERROR("could not read PTP hardware and system clock");
+      return FALSE;
+    }
+    sys1 = TIMESPEC_NSEC(ts[0]);
+    phc = TIMESPEC_NSEC(ts[1]);
+    sys2 = TIMESPEC_NSEC(ts[2]);
+    if(!i || sys2 - sys1 < best[2] - best[0])
+    {
+      best[0] = sys1;
+      best[1] = phc;
+      best[2] = sys2;
+    }
+  }
+  phcCrossDelays(best[0], best[1], best[2], systemToNIC, NICToSystem);
+  return samples > 0;
+}
+
+static void phcToState(UInteger8 state, PtpClock *ptpClock)
+{
+  if(PHC_REALTIME(ptpClock))
+    return;
+
+  if(state == PTP_MASTER)
+    /* only master listens for Delay_Req... */
+    linuxSelectHWTimeStamping(FALSE, PHC_HW_FLAGS, ptpClock);
+  else if(ptpClock->port_state == PTP_MASTER)
+    /** ... and only while he still is master */
+    linuxSelectHWTimeStamping(TRUE, PHC_HW_FLAGS, ptpClock);
+}
+
+const TimeBackend timePHCBackend = {
+  .name = "phc",
+  .delayedTiming = FALSE,
+  .init = phcInit,
+  .getTime = phcGetTime,
+  .setTime = phcSetTime,
+  .adjTime = phcAdjTime,
+  .adjTimeOffset = phcAdjTimeOffset,
+  .toState = phcToState,
+  .shutdown = phcShutdown,
+  .crossTimestamp = phcCrossTimestamp,
+};
+
+#else /* HAVE_LINUX_NET_TSTAMP_H */
+
+static Boolean phcUnsupported(PtpClock *ptpClock)
+{
+  ERROR("PTP hardware clocks need the net_tstamp interface\n");
+  return FALSE;
+}
+
+const TimeBackend timePHCBackend = {
+  .name = "phc",
+  .init = phcUnsupported,
+  .getTime = systemGetTime,
+  .setTime = systemSetTime,
+  .adjTime = systemAdjTime,
+  .adjTimeOffset = systemAdjTimeOffset,
+};
+
+#endif /* HAVE_LINUX_NET_TSTAMP_H */
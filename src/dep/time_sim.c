@@ -0,0 +1,92 @@
+/* time_sim.c */
+
+#include "../ptpd.h"
+
+#include <math.h>
+
+/*
+ * TIME_SIM: a simulated oscillator in ptpClock->sim which runs on
+ * timerMonotonic(). Its frequency is off by a constant drift plus a
+ * random walk (wander) and the frequency adjustment. Packets are time
+ * stamped by whoever delivers them, with simClockRead(), like the IP
+ * stack does for TIME_SYSTEM. Used by ptpsim, which provides virtual
+ * network and time.
+ */
+
+double simGauss(UInteger32 *seed)
+{
+  double u1 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+
+  /* Box-Muller */
+  return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+/* bring the clock to monotonic time 'now' */
+static void simAdvance(SimClock *sim, Integer64 now)
+{
+  double dt, whole;
+
+  if(now <= sim->last)
+    return;
+
+  dt = now - sim->last;
+  sim->frac += dt * (sim->drift + sim->walk + sim->adj) / 1e9;
+  whole = floor(sim->frac);
+  sim->time += now - sim->last + (Integer64)whole;
+  sim->frac -= whole;
+  if(sim->wander)
+    sim->walk += sim->wander * sqrt(dt / 1e9) * simGauss(&sim->seed);
+  sim->last = now;
+}
+
+TimeInternal simClockRead(SimClock *sim, Integer64 now)
+{
+  simAdvance(sim, now);
+  return sim->time;
+}
+
+/* time, drift and wander were set up by the simulator, keep them */
+static Boolean simInit(PtpClock *ptpClock)
+{
+  if(!ptpClock->sim.last)
+    ptpClock->sim.last = timerMonotonic();
+  return TRUE;
+}
+
+static void simGetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  *time = simClockRead(&ptpClock->sim, timerMonotonic());
+}
+
+static void simSetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  simAdvance(&ptpClock->sim, timerMonotonic());
+  ptpClock->sim.time = *time;
+  ptpClock->sim.frac = 0;
+}
+
+static void simAdjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+{
+  simAdvance(&ptpClock->sim, timerMonotonic());
+  if(adj > ADJ_FREQ_MAX)
+    adj = ADJ_FREQ_MAX;
+  else if(adj < -ADJ_FREQ_MAX)
+    adj = -ADJ_FREQ_MAX;
+  ptpClock->sim.adj = adj;
+}
+
+static void simAdjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  simAdvance(&ptpClock->sim, timerMonotonic());
+  ptpClock->sim.time -= *offset;
+}
+
+const TimeBackend timeSimBackend = {
+  .name = "sim",
+  .init = simInit,
+  .getTime = simGetTime,
+  .setTime = simSetTime,
+  .adjTime = simAdjTime,
+  .adjTimeOffset = simAdjTimeOffset,
+};
@@ -0,0 +1,181 @@
+/* time_system.c */
+
+#include "../ptpd.h"
+
+/*
+ * TIME_SYSTEM: the host's system time is read and adjusted, packets
+ * are time stamped by the IP stack (SO_TIMESTAMP, multicast loop back).
+ * The other backends which control system time reuse these functions.
+ */
+
+void systemGetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  *time = TIMESPEC_NSEC(ts);
+}
+
+void systemSetTime(TimeInternal *time, PtpClock *ptpClock)
+{
+  struct timespec ts;
+
+  NOTIFY("resetting system clock to %lldns\n", *time);
+  NSEC_TIMESPEC(ts, *time);
+  if(clock_settime(CLOCK_REALTIME, &ts) < 0)
+    PERROR("could not set system clock");
+}
+
+void systemAdjTime(Integer32 adj, TimeInternal *offset, PtpClock *ptpClock)
+{
+  struct timex t;
+  static Boolean maxAdjValid;
+  static long maxAdj;
+  static long minTick, maxTick;
+  static long userHZ;
+  static long tickRes; /* USER_HZ * 1000 [ppb] */
+  long tickAdj;
+  long freqAdj;
+  int res;
+
+  if (!maxAdjValid) {
+      userHZ = sysconf(_SC_CLK_TCK);
+      t.modes = 0;
+      adjtimex(&t);
+      maxAdj = t.tolerance / ((1<<16)/1000);
+      tickRes = userHZ * 1000;
+      /* limits from the adjtimex command man page; could be determined via binary search */
+      minTick = (900000 - 1000000) / userHZ;
+      maxTick = (1100000 - 1000000) / userHZ;
+      maxAdjValid = TRUE;
+  }
+
+  /*
+   * The Linux man page for the adjtimex() system call does not
+   * describe limits for frequency. The more recent man page for
+   * the adjtimex command on RH5 does and says that
+   * -tolerance <= frequency <= tolerance
+   * which was confirmed by trying out values just outside that interval.
+   *
+   * Note that this contradicts the comments for struct timex which say
+   * that freq and tolerance have different units (scaled ppm vs ppm).
+   *
+   * We follow the actual implementation on Linux 2.6.22 and do the
+   * range check after scaling.
+   */
+
+  t.modes = MOD_FREQUENCY|MOD_CLKB;
+  /*
+   * @todo
+   * Where is the official documentation for "scaled  ppm"?
+   * Should this perhaps be adj * (1<<16) / 1000 (more accurate
+   * than multiplying by ((1<<16)/1000) == 65)?
+   */
+
+  /*
+   * 1 t.tick = 1 e-6 s * USER_HZ 1/s = 1 USER_HZ * 1000 ppb
+   *
+   * Large values of adj can be turned into t.tick adjustments:
+   * tickAdj t.tick = adj ppb / ( USER_HZ * 1000 ppb )
+   *
+   * Round this so that the error is as small is possible,
+   * because we need to fit that into t.freq.
+   */
+  freqAdj = adj;
+  tickAdj = 0;
+  if(freqAdj > maxAdj)
+  {
+    tickAdj = (adj - maxAdj + tickRes - 1) / tickRes;
+    if(tickAdj > maxTick)
+      tickAdj = maxTick;
+    freqAdj = adj - tickAdj * tickRes;
+  }
+  else if(freqAdj < -maxAdj)
+  {
+    tickAdj = -((-adj - maxAdj + tickRes - 1) / tickRes);
+    if(tickAdj < minTick)
+      tickAdj = minTick;
+    freqAdj = adj - tickAdj * tickRes;
+  }
+  if(freqAdj > maxAdj)
+    freqAdj = maxAdj;
+  else if(freqAdj < -maxAdj)
+    freqAdj = -maxAdj;
+
+  t.freq = freqAdj * ((1<<16)/1000);
+  t.tick = tickAdj + 1000000 / userHZ;
+  ptpClock->adj = tickAdj * tickRes + freqAdj;
+
+  INFO("requested adj %d ppb => adjust system frequency by %d scaled ppm (%d ppb) + %ld us/tick (%d ppb) = adj %d ppb (freq limit %ld/%ld ppm, tick limit %ld/%ld us*USER_HZ)\n",
+       adj,
+       t.freq, freqAdj,
+       t.tick - 1000000 / userHZ, tickAdj * tickRes,
+       ptpClock->adj,
+       -maxAdj, maxAdj,
+       minTick, maxTick);
+
+  res = adjtimex(&t);
+  switch (res) {
+  case -1:
+      ERROR("adjtimex(freq = %d) failed: %s\n",
+            t.freq, strerror(errno));
+      break;
+  case TIME_OK:
+      INFO("  -> TIME_OK\n");
+      break;
+  case TIME_INS:
+      ERROR("adjtimex -> insert leap second?!\n");
+      break;
+  case TIME_DEL:
+      ERROR("adjtimex -> delete leap second?!\n");
+      break;
+  case TIME_OOP:
+      ERROR("adjtimex -> leap second in progress?!\n");
+      break;
+  case TIME_WAIT:
+      ERROR("adjtimex -> leap second has occurred?!\n");
+      break;
+  case TIME_BAD:
+      ERROR("adjtimex -> time bad\n");
+      break;
+  default:
+      ERROR("adjtimex -> unknown result %d\n", res);
+      break;
+  }
+}
+
+/*
+ * shift the clock by -offset in one go: setting it to the time read
+ * before loses whatever passes in between
+ */
+void systemAdjTimeOffset(TimeInternal *offset, PtpClock *ptpClock)
+{
+  struct timex t;
+  TimeInternal step = -*offset;
+
+  memset(&t, 0, sizeof(t));
+  t.modes = ADJ_SETOFFSET|ADJ_NANO;
+  t.time.tv_sec = step / 1000000000;
+  t.time.tv_usec = step % 1000000000;
+  if(t.time.tv_usec < 0)
+  {
+    t.time.tv_sec -= 1;
+    t.time.tv_usec += 1000000000;
+  }
+
+  NOTIFY("stepping system clock by %lldns\n", step);
+  if(adjtimex(&t) < 0)
+  {
+    DBG("ADJ_SETOFFSET failed (%s), setting clock\n", strerror(errno));
+    timeStepOffset(offset, ptpClock);
+  }
+}
+
+const TimeBackend timeSystemBackend = {
+  .name = "system",
+  .delayedTiming = FALSE,
+  .getTime = systemGetTime,
+  .setTime = systemSetTime,
+  .adjTime = systemAdjTime,
+  .adjTimeOffset = systemAdjTimeOffset,
+};
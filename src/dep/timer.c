@@ -2,105 +2,190 @@
 
 #include "../ptpd.h"
 
-#define TIMER_INTERVAL 1
-int elapsed;
+/*
+ * On Linux every IntervalTimer is backed by its own timerfd, which
+ * becomes readable in the event loop when the timer expires. Elsewhere
+ * the timers keep a deadline and eventWait() limits its sleep to the
+ * next one (see timerNext()).
+ */
+#if defined(linux)
+#include <sys/timerfd.h>
+#endif
 
-void catch_alarm(int sig)
+static Integer64 monotonic(void)
 {
-  elapsed += TIMER_INTERVAL;
-  
-  /*
-   * DBGV() calls vsyslog() which doesn't seem to be reentrant:
-   * with Linux 2.6.23 and libc 2.5 (RH5) this even locked up the
-   * system.
-   *
-   * DBGV("catch_alarm: elapsed %d\n", elapsed);
-   */
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000LL + ts.tv_nsec;
 }
 
-void initTimer(void)
+/* CLOCK_MONOTONIC in nsec: not affected by the clock servo */
+Integer64 timerMonotonic(void)
 {
-  struct itimerval itimer;
-  
-  DBG("initTimer\n");
-  
-  signal(SIGALRM, SIG_IGN);
-  
-  elapsed = 0;
-  itimer.it_value.tv_sec = itimer.it_interval.tv_sec = TIMER_INTERVAL;
-  itimer.it_value.tv_usec = itimer.it_interval.tv_usec = 0;
-  
-  signal(SIGALRM, catch_alarm);
-  setitimer(ITIMER_REAL, &itimer, 0);
+  Integer64 now = monotonic();
+
+  captureTime(CAPTURE_MONOTONIC, &now);
+  return now;
 }
 
-void timerUpdate(IntervalTimer *itimer)
+Boolean initTimer(PtpClock *ptpClock)
 {
-  int i, delta;
-  
-  delta = elapsed;
-  elapsed = 0;
-  
-  if(delta <= 0)
-    return;
-  
+  int i;
+  IntervalTimer *itimer = ptpClock->itimer;
+
+  DBG("initTimer\n");
+
   for(i = 0; i < TIMER_ARRAY_SIZE; ++i)
   {
-    if(itimer[i].interval > 0 && (itimer[i].left -= delta) <= 0)
+    itimer[i].interval = 0;
+    itimer[i].expire = FALSE;
+
+#if defined(linux)
+    /* the event loop was recreated, so are the timers */
+    if(itimer[i].fd > 0)
+      close(itimer[i].fd);
+
+    /* in a replay the capture says when they expire */
+    itimer[i].fd = -1;
+    if(captureReplaying())
+      continue;
+
+    if((itimer[i].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
     {
-      itimer[i].left = itimer[i].interval;
-      itimer[i].expire = TRUE;
-      DBGV("timerUpdate: timer %u expired\n", i);
+      PERROR("failed to create timer");
+      return FALSE;
     }
+
+    if(!eventAdd(itimer[i].fd, EVENT_TIMER, ptpClock))
+      return FALSE;
+#endif
+  }
+
+  return TRUE;
+}
+
+void timerUpdate(IntervalTimer *itimer)
+{
+  int i;
+#if defined(linux)
+  Integer64 expirations;
+#else
+  Integer64 now = monotonic();
+#endif
+
+  for(i = 0; i < TIMER_ARRAY_SIZE; ++i)
+  {
+    if(itimer[i].interval <= 0)
+      continue;
+
+#if defined(linux)
+    /* consume the expiration count, missed expirations are merged */
+    if(read(itimer[i].fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+      continue;
+#else
+    if(now < itimer[i].deadline)
+      continue;
+
+    while(itimer[i].deadline <= now)
+      itimer[i].deadline += itimer[i].interval;
+#endif
+
+    itimer[i].expire = TRUE;
+    DBGV("timerUpdate: timer %u expired\n", i);
   }
 }
 
 void timerStop(UInteger16 index, IntervalTimer *itimer)
 {
+#if defined(linux)
+  struct itimerspec its;
+#endif
+
   if(index >= TIMER_ARRAY_SIZE)
     return;
-  
+
   itimer[index].interval = 0;
+
+#if defined(linux)
+  memset(&its, 0, sizeof(its));
+  if(itimer[index].fd >= 0)
+    timerfd_settime(itimer[index].fd, 0, &its, 0);
+#endif
 }
 
-void timerStart(UInteger16 index, UInteger16 interval, IntervalTimer *itimer)
+void timerStart(UInteger16 index, Integer64 interval, IntervalTimer *itimer)
 {
+#if defined(linux)
+  struct itimerspec its;
+#endif
+
   if(index >= TIMER_ARRAY_SIZE)
     return;
-  
+
   itimer[index].expire = FALSE;
-  itimer[index].left = interval;
-  itimer[index].interval = itimer[index].left;
-  
-  DBGV("timerStart: set timer %d to %d\n", index, interval);
+  itimer[index].interval = interval;
+  itimer[index].deadline = monotonic() + interval;
+
+#if defined(linux)
+  its.it_value.tv_sec = its.it_interval.tv_sec = interval / 1000000000;
+  its.it_value.tv_nsec = its.it_interval.tv_nsec = interval % 1000000000;
+  if(itimer[index].fd >= 0 && timerfd_settime(itimer[index].fd, 0, &its, 0) < 0)
+    PERROR("failed to start timer %d", index);
+#endif
+
+  DBGV("timerStart: set timer %d to %lldns\n", index, interval);
 }
 
 Boolean timerExpired(UInteger16 index, IntervalTimer *itimer)
 {
+  Boolean expired;
+
+#if !defined(linux)
+  /* without timer fds nothing else notices the deadlines */
   timerUpdate(itimer);
-  
+#endif
+  /* on Linux eventWait() latched the expirations reported by epoll */
+
   if(index >= TIMER_ARRAY_SIZE)
     return FALSE;
-  
-  if(!itimer[index].expire)
-    return FALSE;
-  
+
+  expired = itimer[index].expire;
   itimer[index].expire = FALSE;
-  
+
+  return captureTimer(index, expired);
+}
+
+Boolean timerNext(TimeInternal *timeout, IntervalTimer *itimer)
+{
+#if defined(linux)
+  /* the timer fds wake up the event loop by themselves */
+  return FALSE;
+#else
+  int i;
+  Integer64 next = 0, now = monotonic();
+
+  for(i = 0; i < TIMER_ARRAY_SIZE; ++i)
+    if(itimer[i].interval > 0 && (!next || itimer[i].deadline < next))
+      next = itimer[i].deadline;
+
+  if(!next)
+    return FALSE;
+
+  *timeout = next > now ? next - now : 0;
   return TRUE;
+#endif
 }
 
 Boolean nanoSleep(TimeInternal *t)
 {
   struct timespec ts, tr;
 
-  ts.tv_sec = t->seconds;
-  ts.tv_nsec = t->nanoseconds;
+  NSEC_TIMESPEC(ts, *t);
 
   if(nanosleep(&ts, &tr) < 0)
   {
-    t->seconds = tr.tv_sec;
-    t->nanoseconds = tr.tv_nsec;
+    *t = TIMESPEC_NSEC(tr);
     return FALSE;
   }
 
@@ -109,9 +194,9 @@ Boolean nanoSleep(TimeInternal *t)
 
 void timerNow(TimeInternal *time)
 {
-  struct timeval tv;
+  struct timespec ts;
 
-  gettimeofday(&tv, 0);
-  time->seconds = tv.tv_sec;
-  time->nanoseconds = tv.tv_usec*1000;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  *time = TIMESPEC_NSEC(ts);
+  captureTime(CAPTURE_REALTIME, time);
 }
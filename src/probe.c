@@ -66,11 +66,10 @@ void probe(PtpClock *ptpClock)
   }
   
   timerNow(&finish);
-  finish.seconds += PTP_SYNC_INTERVAL_TIMEOUT(ptpClock->sync_interval);
+  finish += PTP_SYNC_INTERVAL_TIMEOUT(ptpClock->sync_interval);
   for(;;)
   {
-    interval.seconds = PTP_SYNC_INTERVAL_TIMEOUT(ptpClock->sync_interval);
-    interval.nanoseconds = 0;
+    interval = PTP_SYNC_INTERVAL_TIMEOUT(ptpClock->sync_interval);
     netSelect(&interval, ptpClock);
     
     netRecvEvent(ptpClock->msgIbuf, NULL, ptpClock);
@@ -91,8 +90,7 @@ void probe(PtpClock *ptpClock)
     }
     
     timerNow(&now);
-    if( now.seconds > finish.seconds || (now.seconds == finish.seconds
-      && now.nanoseconds > finish.nanoseconds) )
+    if(now > finish)
       break;
   }
   
@@ -12,20 +12,26 @@ void handleFollowUp(MsgHeader*,Octet*,ssize_t,Boolean,PtpClock*);
 void handleDelayReq(MsgHeader*,Octet*,ssize_t,TimeInternal*,Boolean,Boolean,PtpClock*);
 void handleDelayResp(MsgHeader*,Octet*,ssize_t,Boolean,PtpClock*);
 void handleManagement(MsgHeader*,Octet*,ssize_t,Boolean,PtpClock*);
+void handleOffset(TimeInternal*,PtpClock*);
 
 void issueSync(PtpClock*);
-void issueFollowup(TimeInternal*,PtpClock*);
+void issueFollowup(TimeInternal*,UInteger16,PtpClock*);
 void issueDelayReq(PtpClock*);
 void issueDelayResp(TimeInternal*,MsgHeader*,PtpClock*);
 void issueManagement(MsgHeader*,MsgManagement*,PtpClock*);
 
+void startPendingSend(UInteger8,UInteger16,PtpClock*);
+void checkPendingSend(PtpClock*);
+
 MsgSync * addForeign(Octet*,MsgHeader*,PtpClock*);
 
 
 /* loop forever. doState() has a switch for the actions and events to be
    checked for 'port_state'. the actions and events may or may not change
    'port_state' by calling toState(), but once they are done we loop around
-   again and perform the actions required for the new 'port_state'. */
+   again and perform the actions required for the new 'port_state'. when
+   idle, the loop sleeps in handle() until the event loop reports input
+   on a socket or an expired timer. */
 void protocol(PtpClock *ptpClock)
 {
   DBG("event POWERUP\n");
@@ -34,6 +40,8 @@ void protocol(PtpClock *ptpClock)
   
   for(;;)
   {
+    LATENCY_POLL();
+    
     if(ptpClock->port_state != PTP_INITIALIZING)
       doState(ptpClock);
     else if(!doInit(ptpClock))
@@ -55,6 +63,7 @@ Boolean doInit(PtpClock *ptpClock)
   
   /* initialize networking */
   netShutdown(ptpClock);
+  shutdownTime(ptpClock);
   if(!netInit(ptpClock))
   {
     ERROR("failed to initialize network\n");
@@ -62,6 +71,14 @@ Boolean doInit(PtpClock *ptpClock)
     return FALSE;
   }
 
+  /* timers are registered with the event loop, the time source may start one */
+  if(!initTimer(ptpClock))
+  {
+    ERROR("failed to initialize timers\n");
+    toState(PTP_FAULTY, ptpClock);
+    return FALSE;
+  }
+
   /* initialize timing, may fail e.g. if timer depends on hardware */
   if(!initTime(ptpClock))
   {
@@ -70,30 +87,19 @@ Boolean doInit(PtpClock *ptpClock)
     return FALSE;
   }
 
-  switch (ptpClock->runTimeOpts.time) {
-  case TIME_SYSTEM:
-  case TIME_SYSTEM_LINUX_HW:
-  case TIME_SYSTEM_LINUX_SW:
-      /*
-       * send time stamp will be returned to socket when available,
-       * either via IP_MULTICAST_LOOP or SIOCSHWTSTAMP + error queue
-       */
-      ptpClock->delayedTiming = FALSE;
-      break;
-  default:
-      /* ask for time stamp shortly after sending */
-      ptpClock->delayedTiming = TRUE;
-      break;
-  }
-
   /* initialize other stuff */
   initData(ptpClock);
-  initTimer();
+  readDrift(ptpClock);
+  stopHoldover(ptpClock);
   initClock(ptpClock);
+  if(ptpClock->runTimeOpts.driftFile[0])
+    timerStart(DRIFT_FILE_TIMER, DRIFT_FILE_INTERVAL * 1000000000LL, ptpClock->itimer);
+  if(ptpClock->runTimeOpts.holdover)
+    timerStart(HOLDOVER_TIMER, HOLDOVER_INTERVAL * 1000000000LL, ptpClock->itimer);
   m1(ptpClock);
   msgPackHeader(ptpClock->msgObuf, ptpClock);
   
-  DBG("sync message interval: %d\n", PTP_SYNC_INTERVAL_TIMEOUT(ptpClock->sync_interval));
+  DBG("sync message interval: %lldns\n", PTP_SYNC_INTERVAL_TIMEOUT(ptpClock->sync_interval));
   DBG("clock identifier: %s\n", ptpClock->clock_identifier);
   DBG("256*log2(clock variance): %d\n", ptpClock->clock_variance);
   DBG("clock stratum: %d\n", ptpClock->clock_stratum);
@@ -123,16 +129,37 @@ void doState(PtpClock *ptpClock)
   
   ptpClock->message_activity = FALSE;
   
+  if(ptpClock->pendingSend && timerExpired(TX_TIMESTAMP_TIMER, ptpClock->itimer))
+    checkPendingSend(ptpClock);
+  
+  if(timerExpired(DRIFT_FILE_TIMER, ptpClock->itimer) && ptpClock->port_state == PTP_SLAVE)
+    writeDrift(ptpClock);
+  
+  if(timerExpired(HOLDOVER_TIMER, ptpClock->itimer))
+  {
+    if(ptpClock->port_state == PTP_SLAVE)
+      holdoverSample(ptpClock);
+    else
+      updateHoldover(ptpClock);
+  }
+  
   switch(ptpClock->port_state)
   {
   case PTP_LISTENING:
   case PTP_PASSIVE:
+  case PTP_UNCALIBRATED:
   case PTP_SLAVE:
   case PTP_MASTER:
     if(ptpClock->record_update)
     {
       ptpClock->record_update = FALSE;
       state = bmc(ptpClock->foreign, ptpClock);
+      
+      /* a new slave first calibrates its clock, see handleOffset() */
+      if(state == PTP_SLAVE && ptpClock->runTimeOpts.calibrationSyncs &&
+         ptpClock->port_state != PTP_SLAVE && !ptpClock->holdover.active)
+        state = PTP_UNCALIBRATED;
+      
       if(state != ptpClock->port_state)
         toState(state, ptpClock);
     }
@@ -162,6 +189,8 @@ void doState(PtpClock *ptpClock)
       DBG("event SYNC_RECEIPT_TIMEOUT_EXPIRES\n");
       ptpClock->number_foreign_records = 0;
       ptpClock->foreign_record_i = 0;
+      if(ptpClock->port_state == PTP_SLAVE)
+        startHoldover(ptpClock);
       if(!ptpClock->runTimeOpts.slaveOnly && ptpClock->clock_stratum != 255)
       {
         m1(ptpClock);
@@ -210,8 +239,16 @@ void toState(UInteger8 state, PtpClock *ptpClock)
     timerStart(SYNC_RECEIPT_TIMER, PTP_SYNC_RECEIPT_TIMEOUT(ptpClock->sync_interval), ptpClock->itimer);
     break;
     
+  case PTP_UNCALIBRATED:
+    /* keep the calibrated frequency only for PTP_SLAVE */
+    if(state != PTP_SLAVE)
+      initClock(ptpClock);
+    break;
+    
   case PTP_SLAVE:
-    initClock(ptpClock);
+    /* in holdover the clock keeps its frequency */
+    if(!ptpClock->holdover.active)
+      initClock(ptpClock);
     break;
     
   default:
@@ -270,13 +307,34 @@ void toState(UInteger8 state, PtpClock *ptpClock)
     
   case PTP_UNCALIBRATED:
     DBG("state PTP_UNCALIBRATED\n");
+    
+    initClock(ptpClock);
+    initCalibration(ptpClock);
+    
+    ptpClock->Q = 0;
+    ptpClock->R = getRand(&ptpClock->random_seed)%4 + 4;
+    DBG("Q = %d, R = %d\n", ptpClock->Q, ptpClock->R);
+    
+    /* a Delay_Resp still on its way must not pair with the next Delay_Req */
+    ptpClock->waitingForFollow = FALSE;
+    ptpClock->sentDelayReq = FALSE;
+    ptpClock->delay_req_send_time = 0;
+    ptpClock->delay_req_receive_time = 0;
+    
+    timerStart(SYNC_RECEIPT_TIMER, PTP_SYNC_RECEIPT_TIMEOUT(ptpClock->sync_interval), ptpClock->itimer);
+    
     ptpClock->port_state = PTP_UNCALIBRATED;
     break;
     
   case PTP_SLAVE:
     DBG("state PTP_PTP_SLAVE\n");
     
-    initClock(ptpClock);
+    /* after calibration or holdover only the servo starts from scratch */
+    if(ptpClock->port_state == PTP_UNCALIBRATED || ptpClock->holdover.active)
+      initServo(ptpClock);
+    else
+      initClock(ptpClock);
+    stopHoldover(ptpClock);
     
     /* R is chosen to allow a few syncs before we first get a one-way delay estimate */
     /* this is to allow the offset filter to fill for an accurate initial clock reset */
@@ -285,10 +343,9 @@ void toState(UInteger8 state, PtpClock *ptpClock)
     DBG("Q = %d, R = %d\n", ptpClock->Q, ptpClock->R);
     
     ptpClock->waitingForFollow = FALSE;
-    ptpClock->delay_req_send_time.seconds = 0;
-    ptpClock->delay_req_send_time.nanoseconds = 0;
-    ptpClock->delay_req_receive_time.seconds = 0;
-    ptpClock->delay_req_receive_time.nanoseconds = 0;
+    ptpClock->sentDelayReq = FALSE;
+    ptpClock->delay_req_send_time = 0;
+    ptpClock->delay_req_receive_time = 0;
     
     timerStart(SYNC_RECEIPT_TIMER, PTP_SYNC_RECEIPT_TIMEOUT(ptpClock->sync_interval), ptpClock->itimer);
     
@@ -308,14 +365,18 @@ void toState(UInteger8 state, PtpClock *ptpClock)
 void handle(PtpClock *ptpClock)
 {
   int ret;
-  ssize_t length;
+  ssize_t length = 0;
   Boolean isFromSelf;
   Boolean isEvent;
   Boolean badTime = FALSE;
-  TimeInternal time = { 0, 0 };
+  TimeInternal time = 0;
+  
+  /* after activity the sockets are read without waiting */
+  ret = EVENT_EVENT_SOCK|EVENT_ERROR_QUEUE|EVENT_GENERAL_SOCK;
   
   if(!ptpClock->message_activity)
   {
+    /* sleep until a socket or timer needs attention */
     ret = netSelect(0, ptpClock);
     if(ret < 0)
     {
@@ -323,20 +384,20 @@ void handle(PtpClock *ptpClock)
       toState(PTP_FAULTY, ptpClock);
       return;
     }
-    else if(!ret)
+    else if(!(ret & (EVENT_EVENT_SOCK|EVENT_ERROR_QUEUE|EVENT_GENERAL_SOCK)))
     {
       DBGV("handle: nothing\n");
       return;
     }
-    /* else length > 0 */
   }
   
   DBGV("handle: something\n");
 
   isEvent = TRUE;
-  length = netRecvEvent(ptpClock->msgIbuf,
-                        ptpClock->delayedTiming ? NULL : &time,
-                        ptpClock);
+  if(ret & (EVENT_EVENT_SOCK|EVENT_ERROR_QUEUE))
+    length = netRecvEvent(ptpClock->msgIbuf,
+                          ptpClock->delayedTiming ? NULL : &time,
+                          ptpClock);
   if(length < 0)
   {
     PERROR("failed to receive on the event socket");
@@ -346,7 +407,8 @@ void handle(PtpClock *ptpClock)
   else if(!length)
   {
     isEvent = FALSE;
-    length = netRecvGeneral(ptpClock->msgIbuf, ptpClock);
+    if(ret & EVENT_GENERAL_SOCK)
+      length = netRecvGeneral(ptpClock->msgIbuf, ptpClock);
     if(length < 0)
     {
       PERROR("failed to receive on the general socket");
@@ -358,6 +420,7 @@ void handle(PtpClock *ptpClock)
   }
   
   ptpClock->message_activity = TRUE;
+  LATENCY_MARK(LATENCY_RECV);
   
   if(!msgPeek(ptpClock->msgIbuf, length))
     return;
@@ -387,13 +450,14 @@ void handle(PtpClock *ptpClock)
       badTime = TRUE;
     }
   }
+  LATENCY_ARRIVAL(&time, ptpClock);
   
   DBGV("%s Receipt of Message\n"
     "   version %d\n"
     "   type %d\n"
     "   uuid %02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx\n"
     "   sequence %d\n"
-    "   time %us %dns\n",
+    "   time %lldns\n",
     isEvent ? "event" : "control",
     ptpClock->msgTmpHeader.versionPTP,
     ptpClock->msgTmpHeader.control,
@@ -401,7 +465,7 @@ void handle(PtpClock *ptpClock)
     ptpClock->msgTmpHeader.sourceUuid[2], ptpClock->msgTmpHeader.sourceUuid[3],
     ptpClock->msgTmpHeader.sourceUuid[4], ptpClock->msgTmpHeader.sourceUuid[5],
     ptpClock->msgTmpHeader.sequenceId,
-    time.seconds, time.nanoseconds);
+    time);
   
   if(ptpClock->msgTmpHeader.versionPTP != VERSION_PTP)
   {
@@ -422,8 +486,8 @@ void handle(PtpClock *ptpClock)
   
   /* subtract the inbound latency adjustment if it is not a loop back and the
      time stamp seems reasonable */
-  if(!isFromSelf && time.seconds > 0)
-    subTime(&time, &time, &ptpClock->runTimeOpts.inboundLatency);
+  if(!isFromSelf && time > 0)
+    time -= ptpClock->runTimeOpts.inboundLatency;
   
   switch(ptpClock->msgTmpHeader.control)
   {
@@ -456,7 +520,6 @@ void handle(PtpClock *ptpClock)
 void handleSync(MsgHeader *header, Octet *msgIbuf, ssize_t length, TimeInternal *time, Boolean badTime, Boolean isFromSelf, PtpClock *ptpClock)
 {
   MsgSync *sync;
-  TimeInternal originTimestamp;
   
   if(length < SYNC_PACKET_LENGTH)
   {
@@ -503,22 +566,22 @@ void handleSync(MsgHeader *header, Octet *msgIbuf, ssize_t length, TimeInternal
         /* spec recommends handling a sync interval discrepancy as a fault */
       }
       
-      /*
-       * TODO: Sync packets without hardware time stamp are rare, but might happen.
-       * Need to decide what to do with the bad default time stamp, similar to handleDelayReq().
-       */
-
-      ptpClock->sync_receive_time.seconds = time->seconds;
-      ptpClock->sync_receive_time.nanoseconds = time->nanoseconds;
+      ptpClock->sync_receive_time = *time;
       
-      if(!getFlag(header->flags, PTP_ASSIST))
+      if(badTime)
+      {
+        /* the fallback time stamp is useless for the servo, keep the Sync for the BMC only */
+        DBG("handleSync: no time stamp, ignored by clock servo\n");
+        ++ptpClock->offset_gate.rejected;
+        ptpClock->waitingForFollow = FALSE;
+      }
+      else if(!getFlag(header->flags, PTP_ASSIST))
       {
         ptpClock->waitingForFollow = FALSE;
         
-        toInternalTime(&originTimestamp, &sync->originTimestamp, &ptpClock->halfEpoch);
-        updateOffset(&originTimestamp, &ptpClock->sync_receive_time,
-          &ptpClock->ofm_filt, ptpClock);
-        updateClock(ptpClock);
+        ptpClock->halfEpoch = sync->halfEpoch;
+        LATENCY_MARK(LATENCY_HANDLER);
+        handleOffset(&sync->originTimestamp, ptpClock);
       }
       else
       {
@@ -557,8 +620,9 @@ void handleSync(MsgHeader *header, Octet *msgIbuf, ssize_t length, TimeInternal
       }
       else if(ptpClock->port_state == PTP_MASTER && ptpClock->clock_followup_capable)
       {
-        addTime(time, time, &ptpClock->runTimeOpts.outboundLatency);
-        issueFollowup(time, ptpClock);
+        /* the loop back need not be the most recently sent Sync */
+        *time += ptpClock->runTimeOpts.outboundLatency;
+        issueFollowup(time, header->sequenceId, ptpClock);
       }
     }
     break;
@@ -568,7 +632,6 @@ void handleSync(MsgHeader *header, Octet *msgIbuf, ssize_t length, TimeInternal
 void handleFollowUp(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean isFromSelf, PtpClock *ptpClock)
 {
   MsgFollowUp *follow;
-  TimeInternal preciseOriginTimestamp;
   
   if(length < FOLLOW_UP_PACKET_LENGTH)
   {
@@ -579,6 +642,7 @@ void handleFollowUp(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean i
   
   switch(ptpClock->port_state)
   {
+  case PTP_UNCALIBRATED:
   case PTP_SLAVE:
     if(isFromSelf)
     {
@@ -604,10 +668,9 @@ void handleFollowUp(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean i
     {
       ptpClock->waitingForFollow = FALSE;
       
-      toInternalTime(&preciseOriginTimestamp, &follow->preciseOriginTimestamp, &ptpClock->halfEpoch);
-      updateOffset(&preciseOriginTimestamp, &ptpClock->sync_receive_time,
-        &ptpClock->ofm_filt, ptpClock);
-      updateClock(ptpClock);
+      ptpClock->halfEpoch = follow->halfEpoch;
+      LATENCY_MARK(LATENCY_HANDLER);
+      handleOffset(&follow->preciseOriginTimestamp, ptpClock);
     }
     else
     {
@@ -621,6 +684,25 @@ void handleFollowUp(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean i
   }
 }
 
+/*
+ * The Sync with local receive time sync_receive_time was sent at
+ * 'originTimestamp': check it and pass it on to the clock servo, or to
+ * the calibration in PTP_UNCALIBRATED.
+ */
+void handleOffset(TimeInternal *originTimestamp, PtpClock *ptpClock)
+{
+  if(!gateOffset(originTimestamp, &ptpClock->sync_receive_time, ptpClock))
+    return;
+  
+  updateOffset(originTimestamp, &ptpClock->sync_receive_time,
+    &ptpClock->ofm_filt, ptpClock);
+  
+  if(ptpClock->port_state != PTP_UNCALIBRATED)
+    updateClock(ptpClock);
+  else if(calibrateClock(ptpClock))
+    toState(PTP_SLAVE, ptpClock);
+}
+
 void handleDelayReq(MsgHeader *header, Octet *msgIbuf, ssize_t length, TimeInternal *time, Boolean badTime, Boolean isFromSelf, PtpClock *ptpClock)
 {
   if(length < DELAY_REQ_PACKET_LENGTH)
@@ -651,25 +733,28 @@ void handleDelayReq(MsgHeader *header, Octet *msgIbuf, ssize_t length, TimeInter
     
     break;
     
+  case PTP_UNCALIBRATED:
   case PTP_SLAVE:
     if(isFromSelf)
     {
       DBG("handleDelayReq: self\n");
       
-      ptpClock->delay_req_send_time.seconds = time->seconds;
-      ptpClock->delay_req_send_time.nanoseconds = time->nanoseconds;
+      if(header->sequenceId != ptpClock->sentDelayReqSequenceId)
+      {
+        DBG("handleDelayReq: ignore stale loop back %d\n", header->sequenceId);
+        return;
+      }
       
-      addTime(&ptpClock->delay_req_send_time, &ptpClock->delay_req_send_time, &ptpClock->runTimeOpts.outboundLatency);
+      ptpClock->delay_req_send_time = *time + ptpClock->runTimeOpts.outboundLatency;
       
-      if(ptpClock->delay_req_receive_time.seconds)
+      if(ptpClock->delay_req_receive_time)
       {
-        updateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time,
-          &ptpClock->owd_filt, ptpClock);
+        if(gateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time, ptpClock))
+          updateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time,
+            &ptpClock->owd_filt, ptpClock);
         
-        ptpClock->delay_req_send_time.seconds = 0;
-        ptpClock->delay_req_send_time.nanoseconds = 0;
-        ptpClock->delay_req_receive_time.seconds = 0;
-        ptpClock->delay_req_receive_time.nanoseconds = 0;
+        ptpClock->delay_req_send_time = 0;
+        ptpClock->delay_req_receive_time = 0;
       }
     }
     break;
@@ -693,6 +778,7 @@ void handleDelayResp(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean
   
   switch(ptpClock->port_state)
   {
+  case PTP_UNCALIBRATED:
   case PTP_SLAVE:
     if(isFromSelf)
     {
@@ -714,17 +800,17 @@ void handleDelayResp(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean
     {
       ptpClock->sentDelayReq = FALSE;
       
-      toInternalTime(&ptpClock->delay_req_receive_time, &resp->delayReceiptTimestamp, &ptpClock->halfEpoch);
+      ptpClock->halfEpoch = resp->halfEpoch;
+      ptpClock->delay_req_receive_time = resp->delayReceiptTimestamp;
       
-      if(ptpClock->delay_req_send_time.seconds)
+      if(ptpClock->delay_req_send_time)
       {
-        updateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time,
-          &ptpClock->owd_filt, ptpClock);
+        if(gateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time, ptpClock))
+          updateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time,
+            &ptpClock->owd_filt, ptpClock);
         
-        ptpClock->delay_req_send_time.seconds = 0;
-        ptpClock->delay_req_send_time.nanoseconds = 0;
-        ptpClock->delay_req_receive_time.seconds = 0;
-        ptpClock->delay_req_receive_time.nanoseconds = 0;
+        ptpClock->delay_req_send_time = 0;
+        ptpClock->delay_req_receive_time = 0;
       }
     }
     else
@@ -786,45 +872,30 @@ void handleManagement(MsgHeader *header, Octet *msgIbuf, ssize_t length, Boolean
 /* pack and send various messages */
 void issueSync(PtpClock *ptpClock)
 {
-  TimeInternal internalTime;
-  TimeRepresentation originTimestamp;
+  TimeInternal originTimestamp;
   
   ++ptpClock->last_sync_event_sequence_number;
   ptpClock->grandmaster_sequence_number = ptpClock->last_sync_event_sequence_number;
 
   /* try to predict outgoing time stamp */
-  getTime(&internalTime, ptpClock);
-  fromInternalTime(&internalTime, &originTimestamp, ptpClock->halfEpoch);
+  getTime(&originTimestamp, ptpClock);
   msgPackSync(ptpClock->msgObuf, FALSE, TRUE, &originTimestamp, ptpClock);
   
-  if(!netSendEvent(ptpClock->msgObuf, SYNC_PACKET_LENGTH,
-                   ptpClock->delayedTiming ? &internalTime : NULL,
-                   ptpClock))
+  if(!netSendEvent(ptpClock->msgObuf, SYNC_PACKET_LENGTH, ptpClock))
     toState(PTP_FAULTY, ptpClock);
   else
   {
     DBGV("sent sync message\n");
     if(ptpClock->delayedTiming)
-    {
-      if (internalTime.seconds || internalTime.nanoseconds) {
-        /* compensate with configurable latency, then tell client real time stamp */
-        addTime(&internalTime, &internalTime, &ptpClock->runTimeOpts.outboundLatency);
-        issueFollowup(&internalTime, ptpClock);
-      } else {
-        NOTIFY("WARNING: sync message without hardware time stamp, skipped followup\n");
-      }
-    }
+      startPendingSend(PTP_SYNC_MESSAGE, ptpClock->last_sync_event_sequence_number, ptpClock);
   }
 }
 
-void issueFollowup(TimeInternal *time, PtpClock *ptpClock)
+void issueFollowup(TimeInternal *time, UInteger16 associatedSequenceId, PtpClock *ptpClock)
 {
-  TimeRepresentation preciseOriginTimestamp;
-  
   ++ptpClock->last_general_event_sequence_number;
   
-  fromInternalTime(time, &preciseOriginTimestamp, ptpClock->halfEpoch);
-  msgPackFollowUp(ptpClock->msgObuf, ptpClock->last_sync_event_sequence_number, &preciseOriginTimestamp, ptpClock);
+  msgPackFollowUp(ptpClock->msgObuf, associatedSequenceId, time, ptpClock);
   
   if(!netSendGeneral(ptpClock->msgObuf, FOLLOW_UP_PACKET_LENGTH, ptpClock))
     toState(PTP_FAULTY, ptpClock);
@@ -834,46 +905,30 @@ void issueFollowup(TimeInternal *time, PtpClock *ptpClock)
 
 void issueDelayReq(PtpClock *ptpClock)
 {
-  TimeInternal internalTime;
-  TimeRepresentation originTimestamp;
+  TimeInternal originTimestamp;
   
   ptpClock->sentDelayReq = TRUE;
   ptpClock->sentDelayReqSequenceId = ++ptpClock->last_sync_event_sequence_number;
 
   /* try to predict outgoing time stamp */
-  getTime(&internalTime, ptpClock);
-  fromInternalTime(&internalTime, &originTimestamp, ptpClock->halfEpoch);
+  getTime(&originTimestamp, ptpClock);
   msgPackDelayReq(ptpClock->msgObuf, FALSE, FALSE, &originTimestamp, ptpClock);
   
-  if(!netSendEvent(ptpClock->msgObuf, DELAY_REQ_PACKET_LENGTH,
-                   ptpClock->delayedTiming ? &internalTime : NULL,
-                   ptpClock))
+  if(!netSendEvent(ptpClock->msgObuf, DELAY_REQ_PACKET_LENGTH, ptpClock))
     toState(PTP_FAULTY, ptpClock);
   else
   {
     DBGV("sent delay request message\n");
     if(ptpClock->delayedTiming)
-    {
-      if (internalTime.seconds || internalTime.nanoseconds) {
-        /* compensate with configurable latency, then store for later use */
-        addTime(&internalTime, &internalTime, &ptpClock->runTimeOpts.outboundLatency);
-        ptpClock->delay_req_send_time = internalTime;
-      } else {
-        NOTIFY("WARNING: delay request message without hardware time stamp, will skip response\n");
-        ptpClock->sentDelayReq = FALSE;
-      }
-    }
+      startPendingSend(PTP_DELAY_REQ_MESSAGE, ptpClock->sentDelayReqSequenceId, ptpClock);
   }
 }
 
 void issueDelayResp(TimeInternal *time, MsgHeader *header, PtpClock *ptpClock)
 {
-  TimeRepresentation delayReceiptTimestamp;
-  
   ++ptpClock->last_general_event_sequence_number;
 
-  fromInternalTime(time, &delayReceiptTimestamp, ptpClock->halfEpoch);
-  msgPackDelayResp(ptpClock->msgObuf, header, &delayReceiptTimestamp, ptpClock);
+  msgPackDelayResp(ptpClock->msgObuf, header, time, ptpClock);
   
   if(!netSendGeneral(ptpClock->msgObuf, DELAY_RESP_PACKET_LENGTH, ptpClock))
     toState(PTP_FAULTY, ptpClock);
@@ -896,6 +951,95 @@ void issueManagement(MsgHeader *header, MsgManagement *manage, PtpClock *ptpCloc
     DBGV("sent management message\n");
 }
 
+/* remember that the send time stamp of an event message is outstanding */
+void startPendingSend(UInteger8 control, UInteger16 sequenceId, PtpClock *ptpClock)
+{
+  if(ptpClock->pendingSend)
+    DBG("send time stamp of message %d still missing, forget it\n", ptpClock->pendingSendSequenceId);
+  
+  ptpClock->pendingSend = TRUE;
+  ptpClock->pendingSendControl = control;
+  ptpClock->pendingSendSequenceId = sequenceId;
+  ptpClock->pendingSendStart = timerMonotonic();
+  
+  /* fast path: time stamp might be available already */
+  checkPendingSend(ptpClock);
+  if(ptpClock->pendingSend)
+    timerStart(TX_TIMESTAMP_TIMER, TX_TIMESTAMP_POLL_INTERVAL, ptpClock->itimer);
+}
+
+/*
+ * Poll for the send time stamp of the pending event message and finish
+ * what depends on it: the Follow_Up for a Sync, the delay calculation
+ * for a Delay_Req. Gives up after TX_TIMESTAMP_TIMEOUT because under
+ * load the time stamp is not always generated (packet dropped inside
+ * the driver?).
+ */
+void checkPendingSend(PtpClock *ptpClock)
+{
+  TimeInternal sendTime;
+  Boolean gotTime;
+  
+  gotTime = getSendTime(&sendTime, ptpClock);
+  if(!gotTime &&
+     timerMonotonic() - ptpClock->pendingSendStart < TX_TIMESTAMP_TIMEOUT)
+    return;
+  
+  DBGV("%s send time stamp of message %d\n",
+       gotTime ? "got" : "failed to get", ptpClock->pendingSendSequenceId);
+  
+  ptpClock->pendingSend = FALSE;
+  timerStop(TX_TIMESTAMP_TIMER, ptpClock->itimer);
+  
+  if(gotTime)
+    /* compensate with configurable latency */
+    sendTime += ptpClock->runTimeOpts.outboundLatency;
+  
+  switch(ptpClock->pendingSendControl)
+  {
+  case PTP_SYNC_MESSAGE:
+    if(ptpClock->port_state != PTP_MASTER
+      || ptpClock->pendingSendSequenceId != ptpClock->last_sync_event_sequence_number)
+      DBG("send time stamp for outdated sync message\n");
+    else if(gotTime)
+      /* tell client real time stamp */
+      issueFollowup(&sendTime, ptpClock->pendingSendSequenceId, ptpClock);
+    else
+      NOTIFY("WARNING: sync message without hardware time stamp, skipped followup\n");
+    break;
+    
+  case PTP_DELAY_REQ_MESSAGE:
+    if((ptpClock->port_state != PTP_SLAVE && ptpClock->port_state != PTP_UNCALIBRATED)
+      || ptpClock->pendingSendSequenceId != ptpClock->sentDelayReqSequenceId)
+      DBG("send time stamp for outdated delay request message\n");
+    else if(!gotTime)
+    {
+      NOTIFY("WARNING: delay request message without hardware time stamp, will skip response\n");
+      ptpClock->sentDelayReq = FALSE;
+      ptpClock->delay_req_receive_time = 0;
+    }
+    else
+    {
+      ptpClock->delay_req_send_time = sendTime;
+      
+      /* the response might have been faster than the time stamp */
+      if(ptpClock->delay_req_receive_time)
+      {
+        if(gateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time, ptpClock))
+          updateDelay(&ptpClock->delay_req_send_time, &ptpClock->delay_req_receive_time,
+            &ptpClock->owd_filt, ptpClock);
+        
+        ptpClock->delay_req_send_time = 0;
+        ptpClock->delay_req_receive_time = 0;
+      }
+    }
+    break;
+    
+  default:
+    break;
+  }
+}
+
 /* add or update an entry in the foreign master data set */
 MsgSync * addForeign(Octet *buf, MsgHeader *header, PtpClock *ptpClock)
 {
@@ -0,0 +1,394 @@
+/* ptpbench.c */
+
+#include "ptpd.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Microbenchmarks of the hot paths: message (un)packing, the BMC and
+ * the steps from a measured delay to the clock correction. Each one
+ * is repeated until it ran for -t msec; of -r such runs the fastest
+ * counts, reported as nsec and CPU cycles per call. Cycles come from
+ * the perf cycle counter, or else the TSC, which ticks at a constant
+ * rate regardless of the CPU frequency.
+ *
+ * The clock is a TIME_SIM oscillator, so updateClock() exercises the
+ * servo and the backend without touching the system clock. TimeInternal
+ * is a plain nsec count; its conversions from and to the wire format
+ * are measured with the Follow_Up, which carries nothing but a time.
+ */
+
+#define BENCH_NOISE 256
+
+Integer8 bmcDataSetComparison(MsgHeader*,MsgSync*,MsgHeader*,MsgSync*,PtpClock*);
+
+typedef struct {
+  const char *name;
+  void (*run)(long iterations);
+} Benchmark;
+
+static PtpClock *ptpClock;
+static Octet syncPacket[PACKET_SIZE], followUpPacket[PACKET_SIZE], buf[PACKET_SIZE];
+static MsgHeader header;
+static MsgSync syncBody;
+static MsgFollowUp followUp;
+/** two foreign masters of equal quality, see benchCompare() */
+static ForeignMasterRecord pair[2];
+/** delay variations, so that filters and servo see realistic input */
+static TimeInternal noise[BENCH_NOISE];
+static TimeInternal now;
+static volatile Integer64 sink;
+
+/* the cycle counter: perf_event file descriptor, or -1 for the TSC */
+static int cycleFd = -1;
+static Boolean haveCycles;
+
+static void cycleInit(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  cycleFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if(cycleFd >= 0) {
+    haveCycles = TRUE;
+    printf("cycles: CPU cycle counter\n");
+    return;
+  }
+#if defined(__i386__) || defined(__x86_64__)
+  haveCycles = TRUE;
+  printf("cycles: TSC (no perf cycle counter: %s)\n", strerror(errno));
+#else
+  printf("cycles: not available (%s)\n", strerror(errno));
+#endif
+}
+
+static unsigned long long cycles(void)
+{
+  unsigned long long count = 0;
+
+  if(cycleFd >= 0) {
+    if(read(cycleFd, &count, sizeof(count)) != sizeof(count))
+      count = 0;
+  }
+#if defined(__i386__) || defined(__x86_64__)
+  else
+    count = __rdtsc();
+#endif
+  return count;
+}
+
+static Integer64 elapsed(struct timespec *start)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return TIMESPEC_NSEC(end) - TIMESPEC_NSEC(*start);
+}
+
+static void benchUnpackHeader(long iterations)
+{
+  while(iterations--)
+    msgUnpackHeader(syncPacket, &header);
+  sink = header.sequenceId;
+}
+
+static void benchUnpackSync(long iterations)
+{
+  while(iterations--)
+    msgUnpackSync(syncPacket, &syncBody);
+  sink = syncBody.originTimestamp;
+}
+
+static void benchPackSync(long iterations)
+{
+  TimeInternal origin = now;
+
+  while(iterations--) {
+    origin += 1000;
+    msgPackSync(buf, FALSE, TRUE, &origin, ptpClock);
+  }
+  sink = buf[47];
+}
+
+static void benchPackTime(long iterations)
+{
+  TimeInternal time = now;
+
+  while(iterations--) {
+    time += 1000;
+    msgPackFollowUp(buf, 1, &time, ptpClock);
+  }
+  sink = buf[51];
+}
+
+static void benchUnpackTime(long iterations)
+{
+  while(iterations--)
+    msgUnpackFollowUp(followUpPacket, &followUp);
+  sink = followUp.preciseOriginTimestamp;
+}
+
+/* equal stratum, identifier and variance: decided by the UUIDs */
+static void benchCompare(long iterations)
+{
+  Integer8 result = 0;
+
+  while(iterations--)
+    result += bmcDataSetComparison(&pair[0].header, &pair[0].sync,
+                                   &pair[1].header, &pair[1].sync, ptpClock);
+  sink = result;
+}
+
+static void benchBmc(long iterations)
+{
+  UInteger8 state = 0;
+
+  while(iterations--)
+    state += bmc(ptpClock->foreign, ptpClock);
+  sink = state;
+}
+
+static void benchUpdateOffset(long iterations)
+{
+  TimeInternal send, recv;
+
+  while(iterations--) {
+    now += 1000000000;
+    send = now;
+    recv = now + 20000 + noise[iterations % BENCH_NOISE];
+    ptpClock->sync_receive_time = recv;
+    updateOffset(&send, &recv, &ptpClock->ofm_filt, ptpClock);
+  }
+  sink = ptpClock->offset_from_master;
+}
+
+static void benchUpdateDelay(long iterations)
+{
+  TimeInternal send, recv;
+
+  while(iterations--) {
+    now += 1000000000;
+    send = now;
+    recv = now + 20000 + noise[iterations % BENCH_NOISE];
+    ptpClock->delay_req_send_time = send;
+    updateDelay(&send, &recv, &ptpClock->owd_filt, ptpClock);
+  }
+  sink = ptpClock->one_way_delay;
+}
+
+static void benchUpdateClock(long iterations)
+{
+  while(iterations--) {
+    now += 1000000000;
+    ptpClock->sync_receive_time = now;
+    ptpClock->offset_from_master = noise[iterations % BENCH_NOISE];
+    updateClock(ptpClock);
+  }
+  sink = ptpClock->observed_drift;
+}
+
+static const Benchmark benchmarks[] = {
+  { "msgUnpackHeader", benchUnpackHeader },
+  { "msgUnpackSync", benchUnpackSync },
+  { "msgPackSync", benchPackSync },
+  { "msgPackFollowUp", benchPackTime },
+  { "msgUnpackFollowUp", benchUnpackTime },
+  { "bmcDataSetComparison", benchCompare },
+  { "bmc", benchBmc },
+  { "updateOffset", benchUpdateOffset },
+  { "updateDelay", benchUpdateDelay },
+  { "updateClock", benchUpdateClock },
+};
+
+/* a Sync of a master with 'uuid' as it arrives from the network */
+static void makeForeign(ForeignMasterRecord *foreign, UInteger8 uuid)
+{
+  Octet packet[PACKET_SIZE];
+
+  memset(packet, 0, sizeof(packet));
+  ptpClock->port_uuid_field[PTP_UUID_LENGTH-1] = uuid;
+  memcpy(ptpClock->grandmaster_uuid_field, ptpClock->port_uuid_field, PTP_UUID_LENGTH);
+  msgPackHeader(packet, ptpClock);
+  msgPackSync(packet, FALSE, TRUE, &now, ptpClock);
+  msgUnpackHeader(packet, &foreign->header);
+  msgUnpackSync(packet, &foreign->sync);
+  memcpy(foreign->foreign_master_uuid, foreign->header.sourceUuid, PTP_UUID_LENGTH);
+  foreign->foreign_master_port_id = foreign->header.sourcePortId;
+}
+
+static Boolean setup(RunTimeOpts *rtOpts)
+{
+  UInteger32 seed = 1;
+  Integer16 i;
+
+  ptpClock = (PtpClock *)calloc(1, sizeof(PtpClock));
+  if(!ptpClock ||
+     !(ptpClock->foreign = (ForeignMasterRecord *)calloc(rtOpts->max_foreign_records, sizeof(ForeignMasterRecord)))) {
+    PERROR("failed to allocate memory for protocol engine data");
+    return FALSE;
+  }
+  ptpClock->name = "";
+  ptpClock->runTimeOpts = *rtOpts;
+  if(!initTime(ptpClock))
+    return FALSE;
+  getTime(&now, ptpClock);
+
+  initData(ptpClock);
+  m1(ptpClock);
+  /* a grandmaster which a slave would compare */
+  ptpClock->grandmaster_stratum = 4;
+  ptpClock->grandmaster_variance = 0;
+
+  /* the foreign masters, from the clock itself with different UUIDs */
+  ptpClock->port_uuid_field[0] = 0x02;
+  for(i = 0; i < rtOpts->max_foreign_records; i++)
+    makeForeign(&ptpClock->foreign[i], 0x10 + i);
+  ptpClock->number_foreign_records = rtOpts->max_foreign_records;
+  makeForeign(&pair[0], 0x20);
+  makeForeign(&pair[1], 0x21);
+
+  /* the packets which are unpacked, from a different master */
+  ptpClock->port_uuid_field[PTP_UUID_LENGTH-1] = 0x01;
+  ++ptpClock->last_sync_event_sequence_number;
+  msgPackHeader(syncPacket, ptpClock);
+  msgPackSync(syncPacket, FALSE, TRUE, &now, ptpClock);
+  msgPackHeader(followUpPacket, ptpClock);
+  msgPackFollowUp(followUpPacket, ptpClock->last_sync_event_sequence_number, &now, ptpClock);
+  msgPackHeader(buf, ptpClock);
+
+  for(i = 0; i < BENCH_NOISE; i++)
+    noise[i] = (rand_r(&seed) % 2001) - 1000;
+
+  initClock(ptpClock);
+  ptpClock->port_state = PTP_SLAVE;
+  return TRUE;
+}
+
+/* run for at least 'minTime' nsec, returns nsec and cycles per call */
+static void measure(const Benchmark *bench, Integer64 minTime, double *nsec, double *cyc)
+{
+  struct timespec start;
+  unsigned long long startCycles;
+  Integer64 time;
+  long iterations = 1;
+
+  /* find an iteration count which takes long enough */
+  for(;;) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bench->run(iterations);
+    time = elapsed(&start);
+    if(time >= minTime / 10)
+      break;
+    iterations *= 2;
+  }
+  if(time < minTime)
+    iterations = (double)iterations * minTime / (time ? time : 1);
+
+  startCycles = cycles();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bench->run(iterations);
+  time = elapsed(&start);
+  *cyc = (double)(cycles() - startCycles) / iterations;
+  *nsec = (double)time / iterations;
+}
+
+static void usage(void)
+{
+  printf(
+"\nUsage:  ptpbench [OPTION] [NAME...]\n\n"
+"-t NUMBER         run each benchmark for NUMBER msec (default 100)\n"
+"-r NUMBER         take the fastest of NUMBER runs (default 5)\n"
+"-m NUMBER         foreign master records for bmc (default 5)\n"
+"-S NAME           clock servo, see ptpd -S\n"
+"NAME...           only the benchmarks whose names start with NAME\n"
+"\n"
+  );
+}
+
+int main(int argc, char **argv)
+{
+  RunTimeOpts rtOpts;
+  Integer64 minTime = 100000000;
+  int repeat = 5;
+  int c, i, j, run;
+  double nsec, cyc, bestNsec, bestCyc;
+
+  memset(&rtOpts, 0, sizeof(rtOpts));
+  ptpdDefaults(&rtOpts);
+  rtOpts.time = TIME_SIM;
+
+  while((c = getopt(argc, argv, "?t:r:m:S:")) != -1) {
+    switch(c) {
+    case 't':
+      minTime = strtoll(optarg, 0, 0) * 1000000;
+      break;
+
+    case 'r':
+      repeat = strtol(optarg, 0, 0);
+      break;
+
+    case 'm':
+      rtOpts.max_foreign_records = strtol(optarg, 0, 0);
+      break;
+
+    case 'S':
+      for(i = 0; i < SERVO_MAX; i++)
+        if(!strcasecmp(optarg, findServo(i)->name))
+          break;
+      if(i == SERVO_MAX) {
+        ERROR("Unsupported -S servo '%s'.\n", optarg);
+        return 1;
+      }
+      rtOpts.servo = i;
+      break;
+
+    default:
+      usage();
+      return c == '?' ? 0 : 1;
+    }
+  }
+
+  if(minTime <= 0 || repeat < 1 || rtOpts.max_foreign_records < 1) {
+    usage();
+    return 1;
+  }
+
+  if(!setup(&rtOpts))
+    return 2;
+
+  cycleInit();
+  printf("%-22s %10s %10s\n", "benchmark", "ns/op", "cycles/op");
+  for(i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); i++) {
+    if(optind < argc) {
+      for(j = optind; j < argc; j++)
+        if(!strncmp(benchmarks[i].name, argv[j], strlen(argv[j])))
+          break;
+      if(j == argc)
+        continue;
+    }
+
+    bestNsec = bestCyc = 0;
+    for(run = 0; run < repeat; run++) {
+      measure(&benchmarks[i], minTime, &nsec, &cyc);
+      if(!run || nsec < bestNsec) {
+        bestNsec = nsec;
+        bestCyc = cyc;
+      }
+    }
+    if(haveCycles)
+      printf("%-22s %10.1f %10.1f\n", benchmarks[i].name, bestNsec, bestCyc);
+    else
+      printf("%-22s %10.1f %10s\n", benchmarks[i].name, bestNsec, "-");
+  }
+
+  return 0;
+}
@@ -13,11 +13,6 @@
 /* arith.c */
 UInteger32 crc_algorithm(Octet*,Integer16);
 UInteger32 sum(Octet*,Integer16);
-void fromInternalTime(TimeInternal*,TimeRepresentation*,Boolean);
-void toInternalTime(TimeInternal*,TimeRepresentation*,Boolean*);
-void normalizeTime(TimeInternal*);
-void addTime(TimeInternal*,TimeInternal*,TimeInternal*);
-void subTime(TimeInternal*,TimeInternal*,TimeInternal*);
 
 /* bmc.c */
 UInteger8 bmc(ForeignMasterRecord*,PtpClock*);
@@ -0,0 +1,889 @@
+/* ptpsim.c */
+
+#include "ptpd.h"
+
+#include <math.h>
+
+/*
+ * Network simulator: runs master capable nodes and slaves, each a
+ * complete protocol engine of protocol.c with BMC, filters and clock
+ * servo, in one process. This file takes the place of net.c, event.c
+ * and timer.c: timerMonotonic() is simulated time, which jumps from
+ * one event (packet arrival, timer expiration) to the next, so the
+ * simulation runs as fast as the engines process their packets. Every
+ * node has a TIME_SIM oscillator with random initial offset, drift
+ * and wander.
+ *
+ * Packets are multicast like in the real network, with a one-way delay
+ * of -D nsec plus half the asymmetry -A on the way from a master
+ * capable node to a slave and minus it on the way back, queuing jitter
+ * which is exponentially distributed with mean -J, loss and reordering.
+ * Event packets come back to their sender with the send time stamp,
+ * like the multicast loop back of the IP stack. Unless -m is given,
+ * packets of slaves only go to the master capable nodes and Delay_Resp
+ * only to the slave which asked for it: the others would just drop
+ * them, and this keeps 10000 slaves affordable.
+ *
+ * Once per simulated second the true offset of every other node from
+ * the (first) node in PTP_MASTER is sampled. A slave has converged
+ * when it stays in PTP_SLAVE within -c nsec until the end; its offsets
+ * after the warm up (-k) make up the steady state statistics. The CPU
+ * time which nodes in PTP_MASTER spend in the protocol engine is the
+ * cost of the master.
+ */
+
+/** where the simulated clocks start */
+#define SIM_EPOCH 1700000000000000000LL
+/** where timerMonotonic() starts */
+#define SIM_MONOTONIC 1000000000LL
+/** sampling of the true offsets */
+#define SIM_SAMPLE_INTERVAL 1000000000LL
+/** nodes start at random times within this */
+#define SIM_START_SPREAD 1000000000LL
+/** a reordered packet is held back by up to this */
+#define SIM_REORDER_DELAY 1000000LL
+
+Boolean doInit(PtpClock*);
+void doState(PtpClock*);
+void toState(UInteger8,PtpClock*);
+
+/** a packet, shared by all deliveries of one send */
+typedef struct {
+  Integer32 refs;
+  UInteger16 length;
+  Octet buf[PACKET_SIZE];
+} SimPacket;
+
+/** a packet waiting in a socket of a node */
+typedef struct SimRecv {
+  struct SimRecv *next;
+  SimPacket *packet;
+  TimeInternal stamp;
+} SimRecv;
+
+typedef struct {
+  SimRecv *head, *tail;
+  Integer32 count;
+} SimQueue;
+
+enum {
+  SIM_EVENT_SOCK,     /**< arrival of an event packet */
+  SIM_GENERAL_SOCK,   /**< arrival of a general packet */
+  SIM_TIMER,
+  SIM_SAMPLE,
+  SIM_START
+};
+
+typedef struct {
+  Integer64 time;
+  /** events at the same time are handled in the order of scheduling */
+  UInteger32 seq;
+  Integer32 node;
+  UInteger16 type, timer;
+  SimPacket *packet;
+} SimEvent;
+
+typedef struct {
+  PtpClock *clock;
+  char name[24];
+  SimQueue queue[2];
+  Boolean masterCapable;
+  /** time of the last sample off by more than the threshold, 0 if none */
+  Integer64 lastBad;
+  Boolean bad;
+} SimNode;
+
+static SimNode *nodes;
+static Integer32 nodeCount, current;
+static Integer64 now = SIM_MONOTONIC;
+
+static SimEvent *heap;
+static Integer32 heapSize, heapMax;
+static UInteger32 heapSeq;
+
+/* network */
+static Integer64 delay = 10000, asymmetry, jitter = 1000, stampJitter;
+static double loss, reorder;
+static Boolean fullMulticast;
+static UInteger32 seed = 1;
+
+/* statistics */
+static Integer64 threshold = 1000, warmup = -1;
+static Integer64 *samples;
+static Integer32 sampleCount, sampleMax;
+static Integer64 masterCpu;
+static UInteger32 masterSent, masterReceived;
+
+static double simUniform(void)
+{
+  return rand_r(&seed) / (RAND_MAX + 1.0);
+}
+
+static void heapPush(SimEvent *event)
+{
+  Integer32 i, parent;
+
+  if(heapSize == heapMax)
+  {
+    heapMax = heapMax ? heapMax * 2 : 1024;
+    if(!(heap = (SimEvent *)realloc(heap, heapMax * sizeof(SimEvent))))
+    {
+      PERROR("failed to allocate %d events", heapMax);
+      exit(2);
+    }
+  }
+
+  event->seq = heapSeq++;
+  for(i = heapSize++; i > 0; i = parent)
+  {
+    parent = (i - 1) / 2;
+    if(heap[parent].time < event->time ||
+       (heap[parent].time == event->time && heap[parent].seq < event->seq))
+      break;
+    heap[i] = heap[parent];
+  }
+  heap[i] = *event;
+}
+
+static void heapPop(SimEvent *event)
+{
+  SimEvent last = heap[--heapSize];
+  Integer32 i, child;
+
+  *event = heap[0];
+  for(i = 0; (child = 2 * i + 1) < heapSize; i = child)
+  {
+    if(child + 1 < heapSize &&
+       (heap[child + 1].time < heap[child].time ||
+        (heap[child + 1].time == heap[child].time && heap[child + 1].seq < heap[child].seq)))
+      ++child;
+    if(last.time < heap[child].time ||
+       (last.time == heap[child].time && last.seq < heap[child].seq))
+      break;
+    heap[i] = heap[child];
+  }
+  heap[i] = last;
+}
+
+static void schedule(Integer64 time, Integer32 node, UInteger16 type, UInteger16 timer, SimPacket *packet)
+{
+  SimEvent event;
+
+  event.time = time;
+  event.node = node;
+  event.type = type;
+  event.timer = timer;
+  event.packet = packet;
+  heapPush(&event);
+}
+
+static void releasePacket(SimPacket *packet)
+{
+  if(!--packet->refs)
+    free(packet);
+}
+
+static void enqueue(SimQueue *queue, SimPacket *packet, TimeInternal stamp)
+{
+  SimRecv *recv = (SimRecv *)malloc(sizeof(SimRecv));
+
+  if(!recv)
+  {
+    PERROR("failed to allocate a packet");
+    exit(2);
+  }
+  recv->next = NULL;
+  recv->packet = packet;
+  recv->stamp = stamp;
+  if(queue->tail)
+    queue->tail->next = recv;
+  else
+    queue->head = recv;
+  queue->tail = recv;
+  ++queue->count;
+}
+
+/* the next packet of 'queue' into 'buf', 0 if none */
+static ssize_t dequeue(SimQueue *queue, Octet *buf, TimeInternal *stamp)
+{
+  SimRecv *recv = queue->head;
+  ssize_t length;
+
+  if(!recv)
+    return 0;
+
+  if(!(queue->head = recv->next))
+    queue->tail = NULL;
+  --queue->count;
+
+  length = recv->packet->length;
+  memcpy(buf, recv->packet->buf, length);
+  if(stamp)
+    *stamp = recv->stamp;
+  releasePacket(recv->packet);
+  free(recv);
+
+  if(nodes[current].clock->port_state == PTP_MASTER)
+    ++masterReceived;
+  return length;
+}
+
+static Integer32 queued(SimNode *node)
+{
+  return node->queue[SIM_EVENT_SOCK].count + node->queue[SIM_GENERAL_SOCK].count;
+}
+
+/* receive time stamp of an event packet arriving at 'node' now */
+static TimeInternal stamp(SimNode *node)
+{
+  TimeInternal time = simClockRead(&node->clock->sim, now);
+
+  if(stampJitter)
+    time += (TimeInternal)(stampJitter * simGauss(&seed));
+  return time;
+}
+
+static Integer64 linkDelay(Integer32 from, Integer32 to)
+{
+  double d = delay;
+
+  if(nodes[from].masterCapable && !nodes[to].masterCapable)
+    d += asymmetry / 2.0;
+  else if(!nodes[from].masterCapable && nodes[to].masterCapable)
+    d -= asymmetry / 2.0;
+  if(jitter)
+    d -= jitter * log(1 - simUniform());
+  if(reorder && simUniform() < reorder)
+    d += SIM_REORDER_DELAY * simUniform();
+
+  return d > 0 ? (Integer64)d : 0;
+}
+
+static void deliver(Integer32 to, UInteger16 type, SimPacket *packet)
+{
+  if(loss && simUniform() < loss)
+    return;
+
+  ++packet->refs;
+  schedule(now + linkDelay(current, to), to, type, 0, packet);
+}
+
+/* multicast from the current node */
+static ssize_t simSend(UInteger16 type, Octet *buf, UInteger16 length)
+{
+  SimPacket *packet = (SimPacket *)malloc(sizeof(SimPacket));
+  SimNode *from = &nodes[current];
+  UInteger8 *uuid;
+  Integer32 i;
+
+  if(!packet || length > PACKET_SIZE)
+  {
+    ERROR("cannot send a packet of %d bytes\n", length);
+    free(packet);
+    return 0;
+  }
+  packet->refs = 1;
+  packet->length = length;
+  memcpy(packet->buf, buf, length);
+
+  if(from->clock->port_state == PTP_MASTER)
+    ++masterSent;
+
+  /* multicast loop back with the send time stamp */
+  if(type == SIM_EVENT_SOCK)
+  {
+    ++packet->refs;
+    enqueue(&from->queue[type], packet, stamp(from));
+  }
+
+  uuid = (UInteger8 *)buf + 50;
+  if(!fullMulticast && length >= DELAY_RESP_PACKET_LENGTH &&
+     *(UInteger8 *)(buf + 32) == PTP_DELAY_RESP_MESSAGE && uuid[0] == 0x02)
+  {
+    i = uuid[3] << 16 | uuid[4] << 8 | uuid[5];
+    if(i < nodeCount)
+      deliver(i, type, packet);
+  }
+  else
+  {
+    for(i = 0; i < nodeCount; i++)
+      if(i != current &&
+         (fullMulticast || from->masterCapable || nodes[i].masterCapable))
+        deliver(i, type, packet);
+  }
+
+  releasePacket(packet);
+  return length;
+}
+
+/* net.c */
+
+Boolean netInit(PtpClock *ptpClock)
+{
+  unsigned int a[SUBDOMAIN_ADDRESS_LENGTH];
+  int i;
+
+  memset(ptpClock->port_uuid_field, 0, PTP_UUID_LENGTH);
+  ptpClock->port_uuid_field[0] = 0x02;
+  ptpClock->port_uuid_field[3] = current >> 16;
+  ptpClock->port_uuid_field[4] = current >> 8;
+  ptpClock->port_uuid_field[5] = current;
+  ptpClock->port_communication_technology = PTP_ETHER;
+
+  sscanf(DEFAULT_PTP_DOMAIN_ADDRESS, "%u.%u.%u.%u", &a[0], &a[1], &a[2], &a[3]);
+  for(i = 0; i < SUBDOMAIN_ADDRESS_LENGTH; i++)
+    ptpClock->subdomain_address[i] = a[i];
+  *(Integer16*)ptpClock->event_port_address = PTP_EVENT_PORT;
+  *(Integer16*)ptpClock->general_port_address = PTP_GENERAL_PORT;
+
+  ptpClock->netPath.eventSock = ptpClock->netPath.generalSock = -1;
+  return TRUE;
+}
+
+Boolean netShutdown(PtpClock *ptpClock)
+{
+  SimNode *node = &nodes[current];
+  Octet buf[PACKET_SIZE];
+
+  while(queued(node))
+  {
+    dequeue(&node->queue[SIM_EVENT_SOCK], buf, NULL);
+    dequeue(&node->queue[SIM_GENERAL_SOCK], buf, NULL);
+  }
+  return TRUE;
+}
+
+int netSelect(TimeInternal *timeout, PtpClock *ptpClock)
+{
+  SimNode *node = &nodes[current];
+
+  return (node->queue[SIM_EVENT_SOCK].count ? EVENT_EVENT_SOCK : 0) |
+    (node->queue[SIM_GENERAL_SOCK].count ? EVENT_GENERAL_SOCK : 0);
+}
+
+ssize_t netRecvEvent(Octet *buf, TimeInternal *time, PtpClock *ptpClock)
+{
+  return dequeue(&nodes[current].queue[SIM_EVENT_SOCK], buf, time);
+}
+
+ssize_t netRecvGeneral(Octet *buf, PtpClock *ptpClock)
+{
+  return dequeue(&nodes[current].queue[SIM_GENERAL_SOCK], buf, NULL);
+}
+
+Boolean netRecvPending(PtpClock *ptpClock)
+{
+  return queued(&nodes[current]) > 0;
+}
+
+Boolean netEnableTimeStamping(int flags, PtpClock *ptpClock)
+{
+  return TRUE;
+}
+
+ssize_t netSendEvent(Octet *buf, UInteger16 length, PtpClock *ptpClock)
+{
+  return simSend(SIM_EVENT_SOCK, buf, length);
+}
+
+ssize_t netSendGeneral(Octet *buf, UInteger16 length, PtpClock *ptpClock)
+{
+  return simSend(SIM_GENERAL_SOCK, buf, length);
+}
+
+/* event.c */
+
+Boolean eventInit(PtpClock *ptpClock)
+{
+  return TRUE;
+}
+
+void eventShutdown(PtpClock *ptpClock)
+{
+}
+
+Boolean eventAdd(Integer32 fd, UInteger32 source, PtpClock *ptpClock)
+{
+  return TRUE;
+}
+
+int eventWait(TimeInternal *timeout, PtpClock *ptpClock)
+{
+  return netSelect(timeout, ptpClock);
+}
+
+/* timer.c: the timers expire through SIM_TIMER events */
+
+Boolean initTimer(PtpClock *ptpClock)
+{
+  int i;
+
+  for(i = 0; i < TIMER_ARRAY_SIZE; ++i)
+  {
+    ptpClock->itimer[i].interval = 0;
+    ptpClock->itimer[i].expire = FALSE;
+    ptpClock->itimer[i].fd = -1;
+  }
+  return TRUE;
+}
+
+void timerUpdate(IntervalTimer *itimer)
+{
+}
+
+void timerStop(UInteger16 index, IntervalTimer *itimer)
+{
+  if(index < TIMER_ARRAY_SIZE)
+    itimer[index].interval = 0;
+}
+
+void timerStart(UInteger16 index, Integer64 interval, IntervalTimer *itimer)
+{
+  if(index >= TIMER_ARRAY_SIZE)
+    return;
+
+  itimer[index].expire = FALSE;
+  itimer[index].interval = interval;
+  itimer[index].deadline = now + interval;
+  if(interval > 0)
+    schedule(itimer[index].deadline, current, SIM_TIMER, index, NULL);
+}
+
+Boolean timerExpired(UInteger16 index, IntervalTimer *itimer)
+{
+  if(index >= TIMER_ARRAY_SIZE || !itimer[index].expire)
+    return FALSE;
+
+  itimer[index].expire = FALSE;
+  return TRUE;
+}
+
+Boolean timerNext(TimeInternal *timeout, IntervalTimer *itimer)
+{
+  return FALSE;
+}
+
+Integer64 timerMonotonic(void)
+{
+  return now;
+}
+
+Boolean nanoSleep(TimeInternal *t)
+{
+  return TRUE;
+}
+
+void timerNow(TimeInternal *time)
+{
+  *time = simClockRead(&nodes[current].clock->sim, now);
+}
+
+/* the simulation */
+
+static Integer64 cpuTime(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return TIMESPEC_NSEC(ts);
+}
+
+/* run the protocol engine of node 'i' until it waits for something */
+static void runNode(Integer32 i)
+{
+  SimNode *node = &nodes[i];
+  PtpClock *ptpClock = node->clock;
+  Boolean master = ptpClock->port_state == PTP_MASTER;
+  Integer64 start = master ? cpuTime() : 0;
+  Integer32 before;
+
+  current = i;
+  for(;;)
+  {
+    if(ptpClock->port_state == PTP_INITIALIZING)
+    {
+      if(!doInit(ptpClock))
+        break;
+      continue;
+    }
+
+    before = queued(node);
+    doState(ptpClock);
+    if(ptpClock->message_activity)
+      continue;
+
+    timeNoActivity(ptpClock);
+    /* packets which the current state does not read stay queued */
+    if(ptpClock->port_state != PTP_INITIALIZING &&
+       (!queued(node) || queued(node) == before))
+      break;
+  }
+
+  if(master)
+    masterCpu += cpuTime() - start;
+}
+
+static void sample(void)
+{
+  SimNode *master = NULL;
+  TimeInternal reference, offset;
+  Integer32 i;
+
+  for(i = 0; i < nodeCount && !master; i++)
+    if(nodes[i].clock->port_state == PTP_MASTER)
+      master = &nodes[i];
+  if(!master)
+    return;
+
+  reference = simClockRead(&master->clock->sim, now);
+  for(i = 0; i < nodeCount; i++)
+  {
+    SimNode *node = &nodes[i];
+
+    if(node == master)
+      continue;
+
+    offset = simClockRead(&node->clock->sim, now) - reference;
+    node->bad = node->clock->port_state != PTP_SLAVE || llabs(offset) > threshold;
+    if(node->bad)
+      node->lastBad = now;
+
+    if(now - SIM_MONOTONIC >= warmup && node->clock->port_state == PTP_SLAVE)
+    {
+      if(sampleCount == sampleMax)
+      {
+        sampleMax = sampleMax ? sampleMax * 2 : 4096;
+        if(!(samples = (Integer64 *)realloc(samples, sampleMax * sizeof(Integer64))))
+        {
+          PERROR("failed to allocate %d samples", sampleMax);
+          exit(2);
+        }
+      }
+      samples[sampleCount++] = llabs(offset);
+    }
+  }
+}
+
+static int compare(const void *a, const void *b)
+{
+  Integer64 x = *(const Integer64 *)a, y = *(const Integer64 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static Integer64 percentile(Integer64 *values, Integer32 count, double p)
+{
+  return values[(Integer32)((count - 1) * p / 100 + 0.5)];
+}
+
+static void report(Integer64 duration, double wall)
+{
+  Integer64 *converged = (Integer64 *)malloc(nodeCount * sizeof(Integer64));
+  Integer32 i, count = 0, slaves = 0, states[PTP_SLAVE + 1];
+  double seconds = duration / 1e9;
+
+  memset(states, 0, sizeof(states));
+  for(i = 0; i < nodeCount; i++)
+  {
+    if(nodes[i].clock->port_state <= PTP_SLAVE)
+      ++states[nodes[i].clock->port_state];
+    if(nodes[i].clock->port_state == PTP_MASTER)
+      continue;
+    ++slaves;
+    if(!nodes[i].bad && converged)
+      converged[count++] = nodes[i].lastBad ?
+        nodes[i].lastBad + SIM_SAMPLE_INTERVAL - SIM_MONOTONIC : 0;
+  }
+
+  printf("nodes %d, simulated %.0fs in %.2fs (%.0fx real time)\n",
+         nodeCount, seconds, wall, wall > 0 ? seconds / wall : 0.0);
+  printf("states: %d master, %d slave, %d uncalibrated, %d other\n",
+         states[PTP_MASTER], states[PTP_SLAVE], states[PTP_UNCALIBRATED],
+         nodeCount - states[PTP_MASTER] - states[PTP_SLAVE] - states[PTP_UNCALIBRATED]);
+
+  if(count)
+  {
+    qsort(converged, count, sizeof(Integer64), compare);
+    printf("converged to %lldns: %d of %d, after %.0fs (median) %.0fs (90%%) %.0fs (max)\n",
+           threshold, count, slaves,
+           percentile(converged, count, 50) / 1e9,
+           percentile(converged, count, 90) / 1e9,
+           converged[count - 1] / 1e9);
+  }
+  else
+    printf("converged to %lldns: 0 of %d\n", threshold, slaves);
+  free(converged);
+
+  if(sampleCount)
+  {
+    qsort(samples, sampleCount, sizeof(Integer64), compare);
+    printf("offset after %.0fs [ns]: %lld (50%%) %lld (90%%) %lld (99%%) %lld (99.9%%) %lld (max), %d samples\n",
+           warmup / 1e9,
+           percentile(samples, sampleCount, 50), percentile(samples, sampleCount, 90),
+           percentile(samples, sampleCount, 99), percentile(samples, sampleCount, 99.9),
+           samples[sampleCount - 1], sampleCount);
+  }
+
+  printf("master: %.1fus CPU per second (%.4f%% of a core), %.1f packets sent, %.1f received per second\n",
+         masterCpu / 1e3 / seconds, masterCpu / 1e7 / seconds,
+         masterSent / seconds, masterReceived / seconds);
+}
+
+static void usage(void)
+{
+  printf(
+"\nUsage:  ptpsim [OPTION]\n\n"
+"-n NUMBER         simulate NUMBER slaves (default 1)\n"
+"-M NUMBER         and NUMBER master capable nodes (default 1)\n"
+"-t NUMBER         for NUMBER seconds (default 600)\n"
+"-k NUMBER         steady state begins after NUMBER seconds (default half of -t)\n"
+"-c NUMBER         converged when within NUMBER nsec of the master (default 1000)\n"
+"-r NUMBER         seed of the random numbers\n"
+"\n"
+"-D NUMBER         one-way delay in nsec (default 10000)\n"
+"-A NUMBER         master to slave minus slave to master delay in nsec\n"
+"-J NUMBER         mean queuing delay in nsec (default 1000)\n"
+"-l NUMBER         lose NUMBER percent of the packets\n"
+"-R NUMBER         reorder NUMBER percent of the packets\n"
+"-m                deliver all packets to all nodes\n"
+"\n"
+"-o NUMBER         initial clock offsets up to NUMBER nsec (default 1000000)\n"
+"-d NUMBER         oscillator drift up to NUMBER ppb (default 10000)\n"
+"-w NUMBER         oscillator wander in ppb/sqrt(s) (default 1)\n"
+"-s NUMBER         standard deviation of the time stamps in nsec\n"
+"\n"
+"-y NUMBER         sync interval in 2^NUMBER sec (default 1)\n"
+"-a NUMBER,NUMBER  clock servo P and I attenuations\n"
+"-S NAME           clock servo, see ptpd -S\n"
+"-x                never step the clocks of the slaves, see ptpd -x\n"
+"-X                step them only before their first correction\n"
+"-T NUMBER         step them if off by NUMBER nsec or more\n"
+"-L NUMBER         correct their frequency by at most NUMBER ppb\n"
+"-U NUMBER         estimate the frequency from NUMBER Syncs, see ptpd -U\n"
+"-H NUMBER         holdover for up to NUMBER seconds, see ptpd -H\n"
+"\n"
+  );
+}
+
+int main(int argc, char **argv)
+{
+  RunTimeOpts rtOpts;
+  Integer32 slaves = 1, masters = 1, i;
+  Integer64 duration = 600000000000LL, maxOffset = 1000000;
+  double drift = 10000, wander = 1;
+  struct timespec start, end;
+  SimEvent event;
+  IntervalTimer *itimer;
+  int c;
+
+  memset(&rtOpts, 0, sizeof(rtOpts));
+  ptpdDefaults(&rtOpts);
+
+  while((c = getopt(argc, argv, "?n:M:t:k:c:r:D:A:J:l:R:mo:d:w:s:y:a:S:xXT:L:U:H:")) != -1) {
+    switch(c) {
+    case 'n':
+      slaves = strtol(optarg, 0, 0);
+      break;
+
+    case 'M':
+      masters = strtol(optarg, 0, 0);
+      break;
+
+    case 't':
+      duration = strtoll(optarg, 0, 0) * 1000000000LL;
+      break;
+
+    case 'k':
+      warmup = strtoll(optarg, 0, 0) * 1000000000LL;
+      break;
+
+    case 'c':
+      threshold = strtoll(optarg, 0, 0);
+      break;
+
+    case 'r':
+      seed = strtoul(optarg, 0, 0);
+      break;
+
+    case 'D':
+      delay = strtoll(optarg, 0, 0);
+      break;
+
+    case 'A':
+      asymmetry = strtoll(optarg, 0, 0);
+      break;
+
+    case 'J':
+      jitter = strtoll(optarg, 0, 0);
+      break;
+
+    case 'l':
+      loss = strtod(optarg, 0) / 100;
+      break;
+
+    case 'R':
+      reorder = strtod(optarg, 0) / 100;
+      break;
+
+    case 'm':
+      fullMulticast = TRUE;
+      break;
+
+    case 'o':
+      maxOffset = strtoll(optarg, 0, 0);
+      break;
+
+    case 'd':
+      drift = strtod(optarg, 0);
+      break;
+
+    case 'w':
+      wander = strtod(optarg, 0);
+      break;
+
+    case 's':
+      stampJitter = strtoll(optarg, 0, 0);
+      break;
+
+    case 'y':
+      rtOpts.syncInterval = strtol(optarg, 0, 0);
+      break;
+
+    case 'a':
+      rtOpts.ap = strtol(optarg, &optarg, 0);
+      if(optarg[0])
+        rtOpts.ai = strtol(optarg+1, 0, 0);
+      break;
+
+    case 'S':
+      for(i = 0; i < SERVO_MAX; i++)
+        if(!strcasecmp(optarg, findServo(i)->name))
+          break;
+      if(i == SERVO_MAX) {
+        ERROR("Unsupported -S servo '%s'.\n", optarg);
+        return 1;
+      }
+      rtOpts.servo = i;
+      break;
+
+    case 'x':
+      rtOpts.noResetClock = TRUE;
+      break;
+
+    case 'X':
+      rtOpts.stepFirstOnly = TRUE;
+      break;
+
+    case 'T':
+      rtOpts.stepThreshold = strtoll(optarg, 0, 0);
+      if(rtOpts.stepThreshold < 1)
+        rtOpts.stepThreshold = 1;
+      break;
+
+    case 'L':
+      rtOpts.maxSlew = strtol(optarg, 0, 0);
+      if(rtOpts.maxSlew < 1 || rtOpts.maxSlew > ADJ_FREQ_MAX)
+        rtOpts.maxSlew = ADJ_FREQ_MAX;
+      break;
+
+    case 'U':
+      rtOpts.calibrationSyncs = strtol(optarg, 0, 0);
+      if(rtOpts.calibrationSyncs < 0)
+        rtOpts.calibrationSyncs = 0;
+      else if(rtOpts.calibrationSyncs > MAX_CALIBRATION_SYNCS)
+        rtOpts.calibrationSyncs = MAX_CALIBRATION_SYNCS;
+      break;
+
+    case 'H':
+      rtOpts.holdover = strtol(optarg, 0, 0);
+      if(rtOpts.holdover < 0)
+        rtOpts.holdover = 0;
+      break;
+
+    default:
+      usage();
+      return c == '?' ? 0 : 1;
+    }
+  }
+
+  if(optind != argc || slaves < 0 || masters < 1 || duration <= 0) {
+    usage();
+    return 1;
+  }
+  if(warmup < 0)
+    warmup = duration / 2;
+
+  nodeCount = masters + slaves;
+  if(!(nodes = (SimNode *)calloc(nodeCount, sizeof(SimNode)))) {
+    PERROR("failed to allocate %d nodes", nodeCount);
+    return 2;
+  }
+
+  rtOpts.time = TIME_SIM;
+  for(i = 0; i < nodeCount; i++) {
+    SimNode *node = &nodes[i];
+    PtpClock *ptpClock = (PtpClock *)calloc(1, sizeof(PtpClock));
+
+    if(!ptpClock ||
+       !(ptpClock->foreign = (ForeignMasterRecord *)calloc(rtOpts.max_foreign_records, sizeof(ForeignMasterRecord)))) {
+      PERROR("failed to allocate node %d", i);
+      return 2;
+    }
+    node->clock = ptpClock;
+    node->masterCapable = i < masters;
+    snprintf(node->name, sizeof(node->name), "node%d: ", i);
+    ptpClock->name = node->name;
+    ptpClock->runTimeOpts = rtOpts;
+    ptpClock->runTimeOpts.slaveOnly = !node->masterCapable;
+
+    ptpClock->sim.last = now;
+    ptpClock->sim.time = SIM_EPOCH + (Integer64)((2 * simUniform() - 1) * maxOffset);
+    ptpClock->sim.drift = (2 * simUniform() - 1) * drift;
+    ptpClock->sim.wander = wander;
+    ptpClock->sim.seed = rand_r(&seed);
+
+    schedule(now + (Integer64)(SIM_START_SPREAD * simUniform()), i, SIM_START, 0, NULL);
+  }
+  schedule(now + SIM_SAMPLE_INTERVAL, 0, SIM_SAMPLE, 0, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while(heapSize && heap[0].time <= SIM_MONOTONIC + duration) {
+    heapPop(&event);
+    now = event.time;
+
+    switch(event.type) {
+    case SIM_EVENT_SOCK:
+    case SIM_GENERAL_SOCK:
+      enqueue(&nodes[event.node].queue[event.type], event.packet,
+              event.type == SIM_EVENT_SOCK ? stamp(&nodes[event.node]) : 0);
+      runNode(event.node);
+      break;
+
+    case SIM_TIMER:
+      itimer = &nodes[event.node].clock->itimer[event.timer];
+      /* stopped or restarted since */
+      if(itimer->interval <= 0 || itimer->deadline != now)
+        break;
+      itimer->expire = TRUE;
+      itimer->deadline += itimer->interval;
+      schedule(itimer->deadline, event.node, SIM_TIMER, event.timer, NULL);
+      runNode(event.node);
+      break;
+
+    case SIM_SAMPLE:
+      sample();
+      schedule(now + SIM_SAMPLE_INTERVAL, 0, SIM_SAMPLE, 0, NULL);
+      break;
+
+    case SIM_START:
+      current = event.node;
+      toState(PTP_INITIALIZING, nodes[event.node].clock);
+      runNode(event.node);
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  report(duration, (TIMESPEC_NSEC(end) - TIMESPEC_NSEC(start)) / 1e9);
+  return 0;
+}
@@ -0,0 +1,219 @@
+/* servocmp.c */
+
+#include "ptpd.h"
+
+#include <math.h>
+
+/*
+ * Replays the input of a clock servo recorded with "ptpd -O FILE"
+ * through every servo of servo.c and compares the offsets from master
+ * which they would have achieved.
+ *
+ * Each line of the recording holds local time, offset from master
+ * (both nsec), the frequency adjustment (ppb) applied afterwards, 1
+ * if the clock was stepped instead and the last unfiltered master to
+ * slave and slave to master delays (nsec). The delays are shifted by
+ * the difference between simulated and recorded offset; a changed
+ * slave to master delay is passed to the delay hook of the servos as
+ * if measured at the time of the line. Integrating the adjustments and
+ * steps yields the phase of the free running clock. Every servo then
+ * steers its own virtual clock against that phase, open loop: its
+ * offsets are what the recorded clock minus the recorded corrections
+ * plus its own corrections would have shown. Filtering of the offsets
+ * in updateOffset() and noise which depended on the real corrections
+ * are not reproduced.
+ */
+
+typedef struct {
+  const ClockServo *servo;
+  PtpClock clock;
+  /** integral of the frequency corrections and steps of the virtual clock */
+  TimeInternal correction;
+  Integer32 adj;
+  /* statistics */
+  double sumSquares;
+  TimeInternal maxOffset;
+  UInteger32 samples, steps;
+  Boolean locked;
+  UInteger32 lockedAt;
+} ServoRun;
+
+static void usage(void)
+{
+  printf(
+"\nUsage:  servocmp [OPTION] FILE\n\n"
+"-a NUMBER,NUMBER  specify clock servo P and I attenuations\n"
+"-w NUMBER         samples in the window of the linreg servo\n"
+"-T NUMBER         step if off by NUMBER nsec or more (default 1000000000)\n"
+"-k NUMBER         skip the first NUMBER samples in the statistics\n"
+"-p                print the offset of every servo for every sample\n"
+"\n"
+  );
+}
+
+static void account(ServoRun *run, TimeInternal offset, UInteger32 line, UInteger32 skip)
+{
+  if(line < skip)
+    return;
+
+  run->sumSquares += (double)offset * offset;
+  if(llabs(offset) > run->maxOffset)
+    run->maxOffset = llabs(offset);
+  ++run->samples;
+}
+
+static void report(const char *name, ServoRun *run)
+{
+  printf("%-10s %8u %12.0f %12lld %6u",
+         name, run->samples,
+         run->samples ? sqrt(run->sumSquares / run->samples) : 0.0,
+         run->maxOffset, run->steps);
+  if(run->servo)
+    printf(" %8u", run->locked ? run->lockedAt : 0);
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  ServoRun runs[SERVO_MAX], recorded;
+  Integer32 ap = DEFAULT_AP, ai = DEFAULT_AI, window = DEFAULT_SERVO_WINDOW;
+  Integer64 threshold = DEFAULT_STEP_THRESHOLD;
+  UInteger32 skip = 0, line = 0;
+  Boolean print = FALSE;
+  TimeInternal time, prevTime = 0, offset, correction = 0, phase;
+  TimeInternal m2s, s2m, prevS2m = 0;
+  Integer32 adj, prevAdj = 0;
+  int c, i, step, fields;
+  char buffer[256];
+  FILE *in;
+
+  while((c = getopt(argc, argv, "?a:w:T:k:p")) != -1) {
+    switch(c) {
+    case 'a':
+      ap = strtol(optarg, &optarg, 0);
+      if(optarg[0])
+        ai = strtol(optarg+1, 0, 0);
+      break;
+
+    case 'w':
+      window = strtol(optarg, 0, 0);
+      break;
+
+    case 'T':
+      threshold = strtoll(optarg, 0, 0);
+      break;
+
+    case 'k':
+      skip = strtoul(optarg, 0, 0);
+      break;
+
+    case 'p':
+      print = TRUE;
+      break;
+
+    default:
+      usage();
+      return c == '?' ? 0 : 1;
+    }
+  }
+
+  if(optind != argc - 1) {
+    usage();
+    return 1;
+  }
+
+  if(!(in = fopen(argv[optind], "r"))) {
+    PERROR("could not open %s", argv[optind]);
+    return 1;
+  }
+
+  memset(&recorded, 0, sizeof(recorded));
+  memset(runs, 0, sizeof(runs));
+  for(i = 0; i < SERVO_MAX; i++) {
+    runs[i].servo = findServo(i);
+    runs[i].clock.name = "";
+    runs[i].clock.runTimeOpts.servo = i;
+    runs[i].clock.runTimeOpts.servoWindow = window;
+    runs[i].clock.runTimeOpts.ap = ap;
+    runs[i].clock.runTimeOpts.ai = ai;
+    runs[i].clock.runTimeOpts.maxSlew = DEFAULT_MAX_SLEW;
+    runs[i].clock.servo = runs[i].servo;
+    runs[i].servo->reset(&runs[i].clock);
+  }
+
+  while(fgets(buffer, sizeof(buffer), in)) {
+    m2s = s2m = 0;
+    fields = sscanf(buffer, "%lld %lld %d %d %lld %lld",
+                    &time, &offset, &adj, &step, &m2s, &s2m);
+    if(fields < 4)
+      continue;
+
+    /* the phase of the free running clock */
+    if(line)
+      correction += (Integer64)prevAdj * (time - prevTime) / 1000000000;
+    phase = offset + correction;
+    account(&recorded, offset, line, skip);
+    if(step) {
+      correction += offset;
+      ++recorded.steps;
+    }
+
+    if(print)
+      printf("%lld %lld", time, offset);
+
+    for(i = 0; i < SERVO_MAX; i++) {
+      ServoRun *run = &runs[i];
+      TimeInternal simOffset;
+
+      if(line)
+        run->correction += (Integer64)run->adj * (time - prevTime) / 1000000000;
+      simOffset = phase - run->correction;
+      if(print)
+        printf(" %lld", simOffset);
+      account(run, simOffset, line, skip);
+
+      run->clock.master_to_slave_delay = m2s + simOffset - offset;
+      if(s2m != prevS2m && run->servo->delay)
+        run->servo->delay(s2m - simOffset + offset, time, &run->clock);
+
+      if(llabs(simOffset) >= threshold) {
+        /* step like updateClock() */
+        run->correction += simOffset;
+        run->adj = 0;
+        run->clock.observed_drift = 0;
+        run->servo->reset(&run->clock);
+        ++run->steps;
+        run->locked = FALSE;
+        continue;
+      }
+
+      if(run->servo->sample(simOffset, time, run->clock.runTimeOpts.maxSlew,
+                            &run->adj, &run->clock) == SERVO_LOCKED &&
+         !run->locked) {
+        run->locked = TRUE;
+        run->lockedAt = line;
+      }
+    }
+    if(print)
+      printf("\n");
+
+    prevTime = time;
+    prevAdj = adj;
+    prevS2m = s2m;
+    ++line;
+  }
+  fclose(in);
+
+  if(!line) {
+    ERROR("no samples in %s\n", argv[optind]);
+    return 1;
+  }
+
+  printf("%-10s %8s %12s %12s %6s %8s\n",
+         "servo", "samples", "rms[ns]", "max[ns]", "steps", "locked@");
+  report("recorded", &recorded);
+  for(i = 0; i < SERVO_MAX; i++)
+    report(runs[i].servo->name, &runs[i]);
+
+  return 0;
+}